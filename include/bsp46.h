@@ -223,6 +223,33 @@ namespace k
 		bool enclosedInSolid;
 	} q3BspTrace;
 
+	/**
+	 * State of a trace, kept out of the
+	 * bsp so traces can run on many threads.
+	 */
+	typedef struct
+	{
+		q3BspTrace result;
+
+		vector3 start;
+		vector3 end;
+		float radius;
+
+		// @see Q3_TRACE_TYPE
+		int type;
+		int flags;
+	} q3BspTraceWork;
+
+	/**
+	 * Deformed copy of a face or patch vertices, kept
+	 * while the bsp is loaded.
+	 */
+	typedef struct
+	{
+		deformSurface_t* surface;
+		q3BspVertex* vertices;
+	} q3BspDeformCache;
+
 	class DLL_EXPORT bezierPatch
 	{
 		protected:
@@ -414,14 +441,6 @@ namespace k
 			int* mLeafFaces;
 			int* mLeafBrushes;
 
-			/**
-			 * For collision checking
-			 */
-			q3BspTrace mTempTrace;
-			vector3 mTraceStart, mTraceEnd;
-			float mTraceRadius;
-			int mTraceType, mTraceFlags;
-
 			/**
 			 * Game entities
 			 */
@@ -460,6 +479,16 @@ namespace k
 			 */
 			bool mDrawLightmaps;
 
+			/**
+			 * Deformed vertices, by the first source vertex.
+			 */
+			std::map<const q3BspVertex*, q3BspDeformCache> mDeformCache;
+
+			/**
+			 * Camera of the current draw, autosprites face it.
+			 */
+			const camera* mViewer;
+
 			/**
 			 * Vertex Buffer Objects
 			 */
@@ -481,6 +510,30 @@ namespace k
 			 */
 			void _parseEntities(char* str);
 
+			/**
+			 * Run the material deforms over count vertices, returns
+			 * the deformed copy to draw instead of the source.
+			 */
+			const q3BspVertex* _deformVertices(const material* mat, const q3BspVertex* source, unsigned int count);
+
+			/**
+			 * Walk the tree from a node, returns true if the box touches
+			 * a leaf visible from the cluster.
+			 */
+			bool _isBoxVisible(int node, const vector3& mins, const vector3& maxs, int cluster) const;
+
+			/**
+			 * Run a trace from the tree root.
+			 */
+			void _traceWork(q3BspTraceWork& work) const;
+
+			/**
+			 * Walk the tree from a node, collecting the brushes (matching
+			 * flags) of the leaves touched by the box.
+			 */
+			void _collectBrushes(int node, const vector3& mins, const vector3& maxs, 
+				int flags, std::vector<int>& brushes) const;
+
 			/**
 			 * Correctly loaded.
 			 */
@@ -523,6 +576,7 @@ namespace k
 				mBspVisData.bitSet = NULL;
 
 				mDrawLightmaps = true;
+				mViewer = NULL;
 
 				// VBOS
 			 	mVBOVertex = 0;
@@ -557,13 +611,26 @@ namespace k
 			 * article of Nathan Ostgard, iD quake 3
 			 * and my own toughs.
 			 */
-			void checkBrush(const q3BspBrush* brush);
-			void checkNode(int index, const float startFraction, const float endFraction,
-					const vector3& start, const vector3& end);
+			void checkBrush(const q3BspBrush* brush, q3BspTraceWork& work) const;
+			void checkNode(q3BspTraceWork& work, int index, const float startFraction, 
+					const float endFraction, const vector3& start, const vector3& end) const;
 
 			q3BspTrace trace(const vector3& start, const vector3& end, int flags = 0);
 			q3BspTrace traceSphere(const vector3& start, const vector3& end, float radius, int flags = 0);
 
+			/**
+			 * Scene queries, @see world::traceSegment
+			 */
+			bool traceSegment(const vector3& start, const vector3& end, vec_t radius, 
+				int flags, vec_t& fraction, vector3& normal);
+
+			/**
+			 * Batched segment traces, @see world::traceSegments. Segments are only
+			 * tested against the brushes of the leaves touched by their bounds.
+			 */
+			void traceSegments(const vector3* starts, const vector3* ends, unsigned int count,
+				int flags, vec_t* fractions, vector3* normals);
+
 			/**
 			 * Rendering awesomeness
 			 */
@@ -571,6 +638,12 @@ namespace k
 			bool isClusterVisible(int curr, int targ) const;
 			int findLeaf(const vector3& viewerPos) const;
 
+			/**
+			 * Returns true if any leaf touched by the box is
+			 * on a cluster visible from the viewer cluster.
+			 */
+			bool isBoxVisible(const vector3& mins, const vector3& maxs, const camera* viewer) const;
+
 			/**
 			 * Load a bsp file
 			 */
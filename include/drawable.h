@@ -30,6 +30,8 @@ THE SOFTWARE.
 
 namespace k 
 {
+	class ray;
+
 	/**
 	 * \brief A 2D Rectangle.
 	 */
@@ -364,6 +366,12 @@ namespace k
 			 */
 			const vector3& getMaxs() const;
 
+			/**
+			 * Return the axis aligned box containing this box
+			 * scaled, rotated and translated.
+			 */
+			boundingBox transform(const vector3& position, const quaternion& orientation, const vector3& scale) const;
+
 			/**
 			 * Draw the bounding box edges.
 			 */
@@ -499,6 +507,24 @@ namespace k
 
 			virtual void draw() = 0;
 
+			/**
+			 * Return true if the drawable needs to be prepared
+			 * (animations, skinning) before each draw.
+			 */
+			virtual bool isAnimated() const
+			{
+				return false;
+			}
+
+			/**
+			 * Prepare the drawable data for the next draw. The renderer
+			 * calls this from worker threads, so it must only touch
+			 * the drawable own data.
+			 */
+			virtual void prepare()
+			{
+			}
+
 			/**
 			 * Return true if the drawable is opaque (its material doesnt have any transparency).
 			 */
@@ -513,6 +539,14 @@ namespace k
 			 * Return drawable bounding box.
 			 */
 			virtual boundingBox getBoundingBox() const = 0;
+
+			/**
+			 * Trace a ray against this drawable. The default test is against
+			 * the axis aligned box, models override it to test their triangles.
+			 * On collision the ray fraction, normal and surface describe the
+			 * closest hit.
+			 */
+			virtual bool trace(ray& traceRay);
 	};
 }
 
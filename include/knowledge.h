@@ -48,6 +48,7 @@ THE SOFTWARE.
 #include "rendersystem.h"
 #include "resourceManager.h"
 #include "root.h"
+#include "simd.h"
 #include "singleton.h"
 #include "sprite.h"
 #include "sticker.h"
@@ -59,6 +60,7 @@ THE SOFTWARE.
 #include "tinyxml.h"
 #include "vector2.h"
 #include "vector3.h"
+#include "workerPool.h"
 #include "world.h"
 
 // Platform Files
@@ -25,6 +25,7 @@ THE SOFTWARE.
 
 #include "prerequisites.h"
 #include "color.h"
+#include "matrix4.h"
 #include "texture.h"
 #include "wii/tev.h"
 
@@ -55,6 +56,128 @@ namespace k
 		TEXENV_MAX_ENV
 	};
 
+	/**
+	 * Number of stages a compiled material state describes.
+	 */
+	#define K_MAX_STATE_STAGES 8
+
+	/**
+	 * Compiled fixed function state of a material stage.
+	 */
+	typedef struct
+	{
+		bool textured;
+		unsigned int texEnv;
+		TextureCoordType coordType;
+
+		// Stage loads its own texture matrix on draw
+		bool textureMatrix;
+	} stageState_t;
+
+	/**
+	 * Program generated for a material stage configuration,
+	 * @see materialManager::getProgram.
+	 */
+	struct materialProgram_t;
+
+	/**
+	 * \brief Immutable fixed function state of a material.
+	 * Compiled once from the material and its stages, render systems
+	 * apply it as a difference from the state they have bound.
+	 */
+	typedef struct
+	{
+		color ambient;
+		color diffuse;
+		color specular;
+
+		CullMode cull;
+
+		bool depthTest;
+		bool depthWrite;
+
+		bool blend;
+		unsigned short blendSrc, blendDst;
+
+		unsigned int stagesCount;
+		stageState_t stages[K_MAX_STATE_STAGES];
+	} materialState_t;
+
+	/**
+	 * Periodic functions used by vertex deforms.
+	 */
+	enum WaveFunction
+	{
+		WAVE_SIN,
+		WAVE_TRIANGLE,
+		WAVE_SQUARE,
+		WAVE_SAWTOOTH,
+		WAVE_INVERSE_SAWTOOTH
+	};
+
+	/**
+	 * Wave description, value = base + amplitude * func(phase + time * frequency).
+	 */
+	typedef struct
+	{
+		WaveFunction function;
+		vec_t base;
+		vec_t amplitude;
+		vec_t phase;
+		vec_t frequency;
+	} waveForm_t;
+
+	/**
+	 * Vertex deformation types (deformVertexes).
+	 */
+	enum DeformType
+	{
+		DEFORM_WAVE,
+		DEFORM_BULGE,
+		DEFORM_MOVE,
+		DEFORM_AUTOSPRITE
+	};
+
+	/**
+	 * A single vertex deformation of a material.
+	 */
+	typedef struct
+	{
+		DeformType type;
+		waveForm_t wave;
+
+		// Wave phase added per world unit (1 / div)
+		vec_t spread;
+
+		// Bulge width, height and speed
+		vec_t bulge[3];
+
+		// Move direction
+		vector3 move;
+	} materialDeform_t;
+
+	/**
+	 * \brief Vertices fed to material::deform.
+	 * Arrays are split per component so the deform kernels can
+	 * work on four vertices at a time. The caller fills position,
+	 * normal and uv, output receives the deformed positions.
+	 */
+	typedef struct
+	{
+		unsigned int count;
+
+		vec_t* position[3];
+		vec_t* normal[3];
+		vec_t* uv[2];
+		vec_t* output[3];
+
+		// Per vertex wave values
+		vec_t* scratch;
+
+		// Time output was last deformed at
+		float time;
+	} deformSurface_t;
+
 	/**
 	 * \brief The material (texture) stage.
 	 * Each material has a number of sub-texture stages, wich
@@ -66,17 +189,28 @@ namespace k
 			vector2 mScale;
 
 			/**
-			 * Texture scrolling.
+			 * Texture scrolling, per second and at frame time.
 			 */
 			vector2 mScroll;
 			vector2 mScrolled;
 
 			/**
-			 * Texture rotation.
+			 * Texture rotation (degrees), per second and at frame time.
 			 */
 			float mAngle;
 			float mRotate;
 
+			/**
+			 * Texture matrix cached for the frame time it was built.
+			 */
+			matrix4 mTextureMatrix;
+			long mMatrixTime;
+
+			/**
+			 * Evaluate scroll, rotation and the texture matrix at time.
+			 */
+			void _updateTransform(long time);
+
 			/**
 			 * Texture coordinate type, check @TextureCoordType
 			 */
@@ -129,6 +263,12 @@ namespace k
 			 */
 			vec_t mCurrentFrame;
 
+			/**
+			 * Set when a change must reach the material
+			 * compiled state, cleared by compileState.
+			 */
+			bool mStateChanged;
+
 		public:
 
 			/**
@@ -205,10 +345,28 @@ namespace k
 			bool isOpaque() const;
 
 			/**
-			 * Used internally to force current frame calculation.
+			 * Used internally to evaluate the stage animation, once
+			 * per frame from the renderer frame time.
 			 */
 			void feedAnims();
 
+			/**
+			 * Returns the texture matrix evaluated for the current frame.
+			 */
+			const matrix4& getTextureMatrix() const
+			{
+				return mTextureMatrix;
+			}
+
+			/**
+			 * Does this stage load its own texture matrix?
+			 */
+			bool hasTextureMatrix() const
+			{
+				return mCoordType == TEXCOORD_UV && 
+					(mRotate || mScroll.x || mScroll.y || mScale.x || mScale.y);
+			}
+
 			/**
 			 * Is this stage animated?
 			 */
@@ -263,14 +421,26 @@ namespace k
 			const texture* getTexture(unsigned int index) const;
 
 			/**
-			 * Start drawing this stage.
+			 * Did the stage change since its state was compiled?
 			 */
-			void draw();
+			bool isStateChanged() const
+			{
+				return mStateChanged;
+			}
 
 			/**
-			 * Finish drawing this stage.
+			 * Fill the compiled state of this stage.
+			 * @param state The material state being compiled.
+			 * @param slot Stage slot on the state.
 			 */
-			void finish();
+			void compileState(materialState_t& state, unsigned int slot);
+
+			/**
+			 * Start drawing this stage. Only the texture and its matrix
+			 * are set here, the remaining state comes from the material
+			 * compiled state.
+			 */
+			void draw();
 	};
 
 	/**
@@ -305,6 +475,34 @@ namespace k
 			int mEffectFlags;
 
 			std::vector<materialStage*> mStages;
+			std::vector<materialDeform_t> mDeforms;
+
+			/**
+			 * Evaluate a wave into values, in place over
+			 * cycle fractions in [0, 1).
+			 */
+			void _evalWave(vec_t* values, const waveForm_t& wave, unsigned int count) const;
+
+			/**
+			 * Compiled render state, rebuilt when the material changes.
+			 */
+			materialState_t mState;
+			bool mStateCompiled;
+
+			/**
+			 * Generated program used by the last start(), resolved again
+			 * when the lightmap or lighting usage changes.
+			 */
+			materialProgram_t* mProgram;
+			bool mProgramResolved;
+			bool mProgramLightmap;
+			bool mProgramLit;
+
+			/**
+			 * start() bound mProgram, finish() unbinds it. Programs
+			 * bound by others (like md5 skinning) are left alone.
+			 */
+			bool mProgramBound;
 
 		public:
 			/**
@@ -334,6 +532,7 @@ namespace k
 			void setAmbient(const color& clr)
 			{
 				mAmbient = clr;
+				mStateCompiled = false;
 			}
 
 			/**
@@ -343,6 +542,7 @@ namespace k
 			void setDiffuse(const color& clr)
 			{
 				mDiffuse = clr;
+				mStateCompiled = false;
 			}
 
 			/**
@@ -352,6 +552,7 @@ namespace k
 			void setSpecular(const color& clr)
 			{
 				mSpecular = clr;
+				mStateCompiled = false;
 			}
 
 			/**
@@ -361,6 +562,7 @@ namespace k
 			void setCullMode(CullMode cull)
 			{
 				mCull = cull;
+				mStateCompiled = false;
 			}
 
 			/**
@@ -369,6 +571,7 @@ namespace k
 			void setDepthTest(bool test)
 			{
 				mDepthTest = test;
+				mStateCompiled = false;
 			}
 
 			/**
@@ -377,6 +580,7 @@ namespace k
 			void setDepthWrite(bool test)
 			{
 				mDepthWrite = test;
+				mStateCompiled = false;
 			}
 
 			/**
@@ -417,6 +621,7 @@ namespace k
 			void pushStage(materialStage* stage)
 			{
 				mStages.push_back(stage);
+				mStateCompiled = false;
 			}
 
 			/**
@@ -501,12 +706,60 @@ namespace k
 			{ return mReceiveLight ? true : false; } 
 
 			/**
-			 * Set material stuff before drawing.
+			 * Add a vertex deformation, applied in the order pushed.
+			 */
+			void pushDeform(const materialDeform_t& deform)
+			{ mDeforms.push_back(deform); }
+
+			/**
+			 * Does this material deform its vertices?
+			 */
+			bool hasDeforms() const
+			{ return !mDeforms.empty(); }
+
+			/**
+			 * Allocate a deform surface for count vertices.
+			 */
+			static deformSurface_t* createDeformSurface(unsigned int count);
+
+			/**
+			 * Release a surface from createDeformSurface.
+			 */
+			static void destroyDeformSurface(deformSurface_t* surface);
+
+			/**
+			 * Deform surface positions into its output arrays.
+			 * @param time Frame time in seconds.
+			 * @param right Camera right axis, used by autosprites.
+			 * @param up Camera up axis, used by autosprites.
+			 * @return false if output is already up to date.
+			 */
+			bool deform(deformSurface_t* surface, float time, const vector3& right, const vector3& up) const;
+
+			/**
+			 * Compile the material and its stages into an immutable
+			 * state block. Called after parsing, and again on start()
+			 * when the material changed since.
+			 */
+			void compile();
+
+			/**
+			 * Returns the compiled material state.
+			 */
+			const materialState_t& getState() const
+			{ return mState; }
+
+			/**
+			 * Set material stuff before drawing. Only the state that
+			 * differs from the bound one is sent to the render system.
+			 * @param lightmap A lightmap will be bound on the unit after
+			 * the last stage, used to pick the material program.
 			 */
-			void start();
+			void start(bool lightmap = false);
 
 			/**
-			 * Unset material stuff after drawing.
+			 * Unset material stuff after drawing. State is left bound for
+			 * the next material to diff against, only lighting is restored.
 			 */
 			void finish();
 	};
@@ -33,6 +33,29 @@ namespace k
 	typedef std::list<std::string> materialList;
 	typedef std::map<std::string, material*> materialMap;
 
+	/**
+	 * Size of a material program configuration: stages count, lightmap,
+	 * lighting and two bytes per stage.
+	 */
+	#define MATERIAL_PROGRAM_CONFIG (3 + K_MAX_STATE_STAGES * 2)
+
+	/**
+	 * GLSL program generated for a material stage configuration. Tex envs,
+	 * texgen and the lightmap are combined in a single program, stage texture
+	 * matrices and the lights count are uniforms.
+	 */
+	struct materialProgram_t
+	{
+		platformProgram program;
+		int textureMatrices;
+		int lightsCount;
+
+		unsigned char config[MATERIAL_PROGRAM_CONFIG];
+		unsigned int configLength;
+	};
+
+	typedef std::map<unsigned int, materialProgram_t*> materialProgramMap;
+
 	/**
 	 * \brief The material manager.
 	 * This class is responsible for handling material creation, loading and parsing.
@@ -42,6 +65,18 @@ namespace k
 		private:
 			materialMap mMaterials;
 
+			/**
+			 * Generated programs by configuration hash, NULL
+			 * for configurations that failed to build.
+			 */
+			materialProgramMap mProgramCache;
+			bool mUsePrograms;
+
+			/**
+			 * Generate and link the program of a configuration.
+			 */
+			materialProgram_t* _genProgram(const materialState_t& state, bool lightmap, bool lit);
+
 		public:
 			materialManager();
 			~materialManager();
@@ -112,11 +147,37 @@ namespace k
 			 */
 			void createSystemMaterials();
 
+			/**
+			 * Draw materials with generated programs instead of fixed function
+			 * tex envs. Ignored when the render system has no program support,
+			 * so set it after the window is created.
+			 */
+			void setPrograms(bool enabled);
+
+			/**
+			 * Are materials drawn with generated programs?
+			 */
+			bool getPrograms() const
+			{
+				return mUsePrograms;
+			}
+
+			/**
+			 * Get the program for a compiled material state, generating it on
+			 * first use. Materials with the same stage configuration share it.
+			 * @param state The compiled material state.
+			 * @param lightmap A lightmap is bound after the last stage.
+			 * @param lit Fixed function lighting is enabled.
+			 * @return The program, NULL if it could not be built.
+			 */
+			materialProgram_t* getProgram(const materialState_t& state, bool lightmap, bool lit);
+
 			// Quake 3 Shaders
 			void parseQ3TextureSection(material* mat, parsingFile* file, unsigned short index);
 			void parseQ3MaterialScript(const std::string& filename, materialList* map = NULL);
 			void parseQ3MaterialScript(parsingFile* file, materialList* map = NULL);
 			void parseQ3Material(material* mat, parsingFile* file);
+			void parseQ3Wave(waveForm_t& wave, parsingFile* file);
 	};
 }
 
@@ -269,11 +269,12 @@ namespace k
 				{
 					for (unsigned int j = 0; j < 4; j++)
 					{
-						if (i == j && m[i][j] != 1.0)
-							return false;
-						else 
-							continue;
-
+						if (i == j)
+						{
+							if (m[i][j] != 1.0)
+								return false;
+						}
+						else
 						if (m[i][j] != 0)
 							return false;
 					}
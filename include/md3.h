@@ -28,6 +28,7 @@ THE SOFTWARE.
 #include "material.h"
 #include "timer.h"
 #include "ray.h"
+#include "simd.h"
 
 namespace k {
 
@@ -267,6 +268,37 @@ typedef struct
 	unsigned int framesPerSecond;
 } md3Animation_t;
 
+// Maximum triangles on a leaf of surface traces tree (one triangle4_t)
+#define MD3_BVH_LEAF_TRIANGLES 4
+
+// Surfaces with less triangles are traced without a tree
+#define MD3_BVH_MIN_TRIANGLES 16
+
+/**
+ * A node of the triangle tree used for tracing surfaces.
+ * Inner nodes have count zero, left child right after them
+ * and right child at first. Leaves have count triangles
+ * packed on the tree packet at first.
+ */
+typedef struct
+{
+	vector3 mins;
+	vector3 maxs;
+	unsigned int first;
+	unsigned int count;
+} md3BVHNode_t;
+
+/**
+ * Triangle tree of a surface frame. Triangle number
+ * of a packet lane is at triangles[packet * 4 + lane].
+ */
+typedef struct
+{
+	std::vector<md3BVHNode_t> nodes;
+	std::vector<unsigned int> triangles;
+	std::vector<triangle4_t> packets;
+} md3FrameBVH_t;
+
 /**
  * \brief A submesh contained in md3model.
  *
@@ -315,6 +347,34 @@ class DLL_EXPORT md3Surface
 		// Are We drawing normals?
 		bool mDrawNormals;
 
+		// Every frame, uvs and indices resident on GPU
+		bool mUploaded;
+		platformVBO mVertexVBO;
+		platformVBO mIndexVBO;
+
+		/**
+		 * Draw vertices normals as lines.
+		 */
+		void drawNormals(const md3RealVertex* vertices);
+
+		// Bounds of each frame (mins and maxs)
+		vector3* mFrameBounds;
+
+		// Triangle trees of each frame, built on first trace
+		md3FrameBVH_t** mFrameBVH;
+
+		/**
+		 * Build the triangle tree of a frame.
+		 */
+		md3FrameBVH_t* buildBVH(unsigned int frameNum);
+
+		/**
+		 * Test the ray against triangle and keep it if its closer
+		 * than the current closest hit.
+		 */
+		bool traceTriangle(ray& localRay, const md3RealVertex* vertices, unsigned int triangle, 
+			vec_t& closest, vector3& normal) const;
+
 	public:
 		/**
 		 * Constructor
@@ -353,6 +413,14 @@ class DLL_EXPORT md3Surface
 		 */
 		void setDrawNormals(bool draw);
 
+		/**
+		 * Upload all frames, uvs and indices to static
+		 * vertex buffers, so frames are drawn by offset.
+		 * Does nothing if VBOs are not supported.
+		 * @return true if the surface is resident on GPU.
+		 */
+		bool upload();
+
 		/**
 		 * Are we drawing normals?
 		 */
@@ -479,6 +547,22 @@ class DLL_EXPORT md3Surface
 		 */
 		void draw(short frameNum);
 
+		/**
+		 * Draw the model with vertices from outside
+		 * the surface (interpolated frames).
+		 * @vertices An array of getVertexCount() vertices.
+		 */
+		void drawVertices(const md3RealVertex* vertices);
+
+		/**
+		 * Interpolate positions and normals between two frames,
+		 * normals are renormalized.
+		 * @from First frame.
+		 * @to Second frame.
+		 * @fraction Interpolation factor [0, 1].
+		 * @out Destination array with getVertexCount() vertices.
+		 */
+		void interpolate(unsigned int from, unsigned int to, vec_t fraction, md3RealVertex* out) const;
 		/**
 		 * Set surface material.
 		 */
@@ -491,9 +575,37 @@ class DLL_EXPORT md3Surface
 		void setMaterial(const std::string& matName);
 
 		/**
-		 * Trace against this meshe triangles.
+		 * Calculate bounds of each frame. Must be called
+		 * after vertices and frame count are set.
 		 */
-		bool trace(ray& traceRay, short frameNum) const;
+		void calculateFrameBounds();
+
+		/**
+		 * Get the minimum of frame bounds.
+		 */
+		const vector3& getFrameMins(unsigned int frameNum) const
+		{
+			kAssert(mFrameBounds && frameNum < mFrameCount);
+			return mFrameBounds[frameNum * 2];
+		}
+
+		/**
+		 * Get the maximum of frame bounds.
+		 */
+		const vector3& getFrameMaxs(unsigned int frameNum) const
+		{
+			kAssert(mFrameBounds && frameNum < mFrameCount);
+			return mFrameBounds[frameNum * 2 + 1];
+		}
+
+		/**
+		 * Trace against this meshe triangles. The ray is rejected
+		 * against the frame bounds first and, if useBVH is set, the
+		 * frame triangle tree is built (once) and used for the search.
+		 * On collision the ray fraction and normal (in surface
+		 * space) are from the closest hit.
+		 */
+		bool trace(ray& traceRay, short frameNum, bool useBVH = true);
 };
 
 /**
@@ -566,6 +678,40 @@ class DLL_EXPORT md3model : public drawable3D
 		 */
 		const md3model* mShared;
 
+		/**
+		 * Set when prepare() already fed the animations
+		 * for the next draw.
+		 */
+		bool mPrepared;
+
+		// Use surfaces triangle trees on traces
+		bool mTraceBVH;
+
+		/**
+		 * Frame interpolation. Each instance keeps its own
+		 * interpolated vertices for each surface.
+		 */
+		bool mInterpolate;
+		unsigned int mInterpolationSteps;
+		vec_t mInterpolatedFrame;
+		md3RealVertex** mInterpolatedVertices;
+
+		/**
+		 * Interpolate surfaces vertices for the current frame
+		 * in case it changed since last time.
+		 */
+		void updateInterpolation();
+
+		/**
+		 * Current frame bounds in model space.
+		 */
+		boundingBox _getFrameBounds() const;
+
+		/**
+		 * Feed animations of this model and its attachments.
+		 */
+		void _prepareTree();
+
 	public:
 		/**
 		 * Constructor. You can allocate md3model by passing
@@ -685,6 +831,25 @@ class DLL_EXPORT md3model : public drawable3D
 		 */
 		void feedAnims();
 
+		/**
+		 * Interpolate vertices between animation frames. Steps
+		 * quantize the fraction between frames, so vertices are
+		 * only evaluated when the quantized value changes (0 means
+		 * evaluate every time the frame changes). Default is off.
+		 *
+		 * @interpolate Enable or disable interpolation.
+		 * @steps Number of interpolated steps between two frames.
+		 */
+		void setInterpolation(bool interpolate, unsigned int steps = 0);
+
+		/**
+		 * Are we interpolating frames?
+		 */
+		bool getInterpolation() const
+		{
+			return mInterpolate;
+		}
+
 		/**
 		 * Get Model tag.
 		 * @tname The Tag name.
@@ -748,22 +913,48 @@ class DLL_EXPORT md3model : public drawable3D
 		/**
 		 * Trace against this model. If this ray collides
 		 * with some triangle the ray mFraction (getFraction()) 
-		 * will be different than 0 and this function returns true.
+		 * will be the closest hit and this function returns true.
+		 * The ray normal is then in world space and its surface
+		 * is the index of the hit surface.
 		 */
 		bool trace(ray& traceRay);
 
+		/**
+		 * Set if traces use the surfaces triangle trees
+		 * instead of testing every triangle. Default is on.
+		 */
+		void setTraceBVH(bool enabled)
+		{
+			mTraceBVH = enabled;
+		}
+
 		/**
 		 * Return false if the model or any of its submeshes is transparent.
 		 */
 		bool isOpaque() const;
 
+		/**
+		 * Overloaded
+		 */
+		bool isAnimated() const
+		{
+			return mActiveAnimation || mAttach.size();
+		}
+
+		/**
+		 * Overloaded, feed this model and its attachments animations.
+		 * Does nothing on attached models, their parent does it.
+		 */
+		void prepare();
+
 		/**
 		 * Draw the model.
 		 */
 		void draw();
 
 		/**
-		 * Return the model axis-aligned bounding box.
+		 * Return the model axis-aligned bounding box
+		 * in world space.
 		 */
 		boundingBox getAABoundingBox() const;
 		
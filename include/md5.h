@@ -146,6 +146,27 @@ typedef struct
 	index_t index[3];
 } triangle_t;
 
+// Maximum number of bones skinned on the GPU
+#define MD5_GPU_MAX_BONES 80
+
+// Maximum number of weights per vertex skinned on the GPU
+#define MD5_GPU_MAX_WEIGHTS 4
+
+/**
+ * Vertex layout used by GPU skinning, the first weight
+ * position goes on the vertex array and the others
+ * on program attributes.
+ */
+typedef struct
+{
+	vec_t pos[3];
+	vec_t normal[3];
+	vec_t uv[2];
+	vec_t bones[MD5_GPU_MAX_WEIGHTS];
+	vec_t weights[MD5_GPU_MAX_WEIGHTS];
+	vec_t weightPos[MD5_GPU_MAX_WEIGHTS - 1][3];
+} gpuVert_t;
+
 /**
  * \brief Handle submeshes (md5mesh) of md5model.
  * This class is responsible for handling and controlling
@@ -178,8 +199,10 @@ class DLL_EXPORT md5mesh
 		// Drawing Normal array
 		vector3* mDrawingNormals;
 
-		// Used to glDrawelements
-		vec_t* mVertexList;
+		// Used to glDrawelements, vertices are double
+		// buffered so skinning can run while drawing.
+		vec_t* mVertexList[2];
+		unsigned int mFrontBuffer;
 		vec_t* mUvList;
 		vec_t* mNormalList;
 
@@ -189,6 +212,17 @@ class DLL_EXPORT md5mesh
 		// Non animated meshes, have a default boundingBox
 		boundingBox mAABB;
 
+		// GPU skinning buffers
+		bool mGPUReady;
+		bool mGPUSkinning;
+		platformVBO mSkinVBO;
+		platformVBO mIndexVBO;
+
+		/**
+		 * Draw using the skinning program and the bone palette.
+		 */
+		void drawGPUSkinned(const vec_t* bonePalette, unsigned int bonesCount);
+
 	public:
 		/**
 		 * Constructor.
@@ -279,10 +313,37 @@ class DLL_EXPORT md5mesh
 		void compileVertices(std::vector<bone_t*>* boneList);
 
 
+		/**
+		 * Upload bind data to static VBOs for GPU skinning.
+		 * Must be called from the rendering thread.
+		 * @return False if the mesh cant be skinned on the GPU.
+		 */
+		bool prepareGPUSkinning();
+
+		/**
+		 * Enable GPU skinning (only if prepareGPUSkinning succeeded).
+		 */
+		void setGPUSkinning(bool enabled);
+
+		/**
+		 * Are we skinning this mesh on the GPU?
+		 */
+		bool getGPUSkinning() const
+		{
+			return mGPUSkinning && !mDrawNormals;
+		}
+
 		/**
 		 * Draw this surface
 		 */
 		void draw();
+
+		/**
+		 * Draw this surface, skinning on the GPU if enabled.
+		 * @param bonePalette Bone orientation and position (8 floats per bone)
+		 * @param bonesCount Number of bones on the palette.
+		 */
+		void draw(const vec_t* bonePalette, unsigned int bonesCount);
 };
 
 /**
@@ -316,6 +377,31 @@ class DLL_EXPORT md5model : public drawable3D
 		 */
 		bool mAutoFeedAnims;
 
+		/**
+		 * Set when prepare() already fed the animations
+		 * for the next draw.
+		 */
+		bool mPrepared;
+
+		/**
+		 * Culling bounds on model space, updated
+		 * each time the pose changes.
+		 */
+		boundingBox mPoseBounds;
+
+		/**
+		 * Set mPoseBounds from the animation bounds, the union
+		 * of both frames when frame is fractional.
+		 */
+		void updatePoseBounds(const anim_t* anim, vec_t frame);
+
+		/**
+		 * GPU skinning state and the bone palette
+		 * uploaded to the skinning program.
+		 */
+		bool mGPUSkinning;
+		vec_t* mBonePalette;
+
 	public:
 		/**
 		 * Constructor. The model will be allocated from the full path (from the resourceManager root).
@@ -371,6 +457,21 @@ class DLL_EXPORT md5model : public drawable3D
 		 */
 		void feedAnims();
 
+		/**
+		 * Skin the model on the GPU when vertex programs are available,
+		 * otherwise (or when disabled) skinning is done on the CPU.
+		 * Enabled by default, must be called from the rendering thread.
+		 */
+		void setGPUSkinning(bool enabled);
+
+		/**
+		 * Are we skinning on the GPU?
+		 */
+		bool getGPUSkinning() const
+		{
+			return mGPUSkinning;
+		}
+
 		/**
 		 * Set the model desired frame.
 		 * If the specified frame is greater than the number
@@ -384,6 +485,19 @@ class DLL_EXPORT md5model : public drawable3D
 		 */
 		md5mesh* getMesh(unsigned int index);
 
+		/**
+		 * Overloaded
+		 */
+		bool isAnimated() const
+		{
+			return mAutoFeedAnims && mAnimations.size();
+		}
+
+		/**
+		 * Overloaded, evaluate the pose and skin the meshes.
+		 */
+		void prepare();
+
 		/**
 		 * Overloaded
 		 */
@@ -395,8 +509,8 @@ class DLL_EXPORT md5model : public drawable3D
 		bool isOpaque() const;
 
 		/**
-		 * Return model Bounding box, rotated
-		 * like model orientation.
+		 * Return model axis aligned bounding box on world
+		 * space, from the bounds of the current pose.
 		 */
 		boundingBox getAABoundingBox() const;
 
@@ -32,7 +32,23 @@ THE SOFTWARE.
 #include "timer.h"
 #include "vector3.h"
 
+/**
+ * Systems with more alive particles than this are
+ * simulated in chunks of this size on the worker pool.
+ */
+#define PARTICLE_CHUNK_SIZE 2048
+
+/**
+ * Coarse steps used to catch up a system
+ * that was sleeping out of view.
+ */
+#define PARTICLE_CATCHUP_STEPS 8
+
 namespace k {
+
+class camera;
+class world;
+
 namespace particle
 {
 	/**
@@ -135,215 +151,270 @@ namespace particle
 	};
 
 	/**
-	 * \brief Particle representation.
+	 * How particles respond to world collisions.
 	 */
-	class DLL_EXPORT particle : public location
+	enum particleCollision
 	{
-		protected:
-			/**
-			 * Velocity change particle's position on each dt.
-			 */
-			vector3 mVelocity;
+		PARTICLE_COLLISION_NONE = 0,
+		PARTICLE_COLLISION_BOUNCE,
+		PARTICLE_COLLISION_KILL
+	};
 
-			/**
-			 * Acceleration changes particle's velocity on each dt.
-			 */
-			vector3 mAcceleration;
+	/**
+	 * Particle attributes. Each attribute is stored
+	 * on its own array (structure of arrays), so the
+	 * simulation runs on whole arrays at a time.
+	 */
+	enum particleAttributes
+	{
+		PARTICLE_POS_X = 0,
+		PARTICLE_POS_Y,
+		PARTICLE_POS_Z,
 
+		PARTICLE_VEL_X,
+		PARTICLE_VEL_Y,
+		PARTICLE_VEL_Z,
+
+		PARTICLE_ACCEL_X,
+		PARTICLE_ACCEL_Y,
+		PARTICLE_ACCEL_Z,
+
+		PARTICLE_RADIUS,
+
+		// Age and lifetime in seconds
+		PARTICLE_AGE,
+		PARTICLE_LIFETIME,
+
+		MAX_PARTICLE_ATTRIBUTES
+	};
+
+	/**
+	 * \brief Particle containers.
+	 * Particles positions are relative to the container
+	 * owner (the system), so moving the system moves
+	 * its particles.
+	 */
+	class DLL_EXPORT container
+	{
+		protected:
 			/**
-			 * Last time we called the draw function.
-			 *
-			 * On each iteration, we can get dt as the difference
-			 * between local time and mLastDrawTime.
-			 */
-			unsigned long mLastDrawTime;
-			
-			/**
-			 * The time particle was spawned.
-			 * The particle's life is defined by
-			 * actual time - mSpawnTime.
+			 * The actual particles, one array per attribute
+			 * with mCapacity elements each. Alive particles
+			 * are packed at the beginning of the arrays.
 			 */
-			long mSpawnTime;
+			vec_t* mAttributes[MAX_PARTICLE_ATTRIBUTES];
 
 			/**
-			 * Each particle has an independent radius.
+			 * Number of alive particles.
 			 */
-			vec_t mRadius;
+			unsigned int mParticlesCount;
 
 			/**
-			 * Is this particle visible?
+			 * Number of slots on each attribute array, the quota 
+			 * rounded up so arrays are processed four at a time.
 			 */
-			bool mVisible;
+			unsigned int mCapacity;
 
 			/**
-			 * Life time of this particle.
+			 * Without point sprites, all particles are
+			 * expanded into quads and drawn at once.
 			 */
-			unsigned int mLifeTime;
+			spriteBatch* mBatch;
 
-		public:
 			/**
-			 * Constructor
+			 * If we are using ARB point sprites, dont use
+			 * sprite at all, build an array of particle
+			 * positions and call it, F-A-S-T-ER.
 			 */
-			particle();
+			vec_t* mVertexPositions;
 
 			/**
-			 * Particle Velocity
+			 * Particles are sorted back to front before drawing.
 			 */
-			const vector3& getVelocity() const;
+			bool mSortParticles;
 
 			/**
-			 * Particle Acceleration
+			 * mSortBuffer holds positions (x, y, z) and radius of the
+			 * sorted particles, followed by the radix sort indices and keys.
+			 * mSorted is true when it matches the current particles.
 			 */
-			const vector3& getAcceleration() const;
+			vec_t* mSortBuffer;
+			bool mSorted;
 
 			/**
-			 * Is this particle visible? If not, its
-			 * not going to be drawn.
+			 * Timer to update particle positions
+			 * and keep track of events.
 			 */
-			bool isVisible() const;
+			timer mTimer;
 
 			/**
-			 * Time particle spawned. 
-			 * This time is relative to the container mTime.
+			 * Time of the last update, to get dt.
 			 */
-			unsigned int getSpawnTime() const;
+			long mLastUpdate;
 
 			/**
-			 * How much time this particle can live.
+			 * Time (in seconds) simulated on the last update.
 			 */
-			unsigned int getLifeTime() const;
+			vec_t mStepTime;
 
 			/**
-			 * Get particle radius.
+			 * Max number of particles on this system.
 			 */
-			vec_t getRadius() const;
+			unsigned int mMaxNumberOfParticles;
 
 			/**
-			 * Set particle velocity.
+			 * Material used to draw the particles.
 			 */
-			void setVelocity(const vector3& vel);
+			material* mMaterial;
 
 			/**
-			 * Set particle acceleration.
+			 * Integrate velocities and positions and age a range of particles.
+			 * @param dt Elapsed time in seconds.
+			 * @param first First particle of the range.
+			 * @param count Number of particles on the range.
 			 */
-			void setAcceleration(const vector3& accel);
+			void integrate(vec_t dt, unsigned int first, unsigned int count);
 
 			/**
-			 * Set particle life time. This is the amount
-			 * of time (in milliseconds) the particle can live.
+			 * Advance the container timer, updating
+			 * the step time. Returns the step time.
 			 */
-			void setLifeTime(unsigned int time);
+			vec_t advanceTime();
 
 			/**
-			 * Set particle radius.
+			 * Radix sort the particles indices by 16 bits view depth keys.
+			 * @return The sorted indices.
 			 */
-			void setRadius(vec_t radi);
+			const unsigned int* radixSort(const vector3& eye, const vector3& direction);
 
 			/**
-			 * Set the particle visibility. If the particle
-			 * is not visible, then its considered dead
-			 * and will not be drawn.
+			 * Kill particles older than their lifetime.
 			 */
-			void setVisibility(bool vis);
+			void expire();
 
 			/**
-			 * Change particle mSpawnTime to time.
+			 * Kill a particle, moving the last alive one to its place.
 			 */
-			void resetLife(long time);
+			void killParticle(unsigned int index);
 
 			/**
-			 * Calculates dv/dt and dr/dt and update them.
-			 * @time Actual time on container.
+			 * Where particles positions are relative to.
 			 */
-			void updatePhysics(long time);
+			virtual vector3 getParticlesOrigin() const
+			{
+				return vector3::zero;
+			}
 
+		public:
 			/**
-			 * Draw particle, specifying the sprite used.
+			 * Constructor.
 			 */
-			void draw(sprite* spr);
-	};
+			container();
 
-	/**
-	 * \brief Particle containers.
-	 */
-	class DLL_EXPORT container
-	{
-		protected:
 			/**
-			 * The actual particles
+			 * Destructor
 			 */
-			std::vector<particle>* mParticles;
-
+			virtual ~container();
+			
 			/**
-			 * This sprite is shared among the particles
-			 * since they are all the same material, this is 
-			 * pretty possible.
+			 * Set particle quota.
 			 */
-			sprite* mSprite;
+			void setNumParticles(unsigned int amount);
 
 			/**
-			 * If we are using ARB point sprites, dont use
-			 * sprite at all, build an array of particle
-			 * positions and call it, F-A-S-T-ER.
+			 * Returns the particle quota.
 			 */
-			vec_t* mVertexPositions;
+			unsigned int getQuota() const
+			{
+				return mMaxNumberOfParticles;
+			}
 
 			/**
-			 * Timer to update particle positions
-			 * and keep track of events.
+			 * Free the particles memory, keeping the quota.
 			 */
-			timer mTimer;
+			void freeParticles();
 
 			/**
-			 * Max number of particles on this system.
+			 * Set particles material.
 			 */
-			unsigned int mMaxNumberOfParticles;
+			void setMaterial(const std::string& name);
 
 			/**
-			 * Number of free particles.
+			 * Set particles material.
 			 */
-			unsigned int mFreeParticles;
+			void setMaterial(material* mat);
 
 			/**
-			 * Material used to draw the particles.
+			 * Sort particles back to front before drawing them, needed
+			 * by blended materials. Blended particles dont write depth.
 			 */
-			material* mMaterial;
+			void setSorting(bool sort)
+			{
+				mSortParticles = sort;
+			}
 
-		public:
 			/**
-			 * Constructor.
+			 * Returns true if particles are sorted before drawing.
 			 */
-			container();
+			bool getSorting() const
+			{
+				return mSortParticles;
+			}
 
 			/**
-			 * Destructor
+			 * Sort the alive particles back to front, for the next draw().
+			 * Can be called from any thread, after the simulation step.
+			 * @param eye Camera position.
+			 * @param direction Camera view direction.
 			 */
-			~container();
-			
+			void sortParticles(const vector3& eye, const vector3& direction);
+
 			/**
-			 * Set particle quota.
+			 * Spawn a new particle.
+			 * @param pos Position, relative to the container owner.
+			 * @param vel Initial velocity.
+			 * @param accel Acceleration.
+			 * @param radius Particle radius.
+			 * @param lifeTime Time (in milliseconds) the particle lives.
+			 * @return false if there are no free particles.
 			 */
-			void setNumParticles(unsigned int amount);
+			bool spawnParticle(const vector3& pos, const vector3& vel, 
+				const vector3& accel, vec_t radius, unsigned int lifeTime);
 
 			/**
-			 * Set particles material.
+			 * Get an attribute array, @see particleAttributes.
+			 * Arrays have getCapacity() elements.
 			 */
-			void setMaterial(const std::string& name);
+			vec_t* getAttribute(unsigned int attribute) const
+			{
+				kAssert(attribute < MAX_PARTICLE_ATTRIBUTES);
+				return mAttributes[attribute];
+			}
 
 			/**
-			 * Set particles material.
+			 * Number of slots on attributes arrays.
 			 */
-			void setMaterial(material* mat);
+			unsigned int getCapacity() const
+			{
+				return mCapacity;
+			}
 
 			/**
-			 * Returns a free particle.
+			 * Time (in seconds) simulated on the last update.
 			 */
-			particle* findFreeParticle();
+			vec_t getStepTime() const
+			{
+				return mStepTime;
+			}
 
 			/**
-			 * Spawn a new particle
+			 * Number of alive particles, packed at the
+			 * beginning of the attributes arrays.
 			 */
-			particle* spawnParticle();
+			unsigned int getParticlesCount() const
+			{
+				return mParticlesCount;
+			}
 
 			/**
 			 * Remove dead particles, update other
@@ -456,12 +527,48 @@ namespace particle
 			 */
 			void setMaxVelocity(const vector3& max);
 
-			void baseSpawn(particle* newP);
+			/**
+			 * Spawn a particle with this emitter radius and lifetime.
+			 * @param[in] pos Position relative to this emitter.
+			 * @param[in] accel Particle acceleration.
+			 */
+			bool baseSpawn(const vector3& pos, const vector3& accel);
+
+			/**
+			 * Returns the life time (in milliseconds) of the particles.
+			 */
+			unsigned int getLifeTime() const
+			{
+				return mLifetime;
+			}
+
+			/**
+			 * Spawn one set of particles.
+			 * @return false if the container is full.
+			 */
+			virtual bool spawnBurst() = 0;
+
+			/**
+			 * Create a copy of this emitter, as a child of another container.
+			 */
+			virtual emitter* clone(container* cont) const = 0;
+
+			/**
+			 * Restart the spawn timer.
+			 */
+			void resetTimer();
 
 			/**
-			 * Ask the emitter to spawn new particles.
+			 * Ask the emitter to spawn new particles, if its spawn time has passed.
 			 */
-			virtual void spawnParticles() = 0;
+			void spawnParticles();
+
+			/**
+			 * Spawn all sets of particles of an elapsed time, without 
+			 * the spawn timer. Used to catch up sleeping systems.
+			 * @param elapsed Elapsed time in milliseconds.
+			 */
+			void spawnFor(long elapsed);
 
 			/**
 			 * Returns the axis-aligned bounding box of the emitter
@@ -494,9 +601,14 @@ namespace particle
 			~pointEmitter();
 
 			/**
-			 * Ask the emitter to spawn particles.
+			 * Spawn one set of particles.
 			 */
-			void spawnParticles();
+			bool spawnBurst();
+
+			/**
+			 * Create a copy of this emitter.
+			 */
+			emitter* clone(container* cont) const;
 
 			/**
 			 * Set particles acceleration.
@@ -546,9 +658,14 @@ namespace particle
 			~planeEmitter();
 
 			/**
-			 * Ask the emitter to spawn particles.
+			 * Spawn one set of particles.
 			 */
-			void spawnParticles();
+			bool spawnBurst();
+
+			/**
+			 * Create a copy of this emitter.
+			 */
+			emitter* clone(container* cont) const;
 
 			/**
 			 * Set the physical limits of particles emission.
@@ -570,6 +687,37 @@ namespace particle
 			const boundingBox getAABB() const;
 	};
 
+	/**
+	 * An affector compiled into a flat operation
+	 * over particle attribute arrays.
+	 */
+	typedef struct
+	{
+		// First affected attribute (@see particleAttributes) and how many
+		unsigned int attribute;
+		unsigned int components;
+
+		// @see affectedOperations
+		unsigned int operation;
+
+		// Factor of each component, per second
+		vec_t factor[3];
+	} affectorOp_t;
+
+	/**
+	 * Apply a compiled affector operation on the alive particles.
+	 * @param cont Particles container.
+	 * @param op The operation.
+	 * @param time Time (in seconds) the factor is scaled by.
+	 */
+	void applyAffectorOp(container* cont, const affectorOp_t& op, vec_t time);
+
+	/**
+	 * Apply a compiled affector operation on a range of particles.
+	 */
+	void applyAffectorOp(container* cont, const affectorOp_t& op, vec_t time, 
+		unsigned int first, unsigned int count);
+
 	/**
 	 * \brief Affects particles in many ways. 
 	 * This class dont work by itself, it should be derivated.
@@ -612,10 +760,21 @@ namespace particle
 			void resetTimer();
 
 			/**
-			 * Ask the affector to interact with particle.
-			 * @param[in] p Particle to get interaction.
+			 * Compile this affector into a flat operation, so systems
+			 * apply it without calling the affector. Affectors that
+			 * cant be compiled return false and systems call interact().
+			 * @param[out] op The compiled operation.
 			 */
-			virtual void interact(particle* p) = 0;
+			virtual bool compile(affectorOp_t& op) const
+			{
+				return false;
+			}
+
+			/**
+			 * Ask the affector to interact with all particles of a container.
+			 * @param[in] cont Container with the particles.
+			 */
+			virtual void interact(container* cont) = 0;
 	};
 
 	/**
@@ -625,12 +784,29 @@ namespace particle
 	{
 		public:
 			/**
-			 * Ask the affector to interact with particle.
-			 * @param[in] p Particle to get interaction.
+			 * Compile into a flat operation.
 			 */
-			void interact(particle* p);
+			bool compile(affectorOp_t& op) const;
+
+			/**
+			 * Ask the affector to interact with all particles of a container.
+			 * @param[in] cont Container with the particles.
+			 */
+			void interact(container* cont);
 	};
 
+	class system;
+
+	/**
+	 * A range of particles simulated by one job.
+	 */
+	typedef struct
+	{
+		system* owner;
+		unsigned int first;
+		unsigned int count;
+	} particleChunk_t;
+
 	/**
 	 * \brief Base particle System.
 	 */
@@ -652,6 +828,30 @@ namespace particle
 			 */
 			std::map<std::string, affector*> mAffectors;
 
+			/**
+			 * Affectors compiled into flat operations, and the
+			 * ones that couldnt be compiled.
+			 */
+			std::vector<affectorOp_t> mAffectorOps;
+			std::vector<affector*> mInteractAffectors;
+			bool mAffectorsCompiled;
+
+			/**
+			 * Number of particles alive before this step spawn,
+			 * the ones that must be integrated.
+			 */
+			unsigned int mIntegrateCount;
+
+			/**
+			 * Chunks of the last step, when simulated on the worker pool.
+			 */
+			std::vector<particleChunk_t> mChunks;
+
+			/**
+			 * Job of a chunk simulation.
+			 */
+			static void simulateChunkJob(void* data);
+
 			/**
 			 * System bounding box.
 			 */
@@ -662,6 +862,63 @@ namespace particle
 			 */
 			bool mIsVisible;
 
+			/**
+			 * System is out of view and not being simulated.
+			 */
+			bool mSleeping;
+
+			/**
+			 * Template of this system, when its an instance.
+			 */
+			const system* mTemplate;
+
+			/**
+			 * Time (in msec) the system emits particles, zero for ever.
+			 */
+			long mDuration;
+
+			/**
+			 * World collision response (@see particleCollision), restitution
+			 * of bounces and world content flags to collide with.
+			 */
+			unsigned int mCollision;
+			vec_t mRestitution;
+			int mCollisionFlags;
+
+			/**
+			 * Segments starts, ends and hit normals (mCollisionCapacity each)
+			 * and hit fractions of the collision step.
+			 */
+			vector3* mCollisionSegments;
+			vec_t* mCollisionFractions;
+			unsigned int mCollisionCapacity;
+
+			/**
+			 * Sweep a range of integrated particles against the world.
+			 */
+			void collide(unsigned int first, unsigned int count);
+
+			/**
+			 * Fast forward a sleeping system with coarse steps.
+			 * @param elapsed Time (in seconds) the system slept.
+			 */
+			void catchUp(vec_t elapsed);
+
+			/**
+			 * First (serial) part of a simulation step, expire 
+			 * and spawn particles.
+			 * @param dt Step time in seconds.
+			 */
+			void beginSimulation(vec_t dt);
+
+			/**
+			 * Particles are relative to the system.
+			 */
+			vector3 getParticlesOrigin() const
+			{
+				return getAbsolutePosition();
+			}
+
 		public:
 			/**
 			 * Constructor.
@@ -696,6 +953,90 @@ namespace particle
 				return mBounds;
 			}
 
+			/**
+			 * Return the bounding box of the system in world space.
+			 */
+			boundingBox getWorldBounds() const
+			{
+				const vector3 position = getAbsolutePosition();
+				return boundingBox(mBounds.getMins() + position, mBounds.getMaxs() + position);
+			}
+
+			/**
+			 * Make this system an instance of a template, copying the template
+			 * emitters and sharing its affectors. Affectors are shared, so 
+			 * affectors that cant be compiled must not keep per system state.
+			 */
+			void setTemplate(const system* tmpl);
+
+			/**
+			 * Returns the template of this system, NULL if it isnt an instance.
+			 */
+			const system* getTemplate() const
+			{
+				return mTemplate;
+			}
+
+			/**
+			 * Kill all particles and restart the system timers.
+			 */
+			void reset();
+
+			/**
+			 * Collide particles with the renderer world. Particles are swept on
+			 * each step with batched world traces, so the world traceSegments()
+			 * must be thread safe.
+			 * @param mode Collision response, @see particleCollision.
+			 * @param restitution Fraction of the normal velocity kept on bounces.
+			 * @param flags World content flags to collide with, zero for all.
+			 */
+			void setCollision(unsigned int mode, vec_t restitution = 0.5f, int flags = 0);
+
+			/**
+			 * Returns the collision response.
+			 */
+			unsigned int getCollision() const
+			{
+				return mCollision;
+			}
+
+			/**
+			 * Set the time (in milliseconds) the system emits
+			 * particles after reset(), zero for ever.
+			 */
+			void setDuration(long duration)
+			{
+				mDuration = duration;
+			}
+
+			/**
+			 * Returns true if the system stopped emitting and
+			 * all of its particles are dead.
+			 */
+			bool isFinished();
+
+			/**
+			 * Returns the longest particle life time (in msec) of the emitters.
+			 */
+			unsigned int getMaxLifeTime() const;
+
+			/**
+			 * Stop simulating the system until its simulated again,
+			 * when it will catch up the time it slept.
+			 */
+			void sleep()
+			{
+				mSleeping = true;
+			}
+
+			/**
+			 * Returns true if the system is sleeping.
+			 */
+			bool isSleeping() const
+			{
+				return mSleeping;
+			}
+
 			/**
 			 * Set system material, taken from materialManager
 			 */
@@ -721,6 +1062,26 @@ namespace particle
 			 */
 			void pushAffector(const std::string& name, affector* aff);
 
+			/**
+			 * Compile affectors into flat operations. Its done when
+			 * affectors are pushed, call it again if you change
+			 * an affector after pushing it.
+			 */
+			void compileAffectors();
+
+			/**
+			 * Integrate and affect a range of particles, after beginSimulation().
+			 * Different ranges can be simulated on different threads.
+			 */
+			void simulateRange(unsigned int first, unsigned int count);
+
+			/**
+			 * Run a whole simulation step, without drawing.
+			 * @param parallel Split big systems in chunks on the worker pool.
+			 * Only safe to call from a worker pool job or before waiting it.
+			 */
+			void simulate(bool parallel = false);
+
 			/**
 			 * Update and draw everything
 			 */
@@ -740,6 +1101,46 @@ namespace particle
 		protected:
 			std::map<std::string, system*> mSystems;
 
+			/**
+			 * Parsed templates, active instances and 
+			 * released instances of each template.
+			 */
+			std::map<std::string, system*> mTemplates;
+			std::vector<system*> mInstances;
+			std::map<const system*, std::vector<system*> > mPools;
+
+			/**
+			 * Cull a system, queueing it to be simulated when visible.
+			 */
+			void _scheduleSystem(system* sys, camera* cam, world* activeWorld);
+
+			/**
+			 * Release instances that finished.
+			 */
+			void _releaseFinished();
+
+			/**
+			 * Systems simulated on this frame, to be drawn.
+			 */
+			std::vector<system*> mSimulatedSystems;
+			bool mSimulationPending;
+
+			/**
+			 * Camera used to sort particles on this frame.
+			 */
+			vector3 mSortEye;
+			vector3 mSortDirection;
+
+			/**
+			 * Job of a system simulation.
+			 */
+			static void simulateSystemJob(void* data);
+
+			/**
+			 * Job of a system particles sorting.
+			 */
+			static void sortSystemJob(void* data);
+
 		public:
 			/**
 			 * Constructor.
@@ -780,14 +1181,47 @@ namespace particle
 			 */
 			void parseScript(parsingFile* file);
 
-			void parseSystem(parsingFile* file, const std::string& psName);
+			/**
+			 * Parse a particle system. Parsed systems are also templates,
+			 * but templates arent simulated nor drawn by themselves.
+			 */
+			void parseSystem(parsingFile* file, const std::string& psName, bool asTemplate = false);
+
+			/**
+			 * Get a template by name.
+			 */
+			const system* getTemplate(const std::string& name) const;
+
+			/**
+			 * Create an instance of a template, reusing released ones.
+			 * @param templateName Name of the template (or parsed system).
+			 * @param position Instance position.
+			 * @param duration Time (in msec) the instance emits particles, zero for
+			 * ever. Instances with a duration are released once they finish.
+			 * @return The instance, NULL on failure.
+			 */
+			system* instantiate(const std::string& templateName, 
+				const vector3& position = vector3::zero, long duration = 0);
+
+			/**
+			 * Return an instance to its template pool.
+			 */
+			void release(system* instance);
 
 			void parsePlaneEmitter(parsingFile* file, system* mSystem, const std::string& name);
 			void parsePointEmitter(parsingFile* file, system* mSystem, const std::string& name);
 			void parseLinearAffector(parsingFile* file, system* system, const std::string& name);
 
+			/**
+			 * Push the simulation of all particle systems visible to the
+			 * camera into the worker pool. Systems are simulated independently,
+			 * big ones are split in chunks. Call before waiting the pool.
+			 */
+			void simulateParticles();
+
 			/**
 			 * Ask the particle manager to draw all particle systems.
+			 * Simulation is finished here if simulateParticles() wasnt called.
 			 * Note: Particle systems that are not visible to the camera will not be drawn.
 			 */
 			void drawParticles();
@@ -42,6 +42,51 @@ namespace k
 			 */
 			GLuint mScreenshotTex;
 
+			/**
+			 * Shadow of the bound fixed function state, so redundant
+			 * changes are not sent to GL. Trusted once mStateKnown is set.
+			 */
+			bool mStateKnown;
+			CullMode mCull;
+			bool mDepthTest;
+			bool mDepthMask;
+			bool mBlend;
+			unsigned short mBlendSrc, mBlendDst;
+			color mAmbient;
+			color mDiffuse;
+			color mSpecular;
+
+			/**
+			 * Per texture unit shadow state, mActiveUnit is -1 when
+			 * server and client units may differ.
+			 */
+			int mActiveUnit;
+			bool mTextureEnabled[MAX_TEXCOORD];
+			GLuint mTexEnv[MAX_TEXCOORD];
+			bool mSphereMap[MAX_TEXCOORD];
+
+			/**
+			 * Texture matrices loaded on each unit, mTextureMatrix is
+			 * set while a unit holds a non identity one.
+			 */
+			matrix4 mTextureMatrices[MAX_TEXCOORD];
+			bool mTextureMatrix[MAX_TEXCOORD];
+
+			/**
+			 * Bound program, zero for the fixed pipeline.
+			 */
+			GLuint mBoundProgram;
+
+			void _setActiveUnit(int unit);
+			void _enableTexture(int unit, bool enabled);
+			void _setSphereMap(int unit, bool enabled);
+			void _resetTextureMatrix(int unit);
+
+			/**
+			 * Set every shadowed state to known values.
+			 */
+			void _resetState();
+
 		public:
 			glRenderSystem();
 			~glRenderSystem();
@@ -74,6 +119,7 @@ namespace k
 			void setTexEnv(const std::string& baseEnv, int stage);
 			void setTexEnv(texEnvMode mode, int stage);
 			void setTextureUnits(int i) {}
+			void setTextureMatrix(const matrix4& mat, int stage);
 			void setTextureGenerations(int i) {}
 			void setColorChannels(int i) {}
 
@@ -105,6 +151,7 @@ namespace k
 			void matAmbient(const color& color);
 			void matDiffuse(const color& color);
 			void matSpecular(const color& color);
+			void applyMaterialState(const materialState_t& state);
 
 			void genTexture(uint32_t w, uint32_t h, uint32_t bpp, platformTexturePointer* tex);
 			void bindTexture(GLuint* tex, int chan);
@@ -139,6 +186,18 @@ namespace k
 			void setVBOData(VBOArrayType type, int size, void* data, VBOUsage use);
 			void delVBO(platformVBO* target);
 
+			bool getProgramSupport();
+			unsigned int getProgramMaxUniforms();
+			bool genProgram(platformProgram* target, const char* vertex, const char* fragment);
+			void bindProgram(platformProgram* target);
+			void delProgram(platformProgram* target);
+			int getProgramUniform(platformProgram* target, const std::string& name);
+			int getProgramAttribute(platformProgram* target, const std::string& name);
+			void setProgramUniform(int location, int value);
+			void setProgramUniform(int location, const vec_t* values, unsigned int count);
+			void setAttributeArray(int location, unsigned int size, unsigned int offset, unsigned int stride);
+			void unsetAttributeArray(int location);
+
 			unsigned int getScreenWidth();
 			unsigned int getScreenHeight();
 	};
@@ -50,8 +50,10 @@ extern "C"
 	
 typedef pthread_t 			platformThread;
 typedef pthread_mutex_t 	platformMutex;
+typedef pthread_cond_t 		platformCondition;
 typedef GLuint 				platformTexturePointer;
 typedef GLuint 				platformVBO;
+typedef GLuint 				platformProgram;
 typedef struct timeval		platformTimer;
 typedef GLfloat 				vec_t;
 typedef unsigned int 		index_t;
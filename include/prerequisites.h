@@ -31,6 +31,7 @@ THE SOFTWARE.
 #include <string>
 #include <fstream>
 #include <list>
+#include <deque>
 #include <vector>
 #include <map>
 #include <algorithm>
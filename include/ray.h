@@ -30,6 +30,18 @@ THE SOFTWARE.
 
 namespace k
 {
+	/**
+	 * Four triangles laid out by component (first vertex and
+	 * the two edges from it), to test rays against many triangles
+	 * at once. Unused lanes must be zeroed.
+	 */
+	typedef struct
+	{
+		vec_t v1[3][4];
+		vec_t edge1[3][4];
+		vec_t edge2[3][4];
+	} triangle4_t;
+
 	/**
 	 * \brief Casting rays for collision tests.
 	 * Rays are used to execute collision tests against boxes, spheres, triangles, etc.
@@ -49,6 +61,14 @@ namespace k
 			 */
 			vec_t mFraction;
 
+			/**
+			 * Normal of the last collision (facing the ray, in
+			 * the space it was tested) and the hit surface index,
+			 * set by whoever knows about surfaces (-1 otherwise).
+			 */
+			vector3 mNormal;
+			int mSurface;
+
 			/**
 			 * Temporary orientation, in case something is 
 			 * another way oriented, you must give the ray the same
@@ -56,8 +76,25 @@ namespace k
 			 */
 			matrix4 mInverseTransformation;
 
+			/**
+			 * Origin and direction in the transformation space,
+			 * updated once when the ray or its space changes so
+			 * tests dont transform the ray each time.
+			 */
+			vector3 mLocalOrigin;
+			vector3 mLocalDirection;
+
+			/**
+			 * Move origin and direction into the transformation space.
+			 */
+			void updateLocal();
+
 		public:
-			ray() {}
+			ray()
+			{
+				mFraction = 0;
+				mSurface = -1;
+			}
 
 			/**
 			 * Create a ray from a position and direction.
@@ -69,6 +106,10 @@ namespace k
 				mOrigin = origin;
 				mDirection = dir;
 				mFraction = 0;
+				mSurface = -1;
+
+				mLocalOrigin = origin;
+				mLocalDirection = dir;
 			}
 
 			/**
@@ -79,7 +120,12 @@ namespace k
 				mOrigin = oldRay.getOrigin();
 				mDirection = oldRay.getDirection();
 				mFraction = oldRay.getFraction();
+				mNormal = oldRay.getNormal();
+				mSurface = oldRay.getSurface();
 				mInverseTransformation = oldRay.getTransformation();
+
+				mLocalOrigin = oldRay.mLocalOrigin;
+				mLocalDirection = oldRay.mLocalDirection;
 			}
 
 			/**
@@ -89,6 +135,7 @@ namespace k
 			void setOrigin(const vector3& origin)
 			{
 				mOrigin = origin;
+				updateLocal();
 			}
 
 			/**
@@ -98,15 +145,18 @@ namespace k
 			void setDirection(const vector3& dir)
 			{
 				mDirection = dir;
+				updateLocal();
 			}
 
 			/**
 			 * Set the new ray space, multiplying its coords
-			 * by the transformation matrix.
+			 * by the transformation matrix. The direction is
+			 * only affected by the upper 3x3 part.
 			 */
 			void setTransformation(const matrix4& mat)
 			{
 				mInverseTransformation = mat;
+				updateLocal();
 			}
 
 			/**
@@ -115,6 +165,7 @@ namespace k
 			void resetOrientation()
 			{
 				mInverseTransformation.setIdentity();
+				updateLocal();
 			}
 
 			/**
@@ -151,6 +202,55 @@ namespace k
 				return mFraction;
 			}
 
+			/**
+			 * Overwrite the collision distance, used when
+			 * keeping the closest of many tests.
+			 */
+			void setFraction(vec_t fraction)
+			{
+				mFraction = fraction;
+			}
+
+			/**
+			 * Returns the normal of the last collision.
+			 */
+			const vector3& getNormal() const
+			{
+				return mNormal;
+			}
+
+			/**
+			 * Overwrite the collision normal, used when moving it
+			 * back from the transformation space.
+			 */
+			void setNormal(const vector3& normal)
+			{
+				mNormal = normal;
+			}
+
+			/**
+			 * Returns the surface index of the last collision, or -1.
+			 */
+			int getSurface() const
+			{
+				return mSurface;
+			}
+
+			/**
+			 * Set the surface index of the collision.
+			 */
+			void setSurface(int surface)
+			{
+				mSurface = surface;
+			}
+
+			/**
+			 * Return a copy of this ray with its origin and direction
+			 * moved into the transformation space, so many tests can be
+			 * done without transforming the ray on each one.
+			 */
+			ray getTransformed() const;
+
 			/**
 			 * Returns the contact point in case of ray collision.
 			 */
@@ -165,9 +265,55 @@ namespace k
 			bool intersect(const vector3& v1, const vector3& v2, const vector3& v3);
 
 			/**
-			 * Test against bounding box
+			 * Set a lane of a triangle packet.
+			 */
+			static void setTriangle(triangle4_t& packet, unsigned int lane, 
+				const vector3& v1, const vector3& v2, const vector3& v3);
+
+			/**
+			 * Test against packets of four triangles at a time. In case
+			 * of collision the fraction is the closest hit.
+			 * @param packets Array of triangle packets.
+			 * @param count Number of packets.
+			 * @return Index of the closest triangle (packet * 4 + lane), or -1.
+			 */
+			int intersect(const triangle4_t* packets, unsigned int count);
+
+			/**
+			 * Test against bounding box. In case of collision the fraction
+			 * is the distance to the box entry (zero if origin is inside).
 			 */
 			bool intersect(const boundingBox& bb);
+
+			/**
+			 * Test against box extremes, see intersect(const boundingBox&).
+			 */
+			bool intersect(const vector3& mins, const vector3& maxs);
+
+			/**
+			 * Test this ray against many boxes, four at a time.
+			 * @param boxes Array of boxes.
+			 * @param count Number of boxes.
+			 * @param fractions Receives each box entry distance, or -1 if it was missed.
+			 * @return Number of boxes hit.
+			 */
+			unsigned int intersect(const boundingBox* boxes, unsigned int count, vec_t* fractions) const;
+
+			/**
+			 * Test this ray against many boxes given by their extremes.
+			 * See intersect(const boundingBox*, unsigned int, vec_t*).
+			 */
+			unsigned int intersect(const vector3* mins, const vector3* maxs, unsigned int count, vec_t* fractions) const;
+
+			/**
+			 * Test many rays against one box, four rays at a time.
+			 * @param rays Array of rays, each one with its own transformation.
+			 * @param count Number of rays.
+			 * @param bb The box.
+			 * @param fractions Receives each ray entry distance, or -1 if it missed.
+			 * @return Number of rays that hit the box.
+			 */
+			static unsigned int intersect(const ray* rays, unsigned int count, const boundingBox& bb, vec_t* fractions);
 	};
 }
 
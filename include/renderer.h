@@ -36,6 +36,28 @@ THE SOFTWARE.
 
 namespace k
 {
+	/**
+	 * Result of a scene query.
+	 */
+	typedef struct
+	{
+		// Hit drawable, NULL if nothing or the world was hit
+		drawable3D* object;
+
+		// True if the world was hit
+		bool world;
+
+		// Drawable surface index, -1 if unknown
+		int surface;
+
+		// How far along start -> end the hit is [0, 1]
+		vec_t fraction;
+
+		// Hit point and normal in world space
+		vector3 position;
+		vector3 normal;
+	} sceneHit;
+
 	/**
 	 * \brief The global renderer, father of all objects.
 	 * The renderer is responsible for drawing objects, the scenarios
@@ -49,6 +71,13 @@ namespace k
 			std::list<sprite*> mSprites;
 			std::list<light::light*> mLights;
 
+			/**
+			 * Without point sprites, unlit sprites sharing
+			 * a material are drawn at once.
+			 */
+			spriteBatch mSpriteBatch;
+			std::map<material*, std::vector<sprite*> > mSpriteGroups;
+
 			camera* mActiveCamera;
 
 			/**
@@ -72,6 +101,12 @@ namespace k
 			 */
 			timer mFrameTime;
 
+			/**
+			 * Global time (in milliseconds) sampled at frame start,
+			 * shared by everything animated once per frame.
+			 */
+			long mFrameStartTime;
+
 			/**
 			 * Skybox
 			 */
@@ -101,6 +136,38 @@ namespace k
 			 */
 			world* mActiveWorld;
 
+			/**
+			 * Push animated objects that will be drawn this
+			 * frame to the worker pool, so their poses are ready
+			 * when we start drawing them.
+			 */
+			void _prepareObjects();
+
+			/**
+			 * Draw the sprites grouped by material.
+			 */
+			void _drawSpriteBatches();
+
+			/**
+			 * Scene queries broadphase data, the boxes of queried
+			 * drawables (grown by the query radius).
+			 */
+			std::vector<drawable3D*> mQueryObjects;
+			std::vector<vector3> mQueryMins;
+			std::vector<vector3> mQueryMaxs;
+			std::vector<vec_t> mQueryFractions;
+
+			/**
+			 * Gather visible drawables boxes grown by radius.
+			 */
+			void _gatherQueryBounds(vec_t radius);
+
+			/**
+			 * Query the world and gathered drawables.
+			 */
+			bool _query(const vector3& start, const vector3& end, vec_t radius, 
+				int worldFlags, const drawable3D* ignore, sceneHit& hit);
+
 		public:
 			/**
 			 * Constructor.
@@ -178,6 +245,11 @@ namespace k
 			 */
 			void setWorld(world* w);
 
+			/**
+			 * Return the renderer active world.
+			 */
+			world* getWorld();
+
 			/**
 			 * Asks the renderer to draw the full scene.
 			 */
@@ -235,6 +307,14 @@ namespace k
 			 */
 			long getTimeNow();
 
+			/**
+			 * Get the global time (in milliseconds) the current frame started.
+			 */
+			long getFrameStartTime() const
+			{
+				return mFrameStartTime;
+			}
+
 			/**
 			 * Set whenever renderer will count frames or not.
 			 */
@@ -249,6 +329,36 @@ namespace k
 			 * Get scene last FPS
 			 */
 			unsigned int getLastFps();
+
+			/**
+			 * Cast a ray from start to end against the world and the visible
+			 * drawables. Drawables are rejected by their boxes and then traced
+			 * (triangles on models), from the nearest box on.
+			 *
+			 * @param start Ray start.
+			 * @param end Ray end.
+			 * @param hit Receives the nearest hit.
+			 * @param worldFlags World content flags to collide with, zero for all.
+			 * @param ignore A drawable to skip (the shooter, for example).
+			 * @return true if something was hit.
+			 */
+			bool raycast(const vector3& start, const vector3& end, sceneHit& hit, 
+				int worldFlags = 0, const drawable3D* ignore = NULL);
+
+			/**
+			 * Cast a sphere from start to end. The world is swept with the
+			 * sphere, drawables are tested by their boxes grown by the radius.
+			 * @see raycast
+			 */
+			bool sphereCast(const vector3& start, const vector3& end, vec_t radius, sceneHit& hit,
+				int worldFlags = 0, const drawable3D* ignore = NULL);
+
+			/**
+			 * Cast many rays, sharing the drawables gathering between them.
+			 * @return Number of rays that hit something.
+			 */
+			unsigned int raycast(const vector3* starts, const vector3* ends, unsigned int count, 
+				sceneHit* hits, int worldFlags = 0);
 	};
 }
 
@@ -310,6 +310,12 @@ namespace k
 			 */
 			virtual void setTextureUnits(int i) = 0;
 
+			/**
+			 * Load the texture matrix of a texture unit/tev stage. Render
+			 * systems skip the upload when the unit already holds it.
+			 */
+			virtual void setTextureMatrix(const matrix4& mat, int stage) = 0;
+
 			/**
 			 * Only required on wii, to set the number of texgens.
 			 */
@@ -464,6 +470,13 @@ namespace k
 				mActiveMaterial = mat;
 			}
 
+			/**
+			 * Apply a compiled material state. Render systems should only
+			 * send the state that differs from the one currently bound.
+			 * @param state The compiled material state.
+			 */
+			virtual void applyMaterialState(const materialState_t& state) = 0;
+
 			/**
 			 * Create and allocate a texture.
 			 * @param w Texture width.
@@ -480,6 +493,18 @@ namespace k
 			 */
 			virtual void bindTexture(platformTexturePointer* tex, int chan) = 0;
 
+			/**
+			 * Bind a texture object, marking it used so the
+			 * texture manager keeps it resident.
+			 */
+			void bindTexture(const texture* tex, int chan)
+			{
+				kAssert(tex);
+
+				tex->markUsed();
+				bindTexture(tex->getPointer(), chan);
+			}
+
 			/**
 			 * Unbind texture from a channel. If theres no texture binded, nothing happens.
 			 * @param chan A valid channel [0,7]
@@ -834,6 +859,15 @@ namespace k
 			 */
 			virtual bool isLightOn() = 0;
 
+			/**
+			 * Return the number of lights enabled
+			 * since lighting was turned on.
+			 */
+			unsigned int getLightsCount() const
+			{
+				return mLastLightIndex;
+			}
+
 			/**
 			 * Set lighting
 			 * @status If lighting is on or off.
@@ -937,6 +971,69 @@ namespace k
 			 */
 			virtual void delVBO(platformVBO* target) = 0;
 
+			/**
+			 * See if the rendersystem supports
+			 * vertex and fragment programs.
+			 */
+			virtual bool getProgramSupport() = 0;
+
+			/**
+			 * Return the number of vec4 uniforms
+			 * available to vertex programs.
+			 */
+			virtual unsigned int getProgramMaxUniforms() = 0;
+
+			/**
+			 * Compile and link a program. Fragment source can be NULL
+			 * to keep the fixed fragment pipeline.
+			 * @return True on success, false on failure.
+			 */
+			virtual bool genProgram(platformProgram* target, const char* vertex, const char* fragment) = 0;
+
+			/**
+			 * Bind a program, NULL goes back to the fixed pipeline.
+			 */
+			virtual void bindProgram(platformProgram* target) = 0;
+
+			/**
+			 * Remove program
+			 */
+			virtual void delProgram(platformProgram* target) = 0;
+
+			/**
+			 * Get the location of a program uniform, -1 if not found.
+			 */
+			virtual int getProgramUniform(platformProgram* target, const std::string& name) = 0;
+
+			/**
+			 * Get the location of a program attribute, -1 if not found.
+			 */
+			virtual int getProgramAttribute(platformProgram* target, const std::string& name) = 0;
+
+			/**
+			 * Set an integer uniform of the bound program.
+			 */
+			virtual void setProgramUniform(int location, int value) = 0;
+
+			/**
+			 * Set a vec4 array uniform of the bound program.
+			 * @param count The number of vec4 on values.
+			 */
+			virtual void setProgramUniform(int location, const vec_t* values, unsigned int count) = 0;
+
+			/**
+			 * Set a program attribute array from the bound VBO.
+			 * @param size Number of components (1-4).
+			 * @param offset Offset in bytes on the VBO.
+			 * @param stride Distance in bytes between attributes.
+			 */
+			virtual void setAttributeArray(int location, unsigned int size, unsigned int offset, unsigned int stride) = 0;
+
+			/**
+			 * Disable a program attribute array.
+			 */
+			virtual void unsetAttributeArray(int location) = 0;
+
 			/**
 			 * Get the screen width.
 			 */
@@ -161,6 +161,13 @@ namespace k
 			 */
 			void addMemoryUse(unsigned long m);
 
+			/**
+			 * Remove memory freed from the memory usage counter.
+			 *
+			 * @param[in] m The amount to remove from the counter.
+			 */
+			void removeMemoryUse(unsigned long m);
+
 			/**
 			 * Return the memory usage of resource manager allocated data.
 			 */
@@ -32,6 +32,7 @@ THE SOFTWARE.
 #include "guiManager.h"
 #include "inputManager.h"
 #include "thread.h"
+#include "workerPool.h"
 #include "particle.h"
 #include "timer.h"
 
@@ -68,6 +69,7 @@ namespace k
 			guiManager* mGuiManager;
 			inputManager* mInputManager;
 			particle::manager* mParticleManager;
+			workerPool* mWorkerPool;
 			logger* mLogger;
 
 			/**
@@ -124,6 +126,11 @@ namespace k
 			 */
 			particle::manager* getParticleManager();
 
+			/**
+			 * Returns the workerPool instance.
+			 */
+			workerPool* getWorkerPool();
+
 			/**
 			 * The global root timer.
 			 * @see timer
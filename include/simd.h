@@ -0,0 +1,398 @@
+/*
+Copyright (c) 2008-2009 Rômulo Fernandes Machado <romulo@castorgroup.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+// config.h must come before the platform prerequisites
+#include "config.h"
+#include "prerequisites.h"
+
+#ifdef __HAVE_SSE3__
+	#include <pmmintrin.h>
+#endif
+
+namespace k
+{
+	/**
+	 * Linear interpolation between two float arrays,
+	 * out[i] = a[i] + (b[i] - a[i]) * t. Arrays dont need
+	 * to be aligned and out can be a or b.
+	 */
+	inline void lerpArray(const vec_t* a, const vec_t* b, vec_t t, vec_t* out, unsigned int count)
+	{
+		unsigned int i = 0;
+
+		#ifdef __HAVE_SSE3__
+		const __m128 factor = _mm_set1_ps(t);
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 va = _mm_loadu_ps(a + i);
+			__m128 vb = _mm_loadu_ps(b + i);
+			_mm_storeu_ps(out + i, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), factor)));
+		}
+		#endif
+
+		for (; i < count; i++)
+			out[i] = a[i] + (b[i] - a[i]) * t;
+	}
+
+	/**
+	 * Multiply and add, out[i] += in[i] * factor.
+	 */
+	inline void madArray(vec_t* out, const vec_t* in, vec_t factor, unsigned int count)
+	{
+		unsigned int i = 0;
+
+		#ifdef __HAVE_SSE3__
+		const __m128 f = _mm_set1_ps(factor);
+		for (; i + 4 <= count; i += 4)
+			_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(in + i), f)));
+		#endif
+
+		for (; i < count; i++)
+			out[i] += in[i] * factor;
+	}
+
+	/**
+	 * Add a value to every element, out[i] += value.
+	 */
+	inline void addArray(vec_t* out, vec_t value, unsigned int count)
+	{
+		unsigned int i = 0;
+
+		#ifdef __HAVE_SSE3__
+		const __m128 v = _mm_set1_ps(value);
+		for (; i + 4 <= count; i += 4)
+			_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), v));
+		#endif
+
+		for (; i < count; i++)
+			out[i] += value;
+	}
+
+	/**
+	 * Scale every element, out[i] *= value.
+	 */
+	inline void mulArray(vec_t* out, vec_t value, unsigned int count)
+	{
+		unsigned int i = 0;
+
+		#ifdef __HAVE_SSE3__
+		const __m128 v = _mm_set1_ps(value);
+		for (; i + 4 <= count; i += 4)
+			_mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(out + i), v));
+		#endif
+
+		for (; i < count; i++)
+			out[i] *= value;
+	}
+
+	/**
+	 * Multiply two arrays and accumulate, out[i] += a[i] * b[i].
+	 */
+	inline void mulAddArray(vec_t* out, const vec_t* a, const vec_t* b, unsigned int count)
+	{
+		unsigned int i = 0;
+
+		#ifdef __HAVE_SSE3__
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 prod = _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+			_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), prod));
+		}
+		#endif
+
+		for (; i < count; i++)
+			out[i] += a[i] * b[i];
+	}
+
+	/**
+	 * Fractional part of a scaled and offset array,
+	 * out[i] = fract(in[i] * scale + offset), always in [0, 1).
+	 * Values must fit an int after scaling.
+	 */
+	inline void fractArray(vec_t* out, const vec_t* in, vec_t scale, vec_t offset, unsigned int count)
+	{
+		unsigned int i = 0;
+
+		#ifdef __HAVE_SSE3__
+		const __m128 s = _mm_set1_ps(scale);
+		const __m128 o = _mm_set1_ps(offset);
+		const __m128 one = _mm_set1_ps(1.0f);
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 x = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i), s), o);
+
+			// Truncation rounds negatives up, step them down once
+			__m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+			t = _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, x), one));
+			_mm_storeu_ps(out + i, _mm_sub_ps(x, t));
+		}
+		#endif
+
+		for (; i < count; i++)
+		{
+			vec_t x = in[i] * scale + offset;
+			out[i] = x - floorf(x);
+		}
+	}
+
+	/**
+	 * Sine of a cycle fraction in place, out[i] = sin(2 * pi * out[i]),
+	 * with out[i] in [0, 1). The SSE path uses a parabolic
+	 * approximation good to about 0.001.
+	 */
+	inline void sinCycleArray(vec_t* out, unsigned int count)
+	{
+		unsigned int i = 0;
+
+		#ifdef __HAVE_SSE3__
+		const __m128 half = _mm_set1_ps(0.5f);
+		const __m128 twoPi = _mm_set1_ps(6.28318530f);
+		const __m128 b = _mm_set1_ps(1.27323954f);
+		const __m128 c = _mm_set1_ps(-0.40528473f);
+		const __m128 p = _mm_set1_ps(0.225f);
+		const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+		for (; i + 4 <= count; i += 4)
+		{
+			// sin(2pi * f) = -sin(y) with y = 2pi * (f - 0.5) in [-pi, pi)
+			__m128 y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(out + i), half), twoPi);
+			__m128 s = _mm_add_ps(_mm_mul_ps(b, y), _mm_mul_ps(c, _mm_mul_ps(y, _mm_and_ps(y, absMask))));
+			s = _mm_add_ps(_mm_mul_ps(p, _mm_sub_ps(_mm_mul_ps(s, _mm_and_ps(s, absMask)), s)), s);
+			_mm_storeu_ps(out + i, _mm_sub_ps(_mm_setzero_ps(), s));
+		}
+		#endif
+
+		for (; i < count; i++)
+			out[i] = sinf(out[i] * 6.28318530f);
+	}
+
+	/**
+	 * Triangle wave of a cycle fraction in place, with out[i] in [0, 1).
+	 * Rises from 0 to 1 at a quarter cycle, falls to -1 at three quarters
+	 * and rises back to 0.
+	 */
+	inline void triangleCycleArray(vec_t* out, unsigned int count)
+	{
+		unsigned int i = 0;
+
+		#ifdef __HAVE_SSE3__
+		const __m128 quarter = _mm_set1_ps(0.25f);
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 two = _mm_set1_ps(2.0f);
+		const __m128 four = _mm_set1_ps(4.0f);
+		const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+		for (; i + 4 <= count; i += 4)
+		{
+			// 1 - |4g - 2| with g the fraction shifted by a quarter cycle
+			__m128 g = _mm_add_ps(_mm_loadu_ps(out + i), quarter);
+			g = _mm_sub_ps(g, _mm_and_ps(_mm_cmpge_ps(g, one), one));
+			__m128 d = _mm_and_ps(_mm_sub_ps(_mm_mul_ps(g, four), two), absMask);
+			_mm_storeu_ps(out + i, _mm_sub_ps(one, d));
+		}
+		#endif
+
+		for (; i < count; i++)
+		{
+			vec_t g = out[i] + 0.25f;
+			if (g >= 1.0f)
+				g -= 1.0f;
+
+			out[i] = 1.0f - fabsf(g * 4.0f - 2.0f);
+		}
+	}
+
+	/**
+	 * Normalize count 3 component vectors spaced stride floats apart.
+	 * Zero vectors are left as they are. The SSE path uses rsqrt
+	 * refined with one Newton step.
+	 */
+	inline void normalizeVectors(vec_t* data, unsigned int stride, unsigned int count)
+	{
+		unsigned int i = 0;
+
+		#ifdef __HAVE_SSE3__
+		const __m128 half = _mm_set1_ps(0.5f);
+		const __m128 threeHalves = _mm_set1_ps(1.5f);
+		const __m128 tiny = _mm_set1_ps(1e-20f);
+		for (; i + 4 <= count; i += 4)
+		{
+			vec_t* v0 = data + i * stride;
+			vec_t* v1 = v0 + stride;
+			vec_t* v2 = v1 + stride;
+			vec_t* v3 = v2 + stride;
+
+			__m128 x = _mm_setr_ps(v0[0], v1[0], v2[0], v3[0]);
+			__m128 y = _mm_setr_ps(v0[1], v1[1], v2[1], v3[1]);
+			__m128 z = _mm_setr_ps(v0[2], v1[2], v2[2], v3[2]);
+
+			__m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+			len2 = _mm_max_ps(len2, tiny);
+
+			__m128 r = _mm_rsqrt_ps(len2);
+			r = _mm_mul_ps(r, _mm_sub_ps(threeHalves, _mm_mul_ps(_mm_mul_ps(half, len2), _mm_mul_ps(r, r))));
+
+			vec_t out[12];
+			_mm_storeu_ps(out, _mm_mul_ps(x, r));
+			_mm_storeu_ps(out + 4, _mm_mul_ps(y, r));
+			_mm_storeu_ps(out + 8, _mm_mul_ps(z, r));
+
+			v0[0] = out[0]; v0[1] = out[4]; v0[2] = out[8];
+			v1[0] = out[1]; v1[1] = out[5]; v1[2] = out[9];
+			v2[0] = out[2]; v2[1] = out[6]; v2[2] = out[10];
+			v3[0] = out[3]; v3[1] = out[7]; v3[2] = out[11];
+		}
+		#endif
+
+		for (; i < count; i++)
+		{
+			vec_t* v = data + i * stride;
+			vec_t len = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+			if (len > 0)
+			{
+				vec_t inv = 1.0f / len;
+				v[0] *= inv;
+				v[1] *= inv;
+				v[2] *= inv;
+			}
+		}
+	}
+
+	#ifdef __HAVE_SSE3__
+	/**
+	 * Swap bytes 0 and 2 of every 32 bit lane.
+	 */
+	inline __m128i _swapRedBlue(__m128i pixels)
+	{
+		const __m128i keep = _mm_set1_epi32(0xff00ff00);
+		const __m128i low = _mm_set1_epi32(0x000000ff);
+
+		__m128i red = _mm_and_si128(_mm_srli_epi32(pixels, 16), low);
+		__m128i blue = _mm_slli_epi32(_mm_and_si128(pixels, low), 16);
+		return _mm_or_si128(_mm_and_si128(pixels, keep), _mm_or_si128(red, blue));
+	}
+	#endif
+
+	/**
+	 * Swap red and blue of 32 bit pixels (RGBA <-> BGRA),
+	 * out can be in.
+	 */
+	inline void swapRedBlue(const unsigned char* in, unsigned char* out, unsigned int count)
+	{
+		unsigned int i = 0;
+
+		#ifdef __HAVE_SSE3__
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128i pixels = _mm_loadu_si128((const __m128i*) (in + i * 4));
+			_mm_storeu_si128((__m128i*) (out + i * 4), _swapRedBlue(pixels));
+		}
+		#endif
+
+		for (; i < count; i++)
+		{
+			const unsigned char* src = in + i * 4;
+			unsigned char* dst = out + i * 4;
+			unsigned char red = src[0];
+
+			dst[0] = src[2];
+			dst[1] = src[1];
+			dst[2] = red;
+			dst[3] = src[3];
+		}
+	}
+
+	/**
+	 * Expand 24 bit pixels to 32 bit with opaque alpha,
+	 * optionally swapping red and blue (RGB -> BGRA).
+	 */
+	inline void expandRGBToRGBA(const unsigned char* in, unsigned char* out, unsigned int count, bool swap)
+	{
+		unsigned int i = 0;
+
+		#ifdef __HAVE_SSE3__
+		const __m128i alpha = _mm_set1_epi32(0xff000000);
+
+		// Each load reads 16 bytes for 12 used, keep clear of the end
+		for (; i + 6 <= count; i += 4)
+		{
+			__m128i src = _mm_loadu_si128((const __m128i*) (in + i * 3));
+			__m128i lo = _mm_unpacklo_epi32(src, _mm_srli_si128(src, 3));
+			__m128i hi = _mm_unpacklo_epi32(_mm_srli_si128(src, 6), _mm_srli_si128(src, 9));
+			__m128i pixels = _mm_or_si128(_mm_unpacklo_epi64(lo, hi), alpha);
+
+			if (swap)
+				pixels = _swapRedBlue(pixels);
+
+			_mm_storeu_si128((__m128i*) (out + i * 4), pixels);
+		}
+		#endif
+
+		const unsigned int r = swap ? 2 : 0;
+		const unsigned int b = swap ? 0 : 2;
+		for (; i < count; i++)
+		{
+			const unsigned char* src = in + i * 3;
+			unsigned char* dst = out + i * 4;
+
+			dst[0] = src[r];
+			dst[1] = src[1];
+			dst[2] = src[b];
+			dst[3] = 0xff;
+		}
+	}
+
+	/**
+	 * Expand 8 bit luminance to opaque 32 bit pixels.
+	 */
+	inline void expandGrayToRGBA(const unsigned char* in, unsigned char* out, unsigned int count)
+	{
+		unsigned int i = 0;
+
+		#ifdef __HAVE_SSE3__
+		const __m128i alpha = _mm_set1_epi32(0xff000000);
+		for (; i + 16 <= count; i += 16)
+		{
+			__m128i src = _mm_loadu_si128((const __m128i*) (in + i));
+			__m128i lo = _mm_unpacklo_epi8(src, src);
+			__m128i hi = _mm_unpackhi_epi8(src, src);
+
+			__m128i* dst = (__m128i*) (out + i * 4);
+			_mm_storeu_si128(dst, _mm_or_si128(_mm_unpacklo_epi16(lo, lo), alpha));
+			_mm_storeu_si128(dst + 1, _mm_or_si128(_mm_unpackhi_epi16(lo, lo), alpha));
+			_mm_storeu_si128(dst + 2, _mm_or_si128(_mm_unpacklo_epi16(hi, hi), alpha));
+			_mm_storeu_si128(dst + 3, _mm_or_si128(_mm_unpackhi_epi16(hi, hi), alpha));
+		}
+		#endif
+
+		for (; i < count; i++)
+		{
+			unsigned char* dst = out + i * 4;
+			dst[0] = dst[1] = dst[2] = in[i];
+			dst[3] = 0xff;
+		}
+	}
+}
+
+#endif
+
@@ -31,6 +31,8 @@ THE SOFTWARE.
 
 namespace k 
 {
+	class camera;
+
 	/**
 	 * \brief Automatic oriented (always facing camera) finite planes with textures.
 	 *
@@ -181,6 +183,105 @@ namespace k
 			 */
 			void rawDraw();
 	};
+
+	/**
+	 * Texture coordinates layout of batched quads, 
+	 * matching sprite::draw or sprite::rawDraw.
+	 */
+	typedef enum
+	{
+		SPRITEUV_DRAW,
+		SPRITEUV_RAWDRAW
+	} spriteUVLayout_t;
+
+	/**
+	 * \brief Camera facing quads drawn with a single call.
+	 * Quads of many sprites (or particles) are expanded on one SIMD 
+	 * pass into a streaming buffer, all of them facing the camera
+	 * plane. The caller sets the material and the modelview before
+	 * calling draw(). Only used when point sprites arent supported.
+	 */
+	class DLL_EXPORT spriteBatch
+	{
+		private:
+			/**
+			 * Staging buffer, texture coordinates of mCapacity quads
+			 * (written once by reserve) followed by the vertices
+			 * of mCount quads, always at mCapacity * 8.
+			 */
+			vec_t* mBuffer;
+
+			/**
+			 * Positions and radius of gathered sprites.
+			 */
+			vec_t* mGather;
+
+			unsigned int mCapacity;
+			unsigned int mCount;
+
+			spriteUVLayout_t mLayout;
+
+			/**
+			 * Quad corners for a unit radius.
+			 */
+			vector3 mCorners[4];
+
+			platformVBO mVBO;
+			bool mHaveVBO;
+
+		public:
+			/**
+			 * Constructor.
+			 * @param layout Texture coordinates of each quad.
+			 */
+			spriteBatch(spriteUVLayout_t layout = SPRITEUV_DRAW);
+
+			/**
+			 * Destructor.
+			 */
+			~spriteBatch();
+
+			/**
+			 * Make room for count quads.
+			 */
+			bool reserve(unsigned int count);
+
+			/**
+			 * Orient the quads to the camera. Without a camera quads
+			 * face the z axis.
+			 */
+			void setCamera(const camera* cam);
+
+			/**
+			 * Expand quads from arrays of positions and radius.
+			 * @param x,y,z Positions, relative to origin.
+			 * @param radius Quads radius.
+			 * @param count Number of quads.
+			 * @param origin Added to every position.
+			 * @param screenRadius Radius are in screen units (like 
+			 * sprite::setRadius) and must be converted.
+			 */
+			void build(const vec_t* x, const vec_t* y, const vec_t* z, const vec_t* radius,
+				unsigned int count, const vector3& origin, bool screenRadius);
+
+			/**
+			 * Expand quads of sprites.
+			 */
+			void build(sprite* const* sprites, unsigned int count);
+
+			/**
+			 * Number of quads built.
+			 */
+			unsigned int getCount() const
+			{
+				return mCount;
+			}
+
+			/**
+			 * Draw all built quads.
+			 */
+			void draw();
+	};
 }
 
 #endif
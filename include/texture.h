@@ -122,6 +122,16 @@ namespace k
 			 */
 			std::string mFilename;
 
+			/**
+			 * Drawing a placeholder until setData is called.
+			 */
+			bool mPending;
+
+			/**
+			 * Bound since the texture manager last checked.
+			 */
+			mutable bool mUsed;
+
 		public:
 			/**
 			 * On each platform, it will load the right texture file and 
@@ -140,6 +150,30 @@ namespace k
 				mWidth = w;
 				mHeight = h;
 				mFormat = format;
+				mPending = false;
+				mUsed = false;
+			}
+
+			/**
+			 * Start a texture drawn as placeholder until
+			 * setData is called, used by asynchronous loading.
+			 */
+			texture(const texture* placeholder, int flags)
+			{
+				kAssert(placeholder);
+				kAssert(placeholder->getPointer());
+
+				// Shares the placeholder image, never changes its state
+				mPointer = new platformTexturePointer;
+				*mPointer = *placeholder->getPointer();
+
+				mWidth = placeholder->getWidth();
+				mHeight = placeholder->getHeight();
+				mFormat = placeholder->getFormat();
+				mFlags = flags;
+				mRawData = NULL;
+				mPending = true;
+				mUsed = false;
 			}
 
 			/**
@@ -152,6 +186,53 @@ namespace k
 			 */
 			~texture();
 
+			/**
+			 * Decode an image file into BGRA pixels allocated with new [].
+			 * Touches no render state, so it can run on any thread.
+			 * @return The pixels, NULL on failure.
+			 */
+			static unsigned char* decodeFile(const std::string& filename, unsigned int* width, unsigned int* height);
+
+			/**
+			 * Upload decoded BGRA pixels, replacing the placeholder.
+			 * Must be called on the render thread.
+			 */
+			void setData(const unsigned char* data, unsigned int w, unsigned int h);
+
+			/**
+			 * Is this texture still drawing its placeholder?
+			 */
+			bool isPending() const
+			{ return mPending; }
+
+			/**
+			 * Release the texture image, drawing placeholder until setData
+			 * is called again. Must be called on the render thread.
+			 */
+			void evict(const texture* placeholder);
+
+			/**
+			 * Bytes taken by the texture image, none for placeholders.
+			 */
+			unsigned long getMemoryUse() const
+			{ return (mPointer && !mPending) ? 4 * mWidth * mHeight : 0; }
+
+			/**
+			 * Mark the texture as bound, see textureManager::update.
+			 */
+			void markUsed() const
+			{ mUsed = true; }
+
+			/**
+			 * Returns and clears the bound mark.
+			 */
+			bool takeUsed()
+			{
+				bool used = mUsed;
+				mUsed = false;
+				return used;
+			}
+
 			/**
 			 * Needs platform specific implementations.
 			 * Set the texture flags, in case you want to relate the texture
@@ -26,6 +26,7 @@ THE SOFTWARE.
 #include "prerequisites.h"
 #include "singleton.h"
 #include "texture.h"
+#include "thread.h"
 
 #define DEFAULT_WRAP (FLAG_CLAMP_EDGE_S | FLAG_CLAMP_EDGE_T | FLAG_CLAMP_EDGE_R)
 
@@ -36,6 +37,36 @@ namespace k
 
 	typedef std::map<int, texture*> textureHash;
 
+	/**
+	 * A texture being decoded by the worker pool.
+	 */
+	typedef struct
+	{
+		texture* target;
+		std::string filename;
+
+		// Decoded BGRA pixels, NULL if decoding failed
+		unsigned char* data;
+		unsigned int width;
+		unsigned int height;
+	} textureLoad_t;
+
+	/**
+	 * Residency of a texture loaded from file, which
+	 * can be evicted and loaded again when bound.
+	 */
+	typedef struct
+	{
+		std::string filename;
+		unsigned int lastUsed;
+		bool loading;
+
+		// Decoding failed, keeps drawing the placeholder
+		bool failed;
+	} textureResidency_t;
+
+	typedef std::map<texture*, textureResidency_t> textureResidencyMap;
+
 	/**
 	 * \brief Handling texture loading and data allocation.
 	 */
@@ -44,6 +75,55 @@ namespace k
 		private:
 			textureHash mTextures;
 
+			/**
+			 * Asynchronous loading, textures are decoded by the worker
+			 * pool and uploaded by update() on the render thread.
+			 */
+			bool mAsyncLoading;
+			unsigned int mPendingLoads;
+			std::list<textureLoad_t*> mFinishedLoads;
+
+			platformMutex mLoadMutex;
+			platformCondition mLoadCondition;
+
+			/**
+			 * Texture memory budget in bytes (0 means unlimited)
+			 * and the use counted on the last update().
+			 */
+			unsigned long mMemoryBudget;
+			unsigned long mMemoryUse;
+
+			unsigned int mFrame;
+			textureResidencyMap mResidency;
+
+			/**
+			 * Load an evicted texture again.
+			 */
+			void _reload(texture* tex, textureResidency_t& residency);
+
+			/**
+			 * Evict least recently used textures until
+			 * the memory use fits the budget.
+			 */
+			void _evict();
+
+			/**
+			 * Worker job, decodes a textureLoad_t.
+			 */
+			static void decodeJob(void* data);
+
+			/**
+			 * Push a decode job for a placeholder texture,
+			 * returns false if it could not be queued.
+			 */
+			bool _queueLoad(texture* target, const std::string& filename);
+
+			/**
+			 * Upload finished loads, optionally blocking until
+			 * every pending load is finished.
+			 */
+			void _finishLoads(bool wait);
+
 		public:
 			/**
 			 * Constructor.
@@ -76,6 +156,53 @@ namespace k
 			 * Create system textures. (k_base_white, k_base_black, k_base_null)
 			 */
 			void createSystemTextures();
+
+			/**
+			 * Decode new textures on the worker pool. Textures are returned
+			 * right away drawing k_base_null until their data is uploaded.
+			 * Only available on PC, enabled by default.
+			 */
+			void setAsyncLoading(bool async)
+			{ mAsyncLoading = async; }
+
+			bool getAsyncLoading() const
+			{ return mAsyncLoading; }
+
+			/**
+			 * Number of textures still drawing their placeholder,
+			 * useful to keep a loading screen up.
+			 */
+			unsigned int getPendingLoads();
+
+			/**
+			 * Upload textures that finished decoding, load evicted
+			 * textures bound last frame and enforce the memory budget.
+			 * Called by the renderer at the start of every frame.
+			 */
+			void update();
+
+			/**
+			 * Set the texture memory budget in bytes, textures not used
+			 * on the last frame are evicted above it. 0 disables it.
+			 * Only available on PC.
+			 */
+			void setMemoryBudget(unsigned long bytes)
+			{ mMemoryBudget = bytes; }
+
+			unsigned long getMemoryBudget() const
+			{ return mMemoryBudget; }
+
+			/**
+			 * Memory taken by textures loaded from file,
+			 * as counted on the last update().
+			 */
+			unsigned long getMemoryUse() const
+			{ return mMemoryUse; }
+
+			/**
+			 * Block until every pending texture is uploaded.
+			 */
+			void flushLoads();
 	};
 }
 
@@ -43,6 +43,18 @@ namespace k
 	extern void lockKMutex(platformMutex* m);
 	extern void unlockKMutex(platformMutex* m);
 	extern void destroyKMutex(platformMutex* m);
+
+	extern void createKCondition(platformCondition* c);
+	extern void waitKCondition(platformCondition* c, platformMutex* m);
+	extern void signalKCondition(platformCondition* c);
+	extern void broadcastKCondition(platformCondition* c);
+	extern void destroyKCondition(platformCondition* c);
+
+	/**
+	 * Returns the number of processors available
+	 * to the application.
+	 */
+	extern unsigned int getKProcessorsCount();
 }
 
 #endif
@@ -44,6 +44,7 @@ THE SOFTWARE.
 #include <sys/dir.h>
 #include <ogc/lwp.h>
 #include <ogc/mutex.h>
+#include <ogc/cond.h>
 #include <ogc/lwp_watchdog.h>
 #include <malloc.h>
 #include <wiiuse/wpad.h>
@@ -51,8 +52,10 @@ THE SOFTWARE.
 
 typedef lwp_t 				platformThread;
 typedef mutex_t 			platformMutex;
+typedef cond_t 				platformCondition;
 typedef GXTexObj 			platformTexturePointer;
 typedef char 				platformVBO;
+typedef char 				platformProgram;
 typedef long long			platformTimer;
 typedef f32 				vec_t;
 typedef u16 				index_t;
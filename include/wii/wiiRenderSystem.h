@@ -186,6 +186,7 @@ namespace k
 			void setTexEnv(texEnvMode mode, int stage);
 			void setTextureUnits(int i);
 			void setTextureGenerations(int i);
+			void setTextureMatrix(const matrix4& mat, int stage) {}
 			void setColorChannels(int i);
 			void setInverseTransposeModelview(const matrix4& mat);
 
@@ -215,6 +216,7 @@ namespace k
 			void matAmbient(const color& color);
 			void matDiffuse(const color& color);
 			void matSpecular(const color& color);
+			void applyMaterialState(const materialState_t& state);
 
 			void genTexture(uint32_t w, uint32_t h, uint32_t bpp, platformTexturePointer* tex);
 			void bindTexture(platformTexturePointer* tex, int chan);
@@ -253,6 +255,18 @@ namespace k
 			void setVBOData(VBOArrayType type, int size, void* data, VBOUsage use) {}
 			void delVBO(platformVBO* target) {}
 
+			bool getProgramSupport() { return false; }
+			unsigned int getProgramMaxUniforms() { return 0; }
+			bool genProgram(platformProgram* target, const char* vertex, const char* fragment) { return false; }
+			void bindProgram(platformProgram* target) {}
+			void delProgram(platformProgram* target) {}
+			int getProgramUniform(platformProgram* target, const std::string& name) { return -1; }
+			int getProgramAttribute(platformProgram* target, const std::string& name) { return -1; }
+			void setProgramUniform(int location, int value) {}
+			void setProgramUniform(int location, const vec_t* values, unsigned int count) {}
+			void setAttributeArray(int location, unsigned int size, unsigned int offset, unsigned int stride) {}
+			void unsetAttributeArray(int location) {}
+
 			unsigned int getScreenWidth();
 			unsigned int getScreenHeight();
 	};
@@ -0,0 +1,129 @@
+/*
+Copyright (c) 2008-2009 Rômulo Fernandes Machado <romulo@castorgroup.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _WORKER_POOL_H_
+#define _WORKER_POOL_H_
+
+#include "prerequisites.h"
+#include "singleton.h"
+#include "thread.h"
+
+namespace k
+{
+	/**
+	 * A job function, receives the pointer given
+	 * when the job was pushed.
+	 */
+	typedef void (*jobFunction)(void* data);
+
+	typedef struct
+	{
+		jobFunction function;
+		void* data;
+	} job_t;
+
+	/**
+	 * \brief A small pool of worker threads.
+	 * The pool runs independent jobs (like skinning of models)
+	 * on every available processor. The thread that calls wait()
+	 * also runs jobs until the queue is empty, so a pool without
+	 * workers (single core platforms) still runs everything.
+	 */
+	class DLL_EXPORT workerPool : public singleton<workerPool>
+	{
+		private:
+			platformThread* mThreads;
+			unsigned int mThreadsCount;
+
+			std::deque<job_t> mJobs;
+			unsigned int mPendingJobs;
+
+			/**
+			 * Long running jobs (like texture decoding), only
+			 * picked when there is no frame work queued.
+			 */
+			std::deque<job_t> mBackgroundJobs;
+			bool mRunning;
+
+			platformMutex mMutex;
+			platformCondition mJobCondition;
+			platformCondition mDoneCondition;
+
+			/**
+			 * Worker threads main loop.
+			 */
+			static void* workerLoop(void* pool);
+
+			/**
+			 * Mark one job as finished, waking
+			 * up anyone waiting on the pool.
+			 */
+			void finishJob();
+
+		public:
+			/**
+			 * Constructor.
+			 * @param threads Number of worker threads, 0 means
+			 * one worker per processor (excluding the calling one).
+			 */
+			workerPool(unsigned int threads = 0);
+
+			/**
+			 * Destructor, stop and join all workers.
+			 */
+			~workerPool();
+
+			/**
+			 * Returns the workerPool singleton instance.
+			 */
+			static workerPool& getSingleton();
+
+			/**
+			 * Returns the number of worker threads.
+			 */
+			unsigned int getThreadsCount() const
+			{
+				return mThreadsCount;
+			}
+
+			/**
+			 * Push a new job into the pool. Jobs
+			 * must not depend on each other.
+			 */
+			void pushJob(jobFunction function, void* data);
+
+			/**
+			 * Push a job that is not waited on by wait(). Without
+			 * workers it runs right now on the calling thread.
+			 */
+			void pushBackgroundJob(jobFunction function, void* data);
+
+			/**
+			 * Run queued jobs on the calling thread and
+			 * block until every pushed job is finished.
+			 */
+			void wait();
+	};
+}
+
+#endif
+
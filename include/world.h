@@ -48,6 +48,56 @@ namespace k
 			 * @param viewer The active camera on the renderer.
 			 */
 			virtual void draw(const camera* viewer) = 0;
+
+			/**
+			 * Trace a segment (or a sphere, if radius is not zero)
+			 * against the world, for scene queries.
+			 * @param start Segment start.
+			 * @param end Segment end.
+			 * @param radius Sphere radius, zero for rays.
+			 * @param flags World specific content flags, zero for any.
+			 * @param fraction Receives how far along the segment the hit is [0, 1].
+			 * @param normal Receives the hit normal.
+			 * @return true if the world was hit.
+			 */
+			virtual bool traceSegment(const vector3& start, const vector3& end, vec_t radius, 
+				int flags, vec_t& fraction, vector3& normal)
+			{
+				return false;
+			}
+
+			/**
+			 * Returns false if a box cant be seen from the viewer,
+			 * like boxes on hidden clusters of a bsp.
+			 * @param mins Box minimum point.
+			 * @param maxs Box maximum point.
+			 * @param viewer The active camera on the renderer.
+			 */
+			virtual bool isBoxVisible(const vector3& mins, const vector3& maxs, const camera* viewer) const
+			{
+				return true;
+			}
+
+			/**
+			 * Trace many segments against the world at once. Worlds 
+			 * used from several threads (like particle collision) 
+			 * must make this thread safe.
+			 * @param starts Segments start.
+			 * @param ends Segments end.
+			 * @param count Number of segments.
+			 * @param flags World specific content flags, zero for any.
+			 * @param fractions Receives how far along each segment the hit is, 1 on a miss.
+			 * @param normals Receives the hit normals.
+			 */
+			virtual void traceSegments(const vector3* starts, const vector3* ends, unsigned int count,
+				int flags, vec_t* fractions, vector3* normals)
+			{
+				for (unsigned int i = 0; i < count; i++)
+				{
+					if (!traceSegment(starts[i], ends[i], 0, flags, fractions[i], normals[i]))
+						fractions[i] = 1.0f;
+				}
+			}
 	};
 }
 
@@ -29,6 +29,9 @@ THE SOFTWARE.
 namespace k {
 
 #define Q3_EPSILON 1.0f/8.0f
+
+// Batches touching more brushes than this walk the tree per segment
+#define Q3_BATCH_MAX_BRUSHES 32
 			
 void q3BitSet::configure(int i)
 {
@@ -212,6 +215,74 @@ void q3Bsp::_clean()
 
 	if (mLightmaps)
 		delete [] mLightmaps;
+
+	std::map<const q3BspVertex*, q3BspDeformCache>::iterator it;
+	for (it = mDeformCache.begin(); it != mDeformCache.end(); it++)
+	{
+		material::destroyDeformSurface(it->second.surface);
+		free(it->second.vertices);
+	}
+
+	mDeformCache.clear();
+}
+
+const q3BspVertex* q3Bsp::_deformVertices(const material* mat, const q3BspVertex* source, unsigned int count)
+{
+	kAssert(mat);
+	kAssert(source);
+
+	std::map<const q3BspVertex*, q3BspDeformCache>::iterator it = mDeformCache.find(source);
+	if (it == mDeformCache.end())
+	{
+		q3BspDeformCache cache;
+		cache.surface = material::createDeformSurface(count);
+		if (!cache.surface)
+			return source;
+
+		cache.vertices = (q3BspVertex*) memalign(32, count * sizeof(q3BspVertex));
+		if (!cache.vertices)
+		{
+			S_LOG_INFO("Failed to allocate deformed vertices.");
+			material::destroyDeformSurface(cache.surface);
+			return source;
+		}
+
+		memcpy(cache.vertices, source, count * sizeof(q3BspVertex));
+
+		// Split the source once, deforms only read it back
+		deformSurface_t* surface = cache.surface;
+		for (unsigned int i = 0; i < count; i++)
+		{
+			for (unsigned int c = 0; c < 3; c++)
+			{
+				surface->position[c][i] = source[i].pos[c];
+				surface->normal[c][i] = source[i].normal[c];
+			}
+
+			surface->uv[0][i] = source[i].uv[0];
+			surface->uv[1][i] = source[i].uv[1];
+		}
+
+		it = mDeformCache.insert(std::make_pair(source, cache)).first;
+	}
+
+	const float time = root::getSingleton().getRenderer()->getFrameStartTime() / 1000.0f;
+	const vector3 right = mViewer ? mViewer->getRight() : vector3(1, 0, 0);
+	const vector3 up = mViewer ? mViewer->getUp() : vector3(0, 0, 1);
+
+	deformSurface_t* surface = it->second.surface;
+	q3BspVertex* vertices = it->second.vertices;
+	if (mat->deform(surface, time, right, up))
+	{
+		for (unsigned int i = 0; i < count; i++)
+		{
+			vertices[i].pos[0] = surface->output[0][i];
+			vertices[i].pos[1] = surface->output[1][i];
+			vertices[i].pos[2] = surface->output[2][i];
+		}
+	}
+
+	return vertices;
 }
 	
 void q3Bsp::loadQ3Bsp(const std::string& filename)
@@ -918,11 +989,13 @@ void q3Bsp::renderPatch(int i)
 		kAssert(patchVertices);
 
 		const unsigned int patchVertexCount = thisPatch->getVertexCount();
+		if (materialOfFace && materialOfFace->hasDeforms())
+			patchVertices = _deformVertices(materialOfFace, patchVertices, patchVertexCount);
 
 		for (unsigned int j = 0; j < thisPatch->getLevel(); j++)
 		{
 			if (materialOfFace)
-				materialOfFace->start();
+				materialOfFace->start(mDrawLightmaps && patchFace->lmId >= 0);
 
 			rs->clearArrayDesc(VERTEXMODE_TRI_STRIP);
 			rs->setVertexArray(patchVertices[0].pos, sizeof(q3BspVertex));
@@ -970,7 +1043,7 @@ void q3Bsp::renderFace(int i)
 	renderSystem* rs = root::getSingleton().getRenderSystem();
 
 	if (materialOfFace)
-		materialOfFace->start();
+		materialOfFace->start(mDrawLightmaps && faceToRender->lmId >= 0);
 
 	if (faceToRender->lmId < 0 && !materialOfFace)
 		return;
@@ -1016,13 +1089,18 @@ void q3Bsp::renderFace(int i)
 	}
 	else
 	{
+		// Only visible faces reach here, deform them now
+		const q3BspVertex* faceVertices = &mVertices[faceToRender->startVertIndex];
+		if (materialOfFace && materialOfFace->hasDeforms())
+			faceVertices = _deformVertices(materialOfFace, faceVertices, faceToRender->numVertices);
+
 		rs->clearArrayDesc();
-		rs->setVertexArray(mVertices[faceToRender->startVertIndex].pos, sizeof(q3BspVertex));
-		rs->setNormalArray(mVertices[faceToRender->startVertIndex].normal, sizeof(q3BspVertex));
+		rs->setVertexArray(faceVertices[0].pos, sizeof(q3BspVertex));
+		rs->setNormalArray(faceVertices[0].normal, sizeof(q3BspVertex));
 
 		if (materialOfFace)
 		{
-			rs->setTexCoordArray(mVertices[faceToRender->startVertIndex].uv, sizeof(q3BspVertex));
+			rs->setTexCoordArray(faceVertices[0].uv, sizeof(q3BspVertex));
 
 			if (mDrawLightmaps && faceToRender->lmId >= 0)
 			{
@@ -1030,8 +1108,7 @@ void q3Bsp::renderFace(int i)
 				const int stages = materialOfFace->getStagesCount();
 				rs->bindTexture(mLightmaps[faceToRender->lmId]->getPointer(), stages);
 				rs->setTexEnv(TEX_ENV_MODULATE, stages);
-				rs->setTexCoordArray(mVertices[faceToRender->startVertIndex].lmUv, 
-						sizeof(q3BspVertex), stages);
+				rs->setTexCoordArray(faceVertices[0].lmUv, sizeof(q3BspVertex), stages);
 			}
 		}
 
@@ -1049,6 +1126,7 @@ void q3Bsp::renderFace(int i)
 void q3Bsp::draw(const camera* viewer)
 {
 	mFaceSet.clear();
+	mViewer = viewer;
 
 	const int leafIndex = findLeaf(viewer->getPosition());
 	const int cluster = mLeafs[leafIndex].cluster;
@@ -1110,6 +1188,61 @@ bool q3Bsp::isClusterVisible(int curr, int targ) const
 	return (visSet & (1 << (targ & 7)));
 }
 
+bool q3Bsp::_isBoxVisible(int index, const vector3& mins, const vector3& maxs, int cluster) const
+{
+	while (index >= 0)
+	{
+		const q3BspNode* node = &mNodes[index];
+		const q3BspPlane* plane = &mPlanes[node->plane];
+
+		// Nearest and farthest box distances from the plane
+		const vector3 center = (mins + maxs) * 0.5f;
+		const vector3 extents = maxs - center;
+
+		const vector3 planeNormal(plane->normal[0], plane->normal[1], plane->normal[2]);
+		const vec_t distance = center.dotProduct(planeNormal) - plane->dist;
+		const vec_t radius = fabs(extents.x * planeNormal.x) + fabs(extents.y * planeNormal.y) + 
+			fabs(extents.z * planeNormal.z);
+
+		// Front
+		if (distance >= radius)
+		{
+			index = node->children[0];
+		}
+		// Back
+		else
+		if (distance < -radius)
+		{
+			index = node->children[1];
+		}
+		// Both
+		else
+		{
+			if (_isBoxVisible(node->children[0], mins, maxs, cluster))
+				return true;
+
+			index = node->children[1];
+		}
+	}
+
+	const q3BspLeaf* leaf = &mLeafs[~index];
+	if (leaf->cluster < 0)
+		return false;
+
+	return isClusterVisible(cluster, leaf->cluster);
+}
+
+bool q3Bsp::isBoxVisible(const vector3& mins, const vector3& maxs, const camera* viewer) const
+{
+	kAssert(viewer);
+
+	if (!mNodesCount || !mLeafsCount)
+		return true;
+
+	const int cluster = mLeafs[findLeaf(viewer->getPosition())].cluster;
+	return _isBoxVisible(0, mins, maxs, cluster);
+}
+
 int q3Bsp::findLeaf(const vector3& viewerPos) const
 {
 	int i = 0;
@@ -1142,7 +1275,7 @@ static inline float q3DotProduct(const vector3& a, const vec_t* b)
 }
 
 			
-void q3Bsp::checkBrush(const q3BspBrush* brush)
+void q3Bsp::checkBrush(const q3BspBrush* brush, q3BspTraceWork& work) const
 {
 	float startFraction = -1.0f;
 	float endFraction = 1.0f;
@@ -1151,11 +1284,11 @@ void q3Bsp::checkBrush(const q3BspBrush* brush)
 
 	for (int i = 0; i < brush->numSides; i++)
 	{
-		q3BspBrushSide* thisSide = &mBrushSides[brush->firstSide + i];
-		q3BspPlane* thisPlane = &mPlanes[thisSide->planeIndex];
+		const q3BspBrushSide* thisSide = &mBrushSides[brush->firstSide + i];
+		const q3BspPlane* thisPlane = &mPlanes[thisSide->planeIndex];
 
-		float startDist = q3DotProduct(mTraceStart, thisPlane->normal) - thisPlane->dist;	
-		float endDist = q3DotProduct(mTraceEnd, thisPlane->normal) - thisPlane->dist;	
+		float startDist = q3DotProduct(work.start, thisPlane->normal) - thisPlane->dist;	
+		float endDist = q3DotProduct(work.end, thisPlane->normal) - thisPlane->dist;	
 
 		if (startDist > 0)
 			startsOut = true;
@@ -1179,7 +1312,7 @@ void q3Bsp::checkBrush(const q3BspBrush* brush)
 				startFraction = fraction;
 
 				// Copy plane normal
-				mTempTrace.planeNormal = k::vector3(thisPlane->normal[0],
+				work.result.planeNormal = k::vector3(thisPlane->normal[0],
 						thisPlane->normal[1], thisPlane->normal[2]);
 			}
 		}
@@ -1194,21 +1327,21 @@ void q3Bsp::checkBrush(const q3BspBrush* brush)
 
 	if (!startsOut)
 	{
-		mTempTrace.startsOut = false;
+		work.result.startsOut = false;
 		if (!endsOut)
-			mTempTrace.enclosedInSolid = true;
+			work.result.enclosedInSolid = true;
 
 		return;
 	}
 
 	if (startFraction < endFraction)
 	{
-		if (startFraction > -1 && startFraction < mTempTrace.fraction)
+		if (startFraction > -1 && startFraction < work.result.fraction)
 		{
 			if (startFraction < 0)
 				startFraction = 0;
 
-			mTempTrace.fraction = startFraction;
+			work.result.fraction = startFraction;
 		}
 	}
 }
@@ -1218,24 +1351,24 @@ bool q3Bsp::getLoadSuccess()
 	return mSuccessfullyLoaded;
 }
 
-void q3Bsp::checkNode(int index, const float startFraction, const float endFraction,
-					const vector3& start, const vector3& end)
+void q3Bsp::checkNode(q3BspTraceWork& work, int index, const float startFraction, 
+					const float endFraction, const vector3& start, const vector3& end) const
 {
 	// we hit a leaf, go through it =]
 	if (index < 0)
 	{
-		q3BspLeaf* thisLeaf = &mLeafs[~index];
+		const q3BspLeaf* thisLeaf = &mLeafs[~index];
 		for (int i = 0; i < thisLeaf->numLeafBrush; i++)
 		{
 			unsigned int realIndex = mLeafBrushes[thisLeaf->firstLeafBrush + i];
 		
 			// Go go brushes!
-			q3BspBrush* thisBrush = &mBrushes[realIndex];
+			const q3BspBrush* thisBrush = &mBrushes[realIndex];
 
 			if ((thisBrush->numSides > 0) &&
-				(!mTraceFlags || (mMaterials[thisBrush->shaderNum]->getContentFlags() & mTraceFlags)))
+				(!work.flags || (mMaterials[thisBrush->shaderNum]->getContentFlags() & work.flags)))
 			{
-				checkBrush(thisBrush);
+				checkBrush(thisBrush, work);
 			}
 		}
 
@@ -1243,21 +1376,21 @@ void q3Bsp::checkNode(int index, const float startFraction, const float endFract
 	}
 
 	// Lets walk through the tree to find the leaf
-	q3BspNode* thisNode = &mNodes[index];
-	q3BspPlane* thisPlane = &mPlanes[thisNode->plane];
+	const q3BspNode* thisNode = &mNodes[index];
+	const q3BspPlane* thisPlane = &mPlanes[thisNode->plane];
 
 	float startDist = q3DotProduct(start, thisPlane->normal) - thisPlane->dist;
 	float endDist = q3DotProduct(end, thisPlane->normal) - thisPlane->dist;
 	float offset = 0;
 
-	switch (mTraceType)
+	switch (work.type)
 	{
 		default:
 		case TRACE_TYPE_RAY:
 			offset = 0;
 			break;
 		case TRACE_TYPE_SPHERE:
-			offset = mTraceRadius;
+			offset = work.radius;
 			break;
 		case TRACE_TYPE_BOX:
 			// TODO
@@ -1267,13 +1400,13 @@ void q3Bsp::checkNode(int index, const float startFraction, const float endFract
 	// In front of plane
 	if (startDist >= offset && endDist >= offset)
 	{
-		checkNode(thisNode->children[0], startFraction, endFraction, start, end);
+		checkNode(work, thisNode->children[0], startFraction, endFraction, start, end);
 	}
 	else
 	// Behind the plane
 	if (startDist < -offset && endDist < -offset)
 	{
-		checkNode(thisNode->children[1], startFraction, endFraction, start, end);
+		checkNode(work, thisNode->children[1], startFraction, endFraction, start, end);
 	}
 	else
 	{
@@ -1326,62 +1459,184 @@ void q3Bsp::checkNode(int index, const float startFraction, const float endFract
 		// middle point for the first side
 		middleFraction = startFraction + (endFraction - startFraction) * fraction1;
 		middle = start + endStartDiff * fraction1;
-		checkNode(thisNode->children[side], startFraction, middleFraction, start, middle);
+		checkNode(work, thisNode->children[side], startFraction, middleFraction, start, middle);
 		
 		// middle point for the second side
 		middleFraction = startFraction + (endFraction - startFraction) * fraction2;
 		middle = start + endStartDiff * fraction2;
-		checkNode(thisNode->children[side ^ 1], middleFraction, endFraction, middle, end);
+		checkNode(work, thisNode->children[side ^ 1], middleFraction, endFraction, middle, end);
 	}
 }
 				
-q3BspTrace q3Bsp::trace(const vector3& start, const vector3& end, int flags)
+void q3Bsp::_traceWork(q3BspTraceWork& work) const
 {
-	mTempTrace.startsOut = true;
-	mTempTrace.enclosedInSolid = false;
-	mTempTrace.fraction = 1.0f;
+	work.result.startsOut = true;
+	work.result.enclosedInSolid = false;
+	work.result.fraction = 1.0f;
 
-	mTraceStart = start;
-	mTraceEnd = end;
-	mTraceFlags = flags;
-	mTraceType = TRACE_TYPE_RAY;
-
-	checkNode(0, 0, 1.0f, start, end);
-	if (mTempTrace.fraction == 1.0f)
+	checkNode(work, 0, 0, 1.0f, work.start, work.end);
+	if (work.result.fraction == 1.0f)
 	{
-		mTempTrace.end = end;
+		work.result.end = work.end;
 	}
 	else
 	{
-		mTempTrace.end = mTraceStart + (mTraceEnd - mTraceStart) * mTempTrace.fraction;
+		work.result.end = work.start + (work.end - work.start) * work.result.fraction;
 	}
+}
 
-	return mTempTrace;
+q3BspTrace q3Bsp::trace(const vector3& start, const vector3& end, int flags)
+{
+	q3BspTraceWork work;
+	work.start = start;
+	work.end = end;
+	work.flags = flags;
+	work.type = TRACE_TYPE_RAY;
+	work.radius = 0;
+
+	_traceWork(work);
+	return work.result;
 }
 			
 q3BspTrace q3Bsp::traceSphere(const vector3& start, const vector3& end, float radius, int flags)
 {
-	mTempTrace.startsOut = true;
-	mTempTrace.enclosedInSolid = false;
-	mTempTrace.fraction = 1.0f;
+	q3BspTraceWork work;
+	work.start = start;
+	work.end = end;
+	work.flags = flags;
+	work.type = TRACE_TYPE_SPHERE;
+	work.radius = radius;
+
+	_traceWork(work);
+	return work.result;
+}
 
-	mTraceStart = start;
-	mTraceEnd = end;
-	mTraceFlags = flags;
-	mTraceType = TRACE_TYPE_SPHERE;
-	mTraceRadius = radius;
+void q3Bsp::_collectBrushes(int index, const vector3& mins, const vector3& maxs, 
+	int flags, std::vector<int>& brushes) const
+{
+	const vector3 center = (mins + maxs) * 0.5f;
+	const vector3 extents = maxs - center;
 
-	checkNode(0, 0, 1.0f, start, end);
-	if (mTempTrace.fraction == 1.0f)
+	while (index >= 0)
 	{
-		mTempTrace.end = end;
+		const q3BspNode* node = &mNodes[index];
+		const q3BspPlane* plane = &mPlanes[node->plane];
+
+		const vector3 planeNormal(plane->normal[0], plane->normal[1], plane->normal[2]);
+		const vec_t distance = center.dotProduct(planeNormal) - plane->dist;
+		const vec_t radius = fabs(extents.x * planeNormal.x) + fabs(extents.y * planeNormal.y) + 
+			fabs(extents.z * planeNormal.z);
+
+		if (distance >= radius)
+		{
+			index = node->children[0];
+		}
+		else
+		if (distance < -radius)
+		{
+			index = node->children[1];
+		}
+		else
+		{
+			_collectBrushes(node->children[0], mins, maxs, flags, brushes);
+			index = node->children[1];
+		}
 	}
-	else
+
+	const q3BspLeaf* leaf = &mLeafs[~index];
+	for (int i = 0; i < leaf->numLeafBrush; i++)
 	{
-		mTempTrace.end = mTraceStart + (mTraceEnd - mTraceStart) * mTempTrace.fraction;
+		const int brushIndex = mLeafBrushes[leaf->firstLeafBrush + i];
+		const q3BspBrush* brush = &mBrushes[brushIndex];
+
+		if ((brush->numSides > 0) &&
+			(!flags || (mMaterials[brush->shaderNum]->getContentFlags() & flags)))
+		{
+			brushes.push_back(brushIndex);
+		}
 	}
+}
+
+void q3Bsp::traceSegments(const vector3* starts, const vector3* ends, unsigned int count,
+	int flags, vec_t* fractions, vector3* normals)
+{
+	if (!count)
+		return;
+
+	kAssert(starts && ends);
+	kAssert(fractions && normals);
+
+	// Bounds of all segments, with the trace epsilon
+	vector3 mins = starts[0];
+	vector3 maxs = starts[0];
+	for (unsigned int i = 0; i < count; i++)
+	{
+		for (unsigned int a = 0; a < 3; a++)
+		{
+			mins.vec[a] = std::min(mins.vec[a], std::min(starts[i].vec[a], ends[i].vec[a]));
+			maxs.vec[a] = std::max(maxs.vec[a], std::max(starts[i].vec[a], ends[i].vec[a]));
+		}
+	}
+
+	const vector3 epsilon(Q3_EPSILON, Q3_EPSILON, Q3_EPSILON);
+	mins -= epsilon;
+	maxs += epsilon;
+
+	std::vector<int> brushes;
+	if (mNodesCount)
+		_collectBrushes(0, mins, maxs, flags, brushes);
+
+	// Leaves share brushes
+	std::sort(brushes.begin(), brushes.end());
+	brushes.erase(std::unique(brushes.begin(), brushes.end()), brushes.end());
+
+	q3BspTraceWork work;
+	work.flags = flags;
+	work.type = TRACE_TYPE_RAY;
+	work.radius = 0;
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		fractions[i] = 1.0f;
+		if (brushes.empty())
+			continue;
+
+		work.start = starts[i];
+		work.end = ends[i];
+
+		if (brushes.size() > Q3_BATCH_MAX_BRUSHES)
+		{
+			_traceWork(work);
+		}
+		else
+		{
+			work.result.startsOut = true;
+			work.result.enclosedInSolid = false;
+			work.result.fraction = 1.0f;
+
+			for (unsigned int b = 0; b < brushes.size(); b++)
+				checkBrush(&mBrushes[brushes[b]], work);
+		}
+
+		if (work.result.fraction < 1.0f)
+		{
+			fractions[i] = std::max(work.result.fraction, 0.0f);
+			normals[i] = work.result.planeNormal;
+		}
+	}
+}
+
+bool q3Bsp::traceSegment(const vector3& start, const vector3& end, vec_t radius, 
+	int flags, vec_t& fraction, vector3& normal)
+{
+	const q3BspTrace& result = (radius > 0) ? traceSphere(start, end, radius, flags) : trace(start, end, flags);
+	if (result.fraction >= 1.0f)
+		return false;
+
+	fraction = std::max(result.fraction, 0.0f);
+	normal = result.planeNormal;
 
-	return mTempTrace;
+	return true;
 }
 			
 bezierPatch::bezierPatch()
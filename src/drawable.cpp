@@ -21,6 +21,7 @@ THE SOFTWARE.
 */
 
 #include "drawable.h"
+#include "ray.h"
 #include "renderer.h"
 #include "root.h"
 #include "materialManager.h"
@@ -203,6 +204,25 @@ const vector3& boundingBox::getMaxs() const
 	return mMaxs;
 }
 			
+boundingBox boundingBox::transform(const vector3& position, const quaternion& orientation, const vector3& scale) const
+{
+	const vector3 center = ((mMins + mMaxs) * 0.5f) * scale;
+	const vector3 extents = ((mMaxs - mMins) * 0.5f) * scale;
+
+	// Rotated box axes
+	const vector3 axisX = orientation.rotateVector(vector3::unit_x);
+	const vector3 axisY = orientation.rotateVector(vector3::unit_y);
+	const vector3 axisZ = orientation.rotateVector(vector3::unit_z);
+
+	const vector3 finalCenter = orientation.rotateVector(center) + position;
+	const vector3 finalExtents(
+		fabs(axisX.x * extents.x) + fabs(axisY.x * extents.y) + fabs(axisZ.x * extents.z),
+		fabs(axisX.y * extents.x) + fabs(axisY.y * extents.y) + fabs(axisZ.y * extents.z),
+		fabs(axisX.z * extents.x) + fabs(axisY.z * extents.y) + fabs(axisZ.z * extents.z));
+
+	return boundingBox(finalCenter - finalExtents, finalCenter + finalExtents);
+}
+
 void boundingBox::draw()
 {
 	const vector3 v1 = mMins;
@@ -317,6 +337,14 @@ drawable3D::drawable3D()
 drawable3D::~drawable3D()
 {
 }
+
+bool drawable3D::trace(ray& traceRay)
+{
+	traceRay.resetOrientation();
+	traceRay.setSurface(-1);
+
+	return traceRay.intersect(getAABoundingBox());
+}
 			
 void drawable3D::setDrawBoundingBox(bool option)
 {
@@ -26,6 +26,7 @@ THE SOFTWARE.
 #include "renderer.h"
 #include "root.h"
 #include "resourceManager.h"
+#include "textureManager.h"
 #include "tinystr.h"
 #include "tinyxml.h"
 
@@ -1122,6 +1123,9 @@ void guiManager::setSkin(const std::string& matName, const std::string& guiFile)
 		kAssert(matStage);
 	}
 
+	// Skin layout needs the real texture size, not the placeholder
+	textureManager::getSingleton().flushLoads();
+
 	vec_t w = (vec_t)matStage->getWidth();
 	vec_t h = (vec_t)matStage->getHeight();
 
@@ -21,8 +21,11 @@ THE SOFTWARE.
 */
 
 #include "material.h"
+#include "materialManager.h"
 #include "root.h"
+#include "renderer.h"
 #include "logger.h"
+#include "simd.h"
 
 namespace k {
 
@@ -34,6 +37,10 @@ material::material()
 	mNoDraw = false;
 	mIsOpaque = true;
 	mReceiveLight = 1;
+	mStateCompiled = false;
+	mProgram = NULL;
+	mProgramResolved = false;
+	mProgramBound = false;
 }
 
 material::material(texture* tex)
@@ -59,6 +66,10 @@ material::material(texture* tex)
 	mNoDraw = false;
 	mIsOpaque = true;
 	mReceiveLight = 1;
+	mStateCompiled = false;
+	mProgram = NULL;
+	mProgramResolved = false;
+	mProgramBound = false;
 }
 			
 material::material(const std::string& filename)
@@ -89,6 +100,10 @@ material::material(const std::string& filename)
 	mNoDraw = false;
 	mIsOpaque = true;
 	mReceiveLight = 1;
+	mStateCompiled = false;
+	mProgram = NULL;
+	mProgramResolved = false;
+	mProgramBound = false;
 }
 			
 material::~material()
@@ -103,7 +118,35 @@ material::~material()
 	mStages.clear();
 }
 
-void material::start()
+void material::compile()
+{
+	mState.ambient = mAmbient;
+	mState.diffuse = mDiffuse;
+	mState.specular = mSpecular;
+
+	mState.cull = mCull;
+	mState.depthTest = mDepthTest;
+	mState.depthWrite = mDepthWrite;
+
+	mState.blend = false;
+	mState.blendSrc = 0;
+	mState.blendDst = 0;
+
+	mState.stagesCount = mStages.size();
+	if (mState.stagesCount > K_MAX_STATE_STAGES)
+	{
+		S_LOG_INFO("Material has too many stages, extra stages will not be compiled.");
+		mState.stagesCount = K_MAX_STATE_STAGES;
+	}
+
+	for (unsigned int i = 0; i < mState.stagesCount; i++)
+		mStages[i]->compileState(mState, i);
+
+	mStateCompiled = true;
+	mProgramResolved = false;
+}
+
+void material::start(bool lightmap)
 {
 	// Material Properties
 	renderSystem* rs = root::getSingleton().getRenderSystem();
@@ -111,29 +154,18 @@ void material::start()
 	if (mNoDraw)
 		return;
 
-	rs->bindMaterial(this);
-	rs->matAmbient(mAmbient);
-	rs->matDiffuse(mDiffuse);
-	rs->matSpecular(mSpecular);
-
-	rs->setCulling(mCull);
-	rs->setDepthTest(mDepthTest);
-	rs->setDepthMask(mDepthWrite);
-
-	// Color/Light Only
-	if (!mStages.size())
+	// Stages changed after the last compile
+	for (unsigned int i = 0; mStateCompiled && i < mState.stagesCount; i++)
 	{
-		rs->setColorChannels(0);
-		rs->setTextureGenerations(0);
-		rs->setTextureUnits(1);
-	}
-	else
-	{
-		rs->setColorChannels(1);
-		rs->setTextureGenerations(mStages.size());
-		rs->setTextureUnits(mStages.size());
+		if (mStages[i]->isStateChanged())
+			mStateCompiled = false;
 	}
 
+	if (!mStateCompiled)
+		compile();
+
+	rs->bindMaterial(this);
+
 	if (!mReceiveLight && rs->isLightOn())
 	{
 		// Magic trick
@@ -141,6 +173,30 @@ void material::start()
 		rs->setLighting(false);
 	}
 
+	rs->applyMaterialState(mState);
+
+	// Generated program for this stage configuration
+	materialManager& manager = materialManager::getSingleton();
+	materialProgram_t* program = NULL;
+
+	if (manager.getPrograms())
+	{
+		const bool lit = rs->isLightOn();
+		if (!mProgramResolved || mProgramLightmap != lightmap || mProgramLit != lit)
+		{
+			mProgram = manager.getProgram(mState, lightmap, lit);
+			mProgramResolved = true;
+			mProgramLightmap = lightmap;
+			mProgramLit = lit;
+		}
+
+		program = mProgram;
+	}
+
+	mProgramBound = (program != NULL);
+	if (program)
+		rs->bindProgram(&program->program);
+
 	// Cycle through textures
 	std::vector<materialStage*>::const_iterator it;
 	for (it = mStages.begin(); it != mStages.end(); it++)
@@ -148,6 +204,32 @@ void material::start()
 		(*it)->feedAnims();
 		(*it)->draw();
 	}
+
+	if (!program)
+		return;
+
+	// Two rows of each stage texture matrix
+	if (program->textureMatrices >= 0)
+	{
+		vec_t rows[K_MAX_STATE_STAGES * 8];
+		const matrix4 identity;
+
+		for (unsigned int i = 0; i < mState.stagesCount; i++)
+		{
+			const matrix4& mat = mState.stages[i].textureMatrix ? 
+				mStages[i]->getTextureMatrix() : identity;
+
+			for (unsigned int row = 0; row < 2; row++)
+			{
+				for (unsigned int col = 0; col < 4; col++)
+					rows[i * 8 + row * 4 + col] = mat.m[col][row];
+			}
+		}
+
+		rs->setProgramUniform(program->textureMatrices, rows, mState.stagesCount * 2);
+	}
+
+	rs->setProgramUniform(program->lightsCount, (int)rs->getLightsCount());
 }
 
 void material::finish()
@@ -156,6 +238,12 @@ void material::finish()
 		return;
 
 	renderSystem* rs = root::getSingleton().getRenderSystem();
+	if (mProgramBound)
+	{
+		rs->bindProgram(NULL);
+		mProgramBound = false;
+	}
+
 	if (mReceiveLight < 0)
 	{
 		rs->setLighting(true);
@@ -165,11 +253,204 @@ void material::finish()
 		// Disabled again
 		mReceiveLight = 0;
 	}
+}
 
-	// Cycle through textures
-	std::vector<materialStage*>::const_iterator it;
-	for (it = mStages.begin(); it != mStages.end(); it++)
-		(*it)->finish();
+deformSurface_t* material::createDeformSurface(unsigned int count)
+{
+	// Pad every array to a whole number of SSE vectors
+	unsigned int padded = (count + 3) & ~3;
+
+	deformSurface_t* surface = NULL;
+	vec_t* data = NULL;
+	try
+	{
+		surface = new deformSurface_t;
+	}
+
+	catch (...)
+	{
+		S_LOG_INFO("Failed to allocate deform surface.");
+		return NULL;
+	}
+
+	data = (vec_t*) memalign(16, sizeof(vec_t) * padded * 12);
+	if (!data)
+	{
+		S_LOG_INFO("Failed to allocate deform surface arrays.");
+		delete surface;
+		return NULL;
+	}
+
+	memset(data, 0, sizeof(vec_t) * padded * 12);
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		surface->position[i] = data + padded * i;
+		surface->normal[i] = data + padded * (3 + i);
+		surface->output[i] = data + padded * (6 + i);
+	}
+
+	surface->uv[0] = data + padded * 9;
+	surface->uv[1] = data + padded * 10;
+	surface->scratch = data + padded * 11;
+	surface->count = count;
+	surface->time = -1;
+
+	return surface;
+}
+
+void material::destroyDeformSurface(deformSurface_t* surface)
+{
+	if (!surface)
+		return;
+
+	// Arrays share the position[0] block
+	free(surface->position[0]);
+	delete surface;
+}
+
+void material::_evalWave(vec_t* values, const waveForm_t& wave, unsigned int count) const
+{
+	switch (wave.function)
+	{
+		case WAVE_SIN:
+			sinCycleArray(values, count);
+			break;
+		case WAVE_TRIANGLE:
+			triangleCycleArray(values, count);
+			break;
+		case WAVE_SQUARE:
+			for (unsigned int i = 0; i < count; i++)
+				values[i] = values[i] < 0.5f ? 1.0f : -1.0f;
+			break;
+		case WAVE_SAWTOOTH:
+			break;
+		case WAVE_INVERSE_SAWTOOTH:
+			for (unsigned int i = 0; i < count; i++)
+				values[i] = 1.0f - values[i];
+			break;
+	}
+
+	mulArray(values, wave.amplitude, count);
+	addArray(values, wave.base, count);
+}
+
+bool material::deform(deformSurface_t* surface, float time, const vector3& right, const vector3& up) const
+{
+	kAssert(surface);
+
+	if (mDeforms.empty())
+		return false;
+
+	// Autosprites follow the camera, everything else only the clock
+	bool cameraDependent = false;
+	std::vector<materialDeform_t>::const_iterator it;
+	for (it = mDeforms.begin(); it != mDeforms.end(); it++)
+	{
+		if (it->type == DEFORM_AUTOSPRITE)
+			cameraDependent = true;
+	}
+
+	if (!cameraDependent && surface->time == time)
+		return false;
+
+	const unsigned int count = surface->count;
+	vec_t* scratch = surface->scratch;
+	vec_t** out = surface->output;
+
+	for (unsigned int i = 0; i < 3; i++)
+		memcpy(out[i], surface->position[i], sizeof(vec_t) * count);
+
+	for (it = mDeforms.begin(); it != mDeforms.end(); it++)
+	{
+		const materialDeform_t& def = *it;
+		switch (def.type)
+		{
+			case DEFORM_WAVE:
+			{
+				// Phase offset from position, so the wave travels through the surface
+				double cycle = def.wave.phase + (double) time * def.wave.frequency;
+				cycle -= floor(cycle);
+
+				memcpy(scratch, out[0], sizeof(vec_t) * count);
+				madArray(scratch, out[1], 1.0f, count);
+				madArray(scratch, out[2], 1.0f, count);
+				fractArray(scratch, scratch, def.spread, (vec_t) cycle, count);
+				_evalWave(scratch, def.wave, count);
+
+				for (unsigned int i = 0; i < 3; i++)
+					mulAddArray(out[i], surface->normal[i], scratch, count);
+			}
+			break;
+
+			case DEFORM_BULGE:
+			{
+				// sin(s * width + time * speed), in cycles
+				const double invTwoPi = 1.0 / (2.0 * M_PI);
+				double cycle = (double) time * def.bulge[2] * invTwoPi;
+				cycle -= floor(cycle);
+
+				fractArray(scratch, surface->uv[0], def.bulge[0] * invTwoPi, (vec_t) cycle, count);
+				sinCycleArray(scratch, count);
+				mulArray(scratch, def.bulge[1], count);
+
+				for (unsigned int i = 0; i < 3; i++)
+					mulAddArray(out[i], surface->normal[i], scratch, count);
+			}
+			break;
+
+			case DEFORM_MOVE:
+			{
+				// Whole surface moves together, a single wave value
+				double cycle = def.wave.phase + (double) time * def.wave.frequency;
+				vec_t value = (vec_t) (cycle - floor(cycle));
+				_evalWave(&value, def.wave, 1);
+
+				addArray(out[0], def.move.x * value, count);
+				addArray(out[1], def.move.y * value, count);
+				addArray(out[2], def.move.z * value, count);
+			}
+			break;
+
+			case DEFORM_AUTOSPRITE:
+			{
+				// Turn every quad to face the camera, keeping its size
+				for (unsigned int q = 0; q + 4 <= count; q += 4)
+				{
+					vector3 mid;
+					vec_t midS = 0, midT = 0;
+					for (unsigned int v = q; v < q + 4; v++)
+					{
+						mid += vector3(out[0][v], out[1][v], out[2][v]);
+						midS += surface->uv[0][v];
+						midT += surface->uv[1][v];
+					}
+
+					mid *= 0.25f;
+					midS *= 0.25f;
+					midT *= 0.25f;
+
+					vector3 corner = vector3(out[0][q], out[1][q], out[2][q]) - mid;
+					vec_t radius = corner.length() * 0.707f;
+
+					for (unsigned int v = q; v < q + 4; v++)
+					{
+						// Texture left and top map to camera left and up
+						vec_t side = surface->uv[0][v] < midS ? -radius : radius;
+						vec_t height = surface->uv[1][v] < midT ? radius : -radius;
+						vector3 pos = mid + right * side + up * height;
+
+						out[0][v] = pos.x;
+						out[1][v] = pos.y;
+						out[2][v] = pos.z;
+					}
+				}
+			}
+			break;
+		}
+	}
+
+	surface->time = time;
+	return true;
 }
 			
 materialStage::materialStage(unsigned short index)
@@ -183,6 +464,7 @@ materialStage::materialStage(unsigned short index)
 	mScroll.y = 0;
 	
 	mLastFeedTime = root::getSingleton().getGlobalTime();
+	mMatrixTime = -1;
 	mNumberOfFrames = 0;
 	mCurrentFrame = 0;
 	mFrameRate = 0;
@@ -192,6 +474,7 @@ materialStage::materialStage(unsigned short index)
 	
 	mTextures = NULL;
 	mTexturesCount = 0;
+	mStateChanged = true;
 }
 
 materialStage::~materialStage()
@@ -202,17 +485,20 @@ materialStage::~materialStage()
 void materialStage::setEnv(unsigned int tev)
 {
 	mTexEnv = tev;
+	mStateChanged = true;
 }
 
 void materialStage::setBlendMode(unsigned short src, unsigned short dst)
 {
 	mBlendSrc = src;
 	mBlendDst = dst;
+	mStateChanged = true;
 }
 			
 void materialStage::setTexturesCount(unsigned int count)
 {
 	mTexturesCount = count;
+	mStateChanged = true;
 
 	try
 	{
@@ -230,10 +516,14 @@ void materialStage::setTexturesCount(unsigned int count)
 
 void materialStage::feedAnims()
 {
-	if (mNumberOfFrames == 0)
-		return;
+	const long timeNow = root::getSingleton().getRenderer()->getFrameStartTime();
 
-	long timeNow = root::getSingleton().getGlobalTime();
+	// Already evaluated this frame
+	if (timeNow != mMatrixTime && hasTextureMatrix())
+		_updateTransform(timeNow);
+
+	if (mNumberOfFrames == 0 || timeNow <= mLastFeedTime)
+		return;
 
 	mCurrentFrame += (mFrameRate * (timeNow - mLastFeedTime)) / 1000.0f;
 	mLastFeedTime = timeNow;
@@ -241,11 +531,40 @@ void materialStage::feedAnims()
 	while ((uint32_t)mCurrentFrame >= mNumberOfFrames)
 		mCurrentFrame -= mNumberOfFrames;
 }
+
+void materialStage::_updateTransform(long time)
+{
+	mMatrixTime = time;
+
+	// Wrap so precision holds over long sessions
+	const double seconds = time / 1000.0;
+	mAngle = fmod(mRotate * seconds, 360.0);
+	mScrolled.x = fmod(mScroll.x * seconds, 1.0);
+	mScrolled.y = fmod(mScroll.y * seconds, 1.0);
+
+	vector2 scale(1, 1);
+	if (mScale.x || mScale.y)
+		scale = mScale;
+
+	// Rotate * Translate * Scale, column major
+	const vec_t radians = mAngle * M_PI / 180.0f;
+	const vec_t c = cos(radians);
+	const vec_t s = sin(radians);
+
+	mTextureMatrix.setIdentity();
+	mTextureMatrix.m[0][0] = c * scale.x;
+	mTextureMatrix.m[0][1] = s * scale.x;
+	mTextureMatrix.m[1][0] = -s * scale.y;
+	mTextureMatrix.m[1][1] = c * scale.y;
+	mTextureMatrix.m[3][0] = c * mScrolled.x - s * mScrolled.y;
+	mTextureMatrix.m[3][1] = s * mScrolled.x + c * mScrolled.y;
+}
 			
 void materialStage::setTexture(texture* tex, unsigned int index)
 {
 	kAssert(tex);
 	mTextures[index] = tex;
+	mStateChanged = true;
 }
 
 const texture* materialStage::getTexture(unsigned int i) const
@@ -269,6 +588,38 @@ unsigned int materialStage::getHeight() const
 		return 0;
 }
 
+void materialStage::compileState(materialState_t& state, unsigned int slot)
+{
+	kAssert(slot < K_MAX_STATE_STAGES);
+	mStateChanged = false;
+
+	stageState_t& stage = state.stages[slot];
+	stage.texEnv = mTexEnv;
+	stage.coordType = mCoordType;
+	stage.textureMatrix = hasTextureMatrix();
+
+	// Stages without textures are not drawn
+	bool hasTexture = false;
+	for (unsigned int i = 0; i < mTexturesCount; i++)
+	{
+		if (mTextures[i])
+		{
+			hasTexture = true;
+			break;
+		}
+	}
+
+	stage.textured = hasTexture;
+
+	// Last drawn stage sets blending
+	if (hasTexture)
+	{
+		state.blend = !isOpaque();
+		state.blendSrc = mBlendSrc;
+		state.blendDst = mBlendDst;
+	}
+}
+
 bool materialStage::isOpaque() const
 {
 	if (!mBlendDst && !mBlendSrc)
@@ -280,11 +631,15 @@ bool materialStage::isOpaque() const
 void materialStage::setCoordType(TextureCoordType type)
 {
 	mCoordType = type;
+	mMatrixTime = -1;
+	mStateChanged = true;
 }
 
 void materialStage::setScroll(vector2 scroll)
 {
 	mScroll = scroll;
+	mMatrixTime = -1;
+	mStateChanged = true;
 }
 			
 unsigned int materialStage::getImagesCount() const
@@ -295,11 +650,15 @@ unsigned int materialStage::getImagesCount() const
 void materialStage::setScale(vector2 scale)
 {
 	mScale = scale;
+	mMatrixTime = -1;
+	mStateChanged = true;
 }
 
 void materialStage::setRotate(vec_t angle)
 {
 	mRotate = angle;
+	mMatrixTime = -1;
+	mStateChanged = true;
 }
 			
 bool materialStage::containsTexture(const std::string& name) const
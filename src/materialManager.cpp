@@ -38,6 +38,7 @@ materialManager& materialManager::getSingleton()
 materialManager::materialManager()
 {
 	mMaterials.clear();
+	mUsePrograms = false;
 }
 
 materialManager::~materialManager()
@@ -47,6 +48,274 @@ materialManager::~materialManager()
 	{
 		delete it->second;
 	}
+
+	// Programs are released with the context
+	materialProgramMap::iterator pit;
+	for (pit = mProgramCache.begin(); pit != mProgramCache.end(); pit++)
+	{
+		if (pit->second)
+			delete pit->second;
+	}
+}
+
+void materialManager::setPrograms(bool enabled)
+{
+	mUsePrograms = false;
+	if (!enabled)
+		return;
+
+	if (!root::getSingleton().getRenderSystem()->getProgramSupport())
+	{
+		S_LOG_INFO("Material programs are not supported, using fixed function.");
+		return;
+	}
+
+	mUsePrograms = true;
+}
+
+/**
+ * Bytes describing everything a material program depends on.
+ */
+static unsigned int materialProgramConfig(const materialState_t& state, 
+	bool lightmap, bool lit, unsigned char* config)
+{
+	unsigned int length = 0;
+	config[length++] = state.stagesCount;
+	config[length++] = lightmap;
+	config[length++] = lit;
+
+	for (unsigned int i = 0; i < state.stagesCount; i++)
+	{
+		const stageState_t& stage = state.stages[i];
+		config[length++] = stage.textured | (stage.texEnv << 1) | (stage.textureMatrix << 4);
+		config[length++] = stage.coordType;
+	}
+
+	return length;
+}
+
+materialProgram_t* materialManager::getProgram(const materialState_t& state, bool lightmap, bool lit)
+{
+	if (!mUsePrograms)
+		return NULL;
+
+	unsigned char config[MATERIAL_PROGRAM_CONFIG];
+	const unsigned int length = materialProgramConfig(state, lightmap, lit, config);
+
+	// FNV-1a
+	unsigned int hash = 2166136261u;
+	for (unsigned int i = 0; i < length; i++)
+	{
+		hash ^= config[i];
+		hash *= 16777619u;
+	}
+
+	materialProgramMap::const_iterator it = mProgramCache.find(hash);
+	if (it != mProgramCache.end())
+	{
+		materialProgram_t* program = it->second;
+
+		// Colliding configurations use fixed function
+		if (program && (program->configLength != length || memcmp(program->config, config, length)))
+			return NULL;
+
+		return program;
+	}
+
+	materialProgram_t* program = _genProgram(state, lightmap, lit);
+	if (program)
+	{
+		memcpy(program->config, config, length);
+		program->configLength = length;
+	}
+
+	mProgramCache[hash] = program;
+	return program;
+}
+
+materialProgram_t* materialManager::_genProgram(const materialState_t& state, bool lightmap, bool lit)
+{
+	const unsigned int stages = state.stagesCount;
+
+	// Lightmap needs a texture coordinate set of its own
+	if (lightmap && stages >= K_MAX_STATE_STAGES)
+		return NULL;
+
+	bool sphere = false;
+	bool matrices = false;
+	for (unsigned int i = 0; i < stages; i++)
+	{
+		if (!state.stages[i].textured)
+			continue;
+
+		if (state.stages[i].coordType == TEXCOORD_SPHERE)
+			sphere = true;
+		else
+		if (state.stages[i].textureMatrix)
+			matrices = true;
+	}
+
+	std::stringstream vertex;
+	if (matrices)
+		vertex << "uniform vec4 textureMatrices[" << stages * 2 << "];\n";
+
+	if (lit)
+		vertex << "uniform int lightsCount;\n";
+
+	vertex << "void main()\n{\n";
+	vertex << "	vec4 eyePos = gl_ModelViewMatrix * gl_Vertex;\n";
+	vertex << "	vec3 normal = normalize(gl_NormalMatrix * gl_Normal);\n";
+	vertex << "	gl_Position = ftransform();\n";
+
+	if (sphere)
+	{
+		vertex << "	vec3 r = reflect(normalize(eyePos.xyz), normal);\n";
+		vertex << "	float m = 2.0 * sqrt(r.x * r.x + r.y * r.y + (r.z + 1.0) * (r.z + 1.0));\n";
+		vertex << "	vec4 sphere = vec4(r.x / m + 0.5, r.y / m + 0.5, 0.0, 1.0);\n";
+	}
+
+	for (unsigned int i = 0; i < stages; i++)
+	{
+		const stageState_t& stage = state.stages[i];
+		if (!stage.textured)
+			continue;
+
+		if (stage.coordType == TEXCOORD_SPHERE)
+		{
+			vertex << "	gl_TexCoord[" << i << "] = sphere;\n";
+		}
+		else
+		if (stage.textureMatrix)
+		{
+			vertex << "	gl_TexCoord[" << i << "] = vec4(dot(textureMatrices[" << i * 2 << "], gl_MultiTexCoord" << i 
+				<< "), dot(textureMatrices[" << i * 2 + 1 << "], gl_MultiTexCoord" << i << "), 0.0, 1.0);\n";
+		}
+		else
+		{
+			vertex << "	gl_TexCoord[" << i << "] = gl_MultiTexCoord" << i << ";\n";
+		}
+	}
+
+	if (lightmap)
+		vertex << "	gl_TexCoord[" << stages << "] = gl_MultiTexCoord" << stages << ";\n";
+
+	// Same lighting as the md5 skinning program
+	if (lit)
+	{
+		vertex << "	vec4 color = gl_LightModel.ambient * gl_Color;\n";
+		vertex << "	for (int i = 0; i < 8; i++)\n	{\n";
+		vertex << "		if (i >= lightsCount)\n			break;\n";
+		vertex << "		vec3 dir = gl_LightSource[i].position.xyz - eyePos.xyz * gl_LightSource[i].position.w;\n";
+		vertex << "		float dist = length(dir);\n";
+		vertex << "		float att = 1.0;\n";
+		vertex << "		if (gl_LightSource[i].position.w != 0.0)\n";
+		vertex << "			att = 1.0 / (gl_LightSource[i].constantAttenuation + gl_LightSource[i].linearAttenuation * dist +\n";
+		vertex << "				gl_LightSource[i].quadraticAttenuation * dist * dist);\n";
+		vertex << "		float diffuse = max(dot(normal, dir / dist), 0.0);\n";
+		vertex << "		color += att * (gl_LightSource[i].ambient + gl_LightSource[i].diffuse * diffuse) * gl_Color;\n";
+		vertex << "	}\n";
+		vertex << "	gl_FrontColor = clamp(color, 0.0, 1.0);\n";
+	}
+	else
+	{
+		vertex << "	gl_FrontColor = gl_Color;\n";
+	}
+
+	vertex << "}\n";
+
+	// Stages combined like the fixed function tex envs
+	std::stringstream fragment;
+	for (unsigned int i = 0; i < stages; i++)
+	{
+		if (state.stages[i].textured)
+			fragment << "uniform sampler2D stage" << i << ";\n";
+	}
+
+	if (lightmap)
+		fragment << "uniform sampler2D lightmap;\n";
+
+	fragment << "void main()\n{\n";
+	fragment << "	vec4 color = gl_Color;\n";
+	fragment << "	vec4 t;\n";
+
+	for (unsigned int i = 0; i < stages; i++)
+	{
+		const stageState_t& stage = state.stages[i];
+		if (!stage.textured)
+			continue;
+
+		fragment << "	t = texture2D(stage" << i << ", gl_TexCoord[" << i << "].st);\n";
+		switch (stage.texEnv)
+		{
+			default:
+			case TEXENV_REPLACE:
+				// Lit fragments are modulated
+				if (lit)
+					fragment << "	color *= t;\n";
+				else
+					fragment << "	color = t;\n";
+				break;
+
+			case TEXENV_MODULATE:
+				fragment << "	color *= t;\n";
+				break;
+
+			case TEXENV_DECAL:
+				fragment << "	color.rgb = mix(color.rgb, t.rgb, t.a);\n";
+				break;
+
+			case TEXENV_BLEND:
+				fragment << "	color = vec4(color.rgb * (vec3(1.0) - t.rgb), color.a * t.a);\n";
+				break;
+
+			case TEXENV_ADD:
+				fragment << "	color = vec4(color.rgb + t.rgb, color.a * t.a);\n";
+				break;
+		}
+	}
+
+	if (lightmap)
+		fragment << "	color *= texture2D(lightmap, gl_TexCoord[" << stages << "].st);\n";
+
+	fragment << "	gl_FragColor = color;\n";
+	fragment << "}\n";
+
+	materialProgram_t* program;
+	try
+	{
+		program = new materialProgram_t;
+	}
+
+	catch (...)
+	{
+		S_LOG_INFO("Failed to allocate material program.");
+		return NULL;
+	}
+
+	renderSystem* rs = root::getSingleton().getRenderSystem();
+	if (!rs->genProgram(&program->program, vertex.str().c_str(), fragment.str().c_str()))
+	{
+		S_LOG_INFO("Failed to create material program, using fixed function.");
+		delete program;
+		return NULL;
+	}
+
+	program->textureMatrices = rs->getProgramUniform(&program->program, "textureMatrices");
+	program->lightsCount = rs->getProgramUniform(&program->program, "lightsCount");
+
+	// Samplers never change
+	rs->bindProgram(&program->program);
+	for (unsigned int i = 0; i < stages; i++)
+	{
+		std::stringstream name;
+		name << "stage" << i;
+		rs->setProgramUniform(rs->getProgramUniform(&program->program, name.str()), (int)i);
+	}
+
+	rs->setProgramUniform(rs->getProgramUniform(&program->program, "lightmap"), (int)stages);
+	rs->bindProgram(NULL);
+
+	return program;
 }
 
 void materialManager::createSystemMaterials()
@@ -736,6 +1005,8 @@ void materialManager::parseMaterial(material* mat, parsingFile* file)
 		if (token == "{")
 			openBraces++;
 	}
+
+	mat->compile();
 }
 
 void materialManager::parseMaterialScript(const std::string& filename, materialList* map)
@@ -958,6 +1229,36 @@ void materialManager::parseQ3TextureSection(material* mat, parsingFile* file, un
 	}
 }
 
+void materialManager::parseQ3Wave(waveForm_t& wave, parsingFile* file)
+{
+	kAssert(file != NULL);
+
+	std::string token = file->getNextToken();
+	if (token == "triangle")
+		wave.function = WAVE_TRIANGLE;
+	else
+	if (token == "square")
+		wave.function = WAVE_SQUARE;
+	else
+	if (token == "sawtooth")
+		wave.function = WAVE_SAWTOOTH;
+	else
+	if (token == "inversesawtooth")
+		wave.function = WAVE_INVERSE_SAWTOOTH;
+	else
+	{
+		if (token != "sin")
+			S_LOG_INFO("Unknown wave function " + token + ", using sin.");
+
+		wave.function = WAVE_SIN;
+	}
+
+	wave.base = atof(file->getNextToken().c_str());
+	wave.amplitude = atof(file->getNextToken().c_str());
+	wave.phase = atof(file->getNextToken().c_str());
+	wave.frequency = atof(file->getNextToken().c_str());
+}
+
 void materialManager::parseQ3Material(material* mat, parsingFile* file)
 {
 	kAssert(mat != NULL);
@@ -989,6 +1290,55 @@ void materialManager::parseQ3Material(material* mat, parsingFile* file)
 			if (token == "both")
 				mat->setCullMode(CULLMODE_BOTH);
 		}
+		if (token == "deformVertexes" || token == "deformvertexes")
+		{
+			materialDeform_t deform;
+			token = file->getNextToken();
+
+			if (token == "wave")
+			{
+				vec_t div = atof(file->getNextToken().c_str());
+				if (div == 0)
+				{
+					S_LOG_INFO("Deform wave with zero spread, using 100.");
+					div = 100;
+				}
+
+				deform.type = DEFORM_WAVE;
+				deform.spread = 1.0f / div;
+				parseQ3Wave(deform.wave, file);
+				mat->pushDeform(deform);
+			}
+			else
+			if (token == "bulge")
+			{
+				deform.type = DEFORM_BULGE;
+				for (unsigned int i = 0; i < 3; i++)
+					deform.bulge[i] = atof(file->getNextToken().c_str());
+
+				mat->pushDeform(deform);
+			}
+			else
+			if (token == "move")
+			{
+				deform.type = DEFORM_MOVE;
+				deform.move.x = atof(file->getNextToken().c_str());
+				deform.move.y = atof(file->getNextToken().c_str());
+				deform.move.z = atof(file->getNextToken().c_str());
+				parseQ3Wave(deform.wave, file);
+				mat->pushDeform(deform);
+			}
+			else
+			if (token == "autosprite")
+			{
+				deform.type = DEFORM_AUTOSPRITE;
+				mat->pushDeform(deform);
+			}
+			else
+			{
+				S_LOG_INFO("Unsupported deformVertexes " + token);
+			}
+		}
 		if (token == "{")
 		{
 			parseQ3TextureSection(mat, file, textureIndex++);
@@ -40,10 +40,21 @@ md3Surface::md3Surface()
 	mUVs = NULL;
 
 	mDrawNormals = false;
+	mUploaded = false;
+
+	mFrameBounds = NULL;
+	mFrameBVH = NULL;
 }
 
 md3Surface::~md3Surface()
 {
+	if (mUploaded)
+	{
+		renderSystem* rs = root::getSingleton().getRenderSystem();
+		rs->delVBO(&mVertexVBO);
+		rs->delVBO(&mIndexVBO);
+	}
+
 	if (mVertices) 
 		free(mVertices);
 
@@ -55,6 +66,17 @@ md3Surface::~md3Surface()
 
 	if (mDrawingNormals)
 		free(mDrawingNormals);
+
+	if (mFrameBounds)
+		free(mFrameBounds);
+
+	if (mFrameBVH)
+	{
+		for (unsigned int i = 0; i < mFrameCount; i++)
+			delete mFrameBVH[i];
+
+		delete [] mFrameBVH;
+	}
 }
 		
 void md3Surface::setDrawNormals(bool draw)
@@ -79,19 +101,115 @@ void md3Surface::setDrawNormals(bool draw)
 	mDrawNormals = draw;
 }
 
+void md3Surface::interpolate(unsigned int from, unsigned int to, vec_t fraction, md3RealVertex* out) const
+{
+	kAssert(out);
+	kAssert(from < mFrameCount && to < mFrameCount);
+
+	// md3RealVertex is packed as 6 floats (position and normal)
+	lerpArray(mVertices[from * mVerticesCount].pos.vec, mVertices[to * mVerticesCount].pos.vec,
+		fraction, out[0].pos.vec, mVerticesCount * 6);
+
+	// Lerped normals are shorter than unit, which would darken lighting
+	if (from != to && fraction > 0)
+		normalizeVectors(out[0].normal.vec, 6, mVerticesCount);
+}
+
+bool md3Surface::upload()
+{
+	renderSystem* rs = root::getSingleton().getRenderSystem();
+	if (mUploaded || !rs->getVBOSupport())
+		return mUploaded;
+
+	kAssert(mVertices && mUVs && mIndices);
+
+	// Frames are stored one after another, followed by the uvs
+	const unsigned int verticesSize = mFrameCount * mVerticesCount * sizeof(md3RealVertex);
+	const unsigned int uvsSize = mUVCount * sizeof(md3TexCoord_t);
+
+	char* vertexData = (char*) memalign(32, verticesSize + uvsSize);
+	if (!vertexData)
+	{
+		S_LOG_INFO("Failed to allocate md3 surface vertex buffer.");
+		return false;
+	}
+
+	memcpy(vertexData, mVertices, verticesSize);
+	memcpy(vertexData + verticesSize, mUVs, uvsSize);
+
+	rs->genVBO(&mVertexVBO);
+	rs->bindVBO(&mVertexVBO, VBO_ARRAY);
+	rs->setVBOData(VBO_ARRAY, verticesSize + uvsSize, vertexData, VBO_STATIC_DRAW);
+	rs->bindVBO(NULL, VBO_ARRAY);
+
+	free(vertexData);
+
+	rs->genVBO(&mIndexVBO);
+	rs->bindVBO(&mIndexVBO, VBO_ELEMENT_ARRAY);
+	rs->setVBOData(VBO_ELEMENT_ARRAY, mIndicesCount * sizeof(index_t), mIndices, VBO_STATIC_DRAW);
+	rs->bindVBO(NULL, VBO_ELEMENT_ARRAY);
+
+	mUploaded = true;
+	return true;
+}
+
 void md3Surface::draw(short frameNum)
 {
+	if (!mUploaded)
+	{
+		drawVertices(&mVertices[frameNum * mVerticesCount]);
+		return;
+	}
+
+	renderSystem* rs = root::getSingleton().getRenderSystem();
+	const unsigned int frameOffset = frameNum * mVerticesCount * sizeof(md3RealVertex);
+	const unsigned int uvOffset = mFrameCount * mVerticesCount * sizeof(md3RealVertex);
+
+	if (mMaterial)
+		mMaterial->start();
+
+	rs->bindVBO(&mVertexVBO, VBO_ARRAY);
+	rs->bindVBO(&mIndexVBO, VBO_ELEMENT_ARRAY);
+
+	rs->clearArrayDesc();
+	rs->setVBO(true);
+
+	rs->setVertexArray(frameOffset, sizeof(md3RealVertex));
+	rs->setVertexCount(mVerticesCount);
+
+	rs->setTexCoordArray(uvOffset);
+	rs->setNormalArray((unsigned int)(frameOffset + sizeof(vector3)), sizeof(md3RealVertex));
+
+	rs->setVertexIndex((unsigned int)0);
+	rs->setIndexCount(mIndicesCount);
+
+	rs->drawArrays();
+
+	rs->setVBO(false);
+	rs->bindVBO(NULL, VBO_ARRAY);
+	rs->bindVBO(NULL, VBO_ELEMENT_ARRAY);
+
+	if (mMaterial)
+		mMaterial->finish();
+
+	if (mDrawNormals)
+		drawNormals(&mVertices[frameNum * mVerticesCount]);
+}
+
+void md3Surface::drawVertices(const md3RealVertex* vertices)
+{
+	kAssert(vertices);
 	renderSystem* rs = root::getSingleton().getRenderSystem();
 
 	if (mMaterial)
 		mMaterial->start();
 
 	rs->clearArrayDesc();
-	rs->setVertexArray(mVertices[frameNum * mVerticesCount].pos.vec, sizeof(md3RealVertex));
+	rs->setVertexArray(vertices[0].pos.vec, sizeof(md3RealVertex));
 	rs->setVertexCount(mVerticesCount);
 
 	rs->setTexCoordArray(mUVs[0].uv.vec);
-	rs->setNormalArray(mVertices[frameNum * mVerticesCount].normal.vec, sizeof(md3RealVertex));
+	rs->setNormalArray(vertices[0].normal.vec, sizeof(md3RealVertex));
 		
 	rs->setVertexIndex(mIndices[0].indices);
 	rs->setIndexCount(mIndicesCount);
@@ -102,46 +220,319 @@ void md3Surface::draw(short frameNum)
 		mMaterial->finish();
 	
 	if (mDrawNormals)
+		drawNormals(vertices);
+}
+
+void md3Surface::drawNormals(const md3RealVertex* vertices)
+{
+	renderSystem* rs = root::getSingleton().getRenderSystem();
+
+	// Copy Normals
+	for (unsigned int i = 0; i < mVerticesCount; i++)
+	{
+		mDrawingNormals[i * 2] = vertices[i].pos;
+		mDrawingNormals[(i * 2) + 1] = (vertices[i].pos + (vertices[i].normal * 2));
+	}
+
+	material* normalMaterial =  materialManager::getSingleton().getMaterial("k_base_white");
+	kAssert(normalMaterial);
+
+	normalMaterial->start();
+
+	rs->clearArrayDesc(VERTEXMODE_LINE);
+	rs->setVertexArray(mDrawingNormals[0].vec);
+	rs->setVertexCount(mVerticesCount * 2);
+
+	rs->drawArrays(true);
+
+	normalMaterial->finish();
+}
+		
+void md3Surface::calculateFrameBounds()
+{
+	kAssert(mVertices && mFrameCount);
+
+	if (!mFrameBounds)
 	{
-		// Copy Normals
-		for (unsigned int i = 0; i < mVerticesCount; i++)
+		mFrameBounds = (vector3*) memalign(32, sizeof(vector3) * 2 * mFrameCount);
+		if (!mFrameBounds)
 		{
-			mDrawingNormals[i * 2] = mVertices[i + (frameNum * mVerticesCount)].pos;
-			mDrawingNormals[(i * 2) + 1] = (mVertices[i + (frameNum * mVerticesCount)].pos + (mVertices[i + (frameNum * mVerticesCount)].normal * 2));
+			S_LOG_INFO("Failed to allocate md3 surface frame bounds.");
+			return;
 		}
+	}
+
+	for (unsigned int frame = 0; frame < mFrameCount; frame++)
+	{
+		const md3RealVertex* vertices = &mVertices[frame * mVerticesCount];
+		vector3& mins = mFrameBounds[frame * 2];
+		vector3& maxs = mFrameBounds[frame * 2 + 1];
 
-		material* normalMaterial =  materialManager::getSingleton().getMaterial("k_base_white");
-		kAssert(normalMaterial);
+		mins = maxs = vertices[0].pos;
+		for (unsigned int i = 1; i < mVerticesCount; i++)
+		{
+			for (unsigned int axis = 0; axis < 3; axis++)
+			{
+				if (vertices[i].pos.vec[axis] < mins.vec[axis])
+					mins.vec[axis] = vertices[i].pos.vec[axis];
 
-		normalMaterial->start();
+				if (vertices[i].pos.vec[axis] > maxs.vec[axis])
+					maxs.vec[axis] = vertices[i].pos.vec[axis];
+			}
+		}
+	}
+}
 
-		rs->clearArrayDesc(VERTEXMODE_LINE);
-		rs->setVertexArray(mDrawingNormals[0].vec);
-		rs->setVertexCount(mVerticesCount * 2);
+/**
+ * Sort triangles by their centroid on one axis
+ */
+class md3CentroidCompare
+{
+	private:
+		const vector3* mCentroids;
+		unsigned int mAxis;
 
-		rs->drawArrays(true);
+	public:
+		md3CentroidCompare(const vector3* centroids, unsigned int axis)
+		{
+			mCentroids = centroids;
+			mAxis = axis;
+		}
 
-		normalMaterial->finish();
+		bool operator() (unsigned int a, unsigned int b) const
+		{
+			return mCentroids[a].vec[mAxis] < mCentroids[b].vec[mAxis];
+		}
+};
+
+static void buildBVHNode(md3FrameBVH_t* bvh, const vector3* centroids, const md3RealVertex* vertices,
+	const md3Triangle* triangles, unsigned int first, unsigned int count)
+{
+	const unsigned int nodeIndex = bvh->nodes.size();
+	bvh->nodes.push_back(md3BVHNode_t());
+
+	// Node bounds and centroid bounds
+	vector3 mins = vertices[triangles[bvh->triangles[first]].indices[0]].pos;
+	vector3 maxs = mins;
+	vector3 centerMins = centroids[bvh->triangles[first]];
+	vector3 centerMaxs = centerMins;
+
+	for (unsigned int i = first; i < first + count; i++)
+	{
+		const unsigned int tri = bvh->triangles[i];
+		for (unsigned int axis = 0; axis < 3; axis++)
+		{
+			for (unsigned int v = 0; v < 3; v++)
+			{
+				const vec_t value = vertices[triangles[tri].indices[v]].pos.vec[axis];
+				mins.vec[axis] = std::min(mins.vec[axis], value);
+				maxs.vec[axis] = std::max(maxs.vec[axis], value);
+			}
+
+			centerMins.vec[axis] = std::min(centerMins.vec[axis], centroids[tri].vec[axis]);
+			centerMaxs.vec[axis] = std::max(centerMaxs.vec[axis], centroids[tri].vec[axis]);
+		}
+	}
+
+	bvh->nodes[nodeIndex].mins = mins;
+	bvh->nodes[nodeIndex].maxs = maxs;
+
+	if (count <= MD3_BVH_LEAF_TRIANGLES)
+	{
+		bvh->nodes[nodeIndex].first = first;
+		bvh->nodes[nodeIndex].count = count;
+		return;
 	}
+
+	// Median split on the longest axis
+	const vector3 extents = centerMaxs - centerMins;
+	unsigned int axis = 0;
+	if (extents.y > extents.vec[axis]) axis = 1;
+	if (extents.z > extents.vec[axis]) axis = 2;
+
+	const unsigned int half = count / 2;
+	std::vector<unsigned int>::iterator begin = bvh->triangles.begin() + first;
+	std::nth_element(begin, begin + half, begin + count, md3CentroidCompare(centroids, axis));
+
+	// Left child comes right after this node
+	buildBVHNode(bvh, centroids, vertices, triangles, first, half);
+
+	bvh->nodes[nodeIndex].first = bvh->nodes.size();
+	bvh->nodes[nodeIndex].count = 0;
+	buildBVHNode(bvh, centroids, vertices, triangles, first + half, count - half);
 }
-		
-bool md3Surface::trace(ray& traceRay, short frameNum) const
+
+md3FrameBVH_t* md3Surface::buildBVH(unsigned int frameNum)
 {
-	// TODO: Test against surface bounding box.
+	const unsigned int trianglesCount = mIndicesCount / 3;
+	const md3RealVertex* vertices = &mVertices[frameNum * mVerticesCount];
+
+	md3FrameBVH_t* bvh = NULL;
+	vector3* centroids;
+
+	try
+	{
+		bvh = new md3FrameBVH_t;
+		bvh->triangles.resize(trianglesCount);
+		bvh->nodes.reserve(2 * trianglesCount / MD3_BVH_LEAF_TRIANGLES + 1);
 
-	for (unsigned int i = 0; i < mIndicesCount; i += 3)
+		centroids = new vector3[trianglesCount];
+	}
+
+	catch (...)
 	{
-		if (traceRay.intersect(mVertices[i + (frameNum * mVerticesCount)].pos, 
-					mVertices[i + 1 + (frameNum * mVerticesCount)].pos, 
-					mVertices[i + 2 + (frameNum * mVerticesCount)].pos))
+		S_LOG_INFO("Failed to allocate md3 surface triangle tree.");
+		delete bvh;
+		return NULL;
+	}
+
+	for (unsigned int i = 0; i < trianglesCount; i++)
+	{
+		const index_t* tri = mIndices[i].indices;
+
+		bvh->triangles[i] = i;
+		centroids[i] = (vertices[tri[0]].pos + vertices[tri[1]].pos + vertices[tri[2]].pos) * (1.0f / 3.0f);
+	}
+
+	buildBVHNode(bvh, centroids, vertices, mIndices, 0, trianglesCount);
+	delete [] centroids;
+
+	// Pack leaves triangles for the ray kernel
+	std::vector<unsigned int> sorted;
+	sorted.swap(bvh->triangles);
+
+	triangle4_t emptyPacket;
+	memset(&emptyPacket, 0, sizeof(triangle4_t));
+
+	for (unsigned int i = 0; i < bvh->nodes.size(); i++)
+	{
+		md3BVHNode_t& node = bvh->nodes[i];
+		if (!node.count)
+			continue;
+
+		const unsigned int packet = bvh->packets.size();
+		bvh->packets.push_back(emptyPacket);
+
+		for (unsigned int lane = 0; lane < 4; lane++)
 		{
-			return true;
+			const unsigned int tri = (lane < node.count) ? sorted[node.first + lane] : 0;
+			bvh->triangles.push_back(tri);
+
+			if (lane < node.count)
+			{
+				const index_t* indices = mIndices[tri].indices;
+				ray::setTriangle(bvh->packets[packet], lane, vertices[indices[0]].pos, 
+					vertices[indices[1]].pos, vertices[indices[2]].pos);
+			}
 		}
+
+		node.first = packet;
+	}
+
+	return bvh;
+}
+
+bool md3Surface::traceTriangle(ray& localRay, const md3RealVertex* vertices, unsigned int triangle, 
+	vec_t& closest, vector3& normal) const
+{
+	const index_t* tri = mIndices[triangle].indices;
+
+	if (localRay.intersect(vertices[tri[0]].pos, vertices[tri[1]].pos, vertices[tri[2]].pos) 
+			&& localRay.getFraction() < closest)
+	{
+		closest = localRay.getFraction();
+		normal = localRay.getNormal();
+		return true;
 	}
 
 	return false;
 }
 
+bool md3Surface::trace(ray& traceRay, short frameNum, bool useBVH)
+{
+	kAssert((unsigned int)frameNum < mFrameCount);
+
+	// Transform the ray once for all the tests
+	ray localRay = traceRay.getTransformed();
+
+	if (mFrameBounds && !localRay.intersect(getFrameMins(frameNum), getFrameMaxs(frameNum)))
+		return false;
+
+	const md3RealVertex* vertices = &mVertices[frameNum * mVerticesCount];
+	const unsigned int trianglesCount = mIndicesCount / 3;
+	const vec_t noHit = 1e30f;
+	vec_t closest = noHit;
+	vector3 closestNormal;
+
+	if (useBVH && trianglesCount >= MD3_BVH_MIN_TRIANGLES)
+	{
+		if (!mFrameBVH)
+		{
+			try
+			{
+				mFrameBVH = new md3FrameBVH_t*[mFrameCount];
+			}
+
+			catch (...)
+			{
+				S_LOG_INFO("Failed to allocate md3 surface triangle trees.");
+				return false;
+			}
+
+			for (unsigned int i = 0; i < mFrameCount; i++)
+				mFrameBVH[i] = NULL;
+		}
+
+		if (!mFrameBVH[frameNum])
+			mFrameBVH[frameNum] = buildBVH(frameNum);
+	}
+
+	const md3FrameBVH_t* bvh = (mFrameBVH && useBVH) ? mFrameBVH[frameNum] : NULL;
+	if (bvh)
+	{
+		unsigned int stack[64];
+		unsigned int stackSize = 0;
+		stack[stackSize++] = 0;
+
+		while (stackSize)
+		{
+			const md3BVHNode_t& node = bvh->nodes[stack[--stackSize]];
+
+			// Skip nodes missed or behind the closest hit
+			if (!localRay.intersect(node.mins, node.maxs) || localRay.getFraction() > closest)
+				continue;
+
+			if (node.count)
+			{
+				const int lane = localRay.intersect(&bvh->packets[node.first], 1);
+				if (lane >= 0 && localRay.getFraction() < closest)
+				{
+					closest = localRay.getFraction();
+					closestNormal = localRay.getNormal();
+				}
+			}
+			else
+			{
+				kAssert(stackSize + 2 <= 64);
+				stack[stackSize++] = node.first;
+				stack[stackSize++] = (&node - &bvh->nodes[0]) + 1;
+			}
+		}
+	}
+	else
+	{
+		for (unsigned int i = 0; i < trianglesCount; i++)
+			traceTriangle(localRay, vertices, i, closest, closestNormal);
+	}
+
+	if (closest == noHit)
+		return false;
+
+	traceRay.setFraction(closest);
+	traceRay.setNormal(closestNormal);
+	return true;
+}
+
 bool md3Surface::isOpaque() const
 {
 	if (mMaterial)
@@ -268,6 +659,17 @@ md3model::~md3model()
 
 	mAttach.clear();
 	mAnimations.clear();
+
+	if (mInterpolatedVertices)
+	{
+		for (unsigned int i = 0; i < getSurfacesCount(); i++)
+		{
+			if (mInterpolatedVertices[i])
+				free(mInterpolatedVertices[i]);
+		}
+
+		delete [] mInterpolatedVertices;
+	}
 }
 
 md3model::md3model(const md3model* shared) : drawable3D()
@@ -285,6 +687,12 @@ md3model::md3model(const md3model* shared) : drawable3D()
 	mCurrentAnimFrame = 0;
 
 	mAutoFeedAnims = true;
+	mPrepared = false;
+	mInterpolate = false;
+	mTraceBVH = true;
+	mInterpolationSteps = 0;
+	mInterpolatedFrame = -1;
+	mInterpolatedVertices = NULL;
 	mActiveAnimation = NULL;
 	mAnimations.clear();
 	mLastFeedTime = 0;
@@ -338,6 +746,12 @@ md3model::md3model(const std::string& filename, bool adjustVertices)
 	mShared = NULL;
 
 	mAutoFeedAnims = true;
+	mPrepared = false;
+	mInterpolate = false;
+	mTraceBVH = true;
+	mInterpolationSteps = 0;
+	mInterpolatedFrame = -1;
+	mInterpolatedVertices = NULL;
 	mActiveAnimation = NULL;
 	mAnimations.clear();
 	
@@ -658,6 +1072,12 @@ md3model::md3model(const std::string& filename, bool adjustVertices)
 
 		// FrameCount
 		mSurfaces[i].setFrameCount(readLEInt(tempSurface.numFrames));
+
+		// Frames never change, keep them on GPU
+		mSurfaces[i].upload();
+
+		// Bounds for trace rejection
+		mSurfaces[i].calculateFrameBounds();
 	}
 
 	S_LOG_INFO("MD3 Model " + filename + " loaded.");
@@ -715,12 +1135,112 @@ void md3model::feedAnims()
 		mCurrentAnimFrame -= mActiveAnimation->numFrames;
 }
 
+void md3model::setInterpolation(bool interpolate, unsigned int steps)
+{
+	mInterpolate = interpolate;
+	mInterpolationSteps = steps;
+	mInterpolatedFrame = -1;
+
+	if (!mInterpolate || !getSurfacesCount())
+		return;
+
+	if (!mInterpolatedVertices)
+	{
+		try
+		{
+			mInterpolatedVertices = new md3RealVertex*[getSurfacesCount()];
+		}
+
+		catch (...)
+		{
+			S_LOG_INFO("Failed to allocate md3 interpolation buffers.");
+			mInterpolate = false;
+			return;
+		}
+
+		for (unsigned int i = 0; i < getSurfacesCount(); i++)
+			mInterpolatedVertices[i] = NULL;
+	}
+
+	for (unsigned int i = 0; i < getSurfacesCount(); i++)
+	{
+		if (mInterpolatedVertices[i])
+			continue;
+
+		mInterpolatedVertices[i] = (md3RealVertex*) memalign(32, sizeof(md3RealVertex) * getSurface(i)->getVertexCount());
+		if (!mInterpolatedVertices[i])
+		{
+			S_LOG_INFO("Failed to allocate md3 interpolation buffers.");
+			mInterpolate = false;
+		}
+	}
+}
+
+void md3model::updateInterpolation()
+{
+	if (!mInterpolate)
+		return;
+
+	unsigned int from = (uint32_t)mCurrentAnimFrame;
+	unsigned int to = from;
+	vec_t fraction = mCurrentAnimFrame - from;
+
+	if (mActiveAnimation)
+	{
+		to = from + 1;
+		if (to >= mActiveAnimation->firstFrame + mActiveAnimation->numFrames)
+			to = mActiveAnimation->firstFrame;
+	}
+
+	if (to >= (unsigned int)getFramesCount())
+		to = from;
+
+	// Trade smoothness for speed
+	if (mInterpolationSteps)
+		fraction = floor(fraction * mInterpolationSteps) / mInterpolationSteps;
+
+	const vec_t frame = from + fraction;
+	if (frame == mInterpolatedFrame)
+		return;
+
+	for (unsigned int i = 0; i < getSurfacesCount(); i++)
+		getSurface(i)->interpolate(from, to, fraction, mInterpolatedVertices[i]);
+
+	mInterpolatedFrame = frame;
+}
+
+void md3model::_prepareTree()
+{
+	feedAnims();
+	updateInterpolation();
+	mPrepared = true;
+
+	for (std::vector<md3model*>::iterator it = mAttach.begin(); it != mAttach.end(); it++)
+		(*it)->_prepareTree();
+}
+
+void md3model::prepare()
+{
+	// Attached models are prepared by their parent, 
+	// even when they are also in the renderer list.
+	if (mAttachParent)
+		return;
+
+	_prepareTree();
+}
+
 void md3model::draw()
 {
 	renderSystem* rs = root::getSingleton().getRenderSystem();
 
-	// Feed animations =]
-	feedAnims();
+	// Feed animations =], unless the renderer already did
+	if (!mPrepared)
+	{
+		feedAnims();
+		updateInterpolation();
+	}
+
+	mPrepared = false;
 
 	// Rotate and Translate
 	vector3 finalPos = getAbsolutePosition();
@@ -745,10 +1265,15 @@ void md3model::draw()
 	rs->scaleScene(mScale.x, mScale.y, mScale.z);
 
 	for (unsigned int i = 0; i < getSurfacesCount(); i++)
-		getSurface(i)->draw((uint32_t)mCurrentAnimFrame);
+	{
+		if (mInterpolate)
+			getSurface(i)->drawVertices(mInterpolatedVertices[i]);
+		else
+			getSurface(i)->draw((uint32_t)mCurrentAnimFrame);
+	}
 
 	if (getDrawBoundingBox())
-		getAABoundingBox().draw();
+		_getFrameBounds().draw();
 		
 	// Attached
 	for (std::vector<md3model*>::iterator it = mAttach.begin(); it != mAttach.end(); it++)
@@ -782,8 +1307,14 @@ void md3model::attachDraw()
 	
 	renderSystem* rs = root::getSingleton().getRenderSystem();
 
-	// Feed animations =]
-	feedAnims();
+	// Feed animations =], unless the renderer already did
+	if (!mPrepared)
+	{
+		feedAnims();
+		updateInterpolation();
+	}
+
+	mPrepared = false;
 
 	// Get Our Tags
 	md3Tag* mAttachedTo = mAttachParent->getTag(mAttachTag);
@@ -806,28 +1337,32 @@ void md3model::attachDraw()
 	rs->rotateScene(angle, axis.x, axis.y, axis.z);
 
 	for (unsigned int i = 0; i < getSurfacesCount(); i++)
-		getSurface(i)->draw((uint32_t)mCurrentAnimFrame);
+	{
+		if (mInterpolate)
+			getSurface(i)->drawVertices(mInterpolatedVertices[i]);
+		else
+			getSurface(i)->draw((uint32_t)mCurrentAnimFrame);
+	}
 
 	if (getDrawBoundingBox())
-		getAABoundingBox().draw();
+		_getFrameBounds().draw();
 
 	for (std::vector<md3model*>::iterator it = mAttach.begin(); it != mAttach.end(); it++)
 		(*it)->attachDraw();
 }
 
-boundingBox md3model::getAABoundingBox() const
+boundingBox md3model::_getFrameBounds() const
 {
-	if (mShared)
-		return mShared->getAABoundingBox();
+	const md3model* frames = mShared ? mShared : this;
+	const md3Frame_t& frame = frames->mFrames[(uint32_t)mCurrentAnimFrame];
 
-	vector3 mins = vector3(mFrames[(uint32_t)mCurrentAnimFrame].mins[0],
-			mFrames[(uint32_t)mCurrentAnimFrame].mins[1],
-			mFrames[(uint32_t)mCurrentAnimFrame].mins[2]);
-	vector3 maxs = vector3(mFrames[(uint32_t)mCurrentAnimFrame].maxs[0],
-			mFrames[(uint32_t)mCurrentAnimFrame].maxs[1],
-			mFrames[(uint32_t)mCurrentAnimFrame].maxs[2]);
+	return boundingBox(vector3(frame.mins[0], frame.mins[1], frame.mins[2]),
+			vector3(frame.maxs[0], frame.maxs[1], frame.maxs[2]));
+}
 
-	return boundingBox(mins, maxs);
+boundingBox md3model::getAABoundingBox() const
+{
+	return _getFrameBounds().transform(getAbsolutePosition(), getAbsoluteOrientation(), mScale);
 }
 
 boundingBox md3model::getBoundingBox() const
@@ -956,16 +1491,59 @@ void md3model::setDrawNormals(bool draw)
 		
 bool md3model::trace(ray& traceRay)
 {
-	matrix4 mFinal = mOrientation.toMatrix().getInverseTranslation(mPosition);
+	// World to model space: unscale(unrotate(p - position))
+	const quaternion& orientation = getAbsoluteOrientation();
+	const vector3 position = orientation.inverseVector(getAbsolutePosition());
+	const vector3 axis[3] = 
+	{
+		orientation.inverseVector(vector3(1, 0, 0)),
+		orientation.inverseVector(vector3(0, 1, 0)),
+		orientation.inverseVector(vector3(0, 0, 1))
+	};
+
+	matrix4 mFinal;
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		const vec_t invScale = 1.0f / mScale.vec[i];
+		for (unsigned int j = 0; j < 3; j++)
+			mFinal.m[i][j] = axis[j].vec[i] * invScale;
+
+		mFinal.m[i][3] = -position.vec[i] * invScale;
+	}
+
 	traceRay.setTransformation(mFinal);
 
+	const vec_t noHit = 1e30f;
+	vec_t closest = noHit;
+	vector3 closestNormal;
+	int closestSurface = -1;
+
 	for (unsigned int i = 0; i < getSurfacesCount(); i++)
 	{
-		if (getSurface(i)->trace(traceRay, (uint32_t)mCurrentAnimFrame))
-			return true;
+		if (getSurface(i)->trace(traceRay, (uint32_t)mCurrentAnimFrame, mTraceBVH) && traceRay.getFraction() < closest)
+		{
+			closest = traceRay.getFraction();
+			closestNormal = traceRay.getNormal();
+			closestSurface = i;
+		}
 	}
 
-	return false;
+	if (closest == noHit)
+	{
+		traceRay.setFraction(0);
+		traceRay.setSurface(-1);
+		return false;
+	}
+
+	// Normals go back to world with the inverse transpose
+	vector3 worldNormal(closestNormal.x / mScale.x, closestNormal.y / mScale.y, closestNormal.z / mScale.z);
+	worldNormal = orientation.rotateVector(worldNormal);
+	worldNormal.normalize();
+
+	traceRay.setFraction(closest);
+	traceRay.setNormal(worldNormal);
+	traceRay.setSurface(closestSurface);
+	return true;
 }
 
 }
@@ -29,9 +29,122 @@ THE SOFTWARE.
 
 namespace k {
 
+/**
+ * GPU skinning program, shared by all md5 models. Bones are uploaded
+ * as two vec4 (orientation quaternion, position) and normals are kept
+ * on bind pose like the CPU path. Lighting follows the fixed pipeline
+ * (color material) for the enabled lights.
+ */
+static const char* md5SkinVertexProgram = 
+	"#define MAX_BONES 80\n"
+	"uniform vec4 bones[MAX_BONES * 2];\n"
+	"uniform int lightsCount;\n"
+	"attribute vec4 boneIndices;\n"
+	"attribute vec4 boneWeights;\n"
+	"attribute vec3 weightPos1;\n"
+	"attribute vec3 weightPos2;\n"
+	"attribute vec3 weightPos3;\n"
+	"vec3 skin(float bone, vec3 pos)\n"
+	"{\n"
+	"	int b = int(bone) * 2;\n"
+	"	vec3 t = 2.0 * cross(bones[b].xyz, pos);\n"
+	"	return pos + bones[b].w * t + cross(bones[b].xyz, t) + bones[b + 1].xyz;\n"
+	"}\n"
+	"void main()\n"
+	"{\n"
+	"	vec3 pos = skin(boneIndices.x, gl_Vertex.xyz) * boneWeights.x;\n"
+	"	pos += skin(boneIndices.y, weightPos1) * boneWeights.y;\n"
+	"	pos += skin(boneIndices.z, weightPos2) * boneWeights.z;\n"
+	"	pos += skin(boneIndices.w, weightPos3) * boneWeights.w;\n"
+	"	vec4 eyePos = gl_ModelViewMatrix * vec4(pos, 1.0);\n"
+	"	gl_Position = gl_ProjectionMatrix * eyePos;\n"
+	"	gl_TexCoord[0] = gl_TextureMatrix[0] * gl_MultiTexCoord0;\n"
+	"	gl_TexCoord[1] = gl_TextureMatrix[1] * gl_MultiTexCoord0;\n"
+	"	gl_TexCoord[2] = gl_TextureMatrix[2] * gl_MultiTexCoord0;\n"
+	"	gl_TexCoord[3] = gl_TextureMatrix[3] * gl_MultiTexCoord0;\n"
+	"	if (lightsCount == 0)\n"
+	"	{\n"
+	"		gl_FrontColor = gl_Color;\n"
+	"		return;\n"
+	"	}\n"
+	"	vec3 normal = normalize(gl_NormalMatrix * gl_Normal);\n"
+	"	vec4 color = gl_LightModel.ambient * gl_Color;\n"
+	"	for (int i = 0; i < 8; i++)\n"
+	"	{\n"
+	"		if (i >= lightsCount)\n"
+	"			break;\n"
+	"		vec3 dir = gl_LightSource[i].position.xyz - eyePos.xyz * gl_LightSource[i].position.w;\n"
+	"		float dist = length(dir);\n"
+	"		float att = 1.0;\n"
+	"		if (gl_LightSource[i].position.w != 0.0)\n"
+	"			att = 1.0 / (gl_LightSource[i].constantAttenuation + gl_LightSource[i].linearAttenuation * dist +\n"
+	"				gl_LightSource[i].quadraticAttenuation * dist * dist);\n"
+	"		float diffuse = max(dot(normal, dir / dist), 0.0);\n"
+	"		color += att * (gl_LightSource[i].ambient + gl_LightSource[i].diffuse * diffuse) * gl_Color;\n"
+	"	}\n"
+	"	gl_FrontColor = clamp(color, 0.0, 1.0);\n"
+	"}\n";
+
+enum md5SkinProgramState
+{
+	MD5_SKIN_UNTESTED,
+	MD5_SKIN_READY,
+	MD5_SKIN_UNSUPPORTED
+};
+
+static int md5SkinState = MD5_SKIN_UNTESTED;
+static platformProgram md5SkinProgram;
+static int md5SkinBones;
+static int md5SkinLightsCount;
+static int md5SkinIndices;
+static int md5SkinWeights;
+static int md5SkinWeightPos[MD5_GPU_MAX_WEIGHTS - 1];
+
+/**
+ * Compile the skinning program on first use.
+ */
+static bool prepareSkinProgram()
+{
+	if (md5SkinState != MD5_SKIN_UNTESTED)
+		return md5SkinState == MD5_SKIN_READY;
+
+	md5SkinState = MD5_SKIN_UNSUPPORTED;
+	renderSystem* rs = root::getSingleton().getRenderSystem();
+
+	if (!rs->getProgramSupport() || !rs->getVBOSupport())
+		return false;
+
+	// Bones and built in uniforms (matrices, lights)
+	if (rs->getProgramMaxUniforms() < (MD5_GPU_MAX_BONES * 2) + 64)
+	{
+		S_LOG_INFO("Not enough vertex program uniforms for md5 GPU skinning.");
+		return false;
+	}
+
+	if (!rs->genProgram(&md5SkinProgram, md5SkinVertexProgram, NULL))
+	{
+		S_LOG_INFO("Failed to create md5 skinning program, skinning on CPU.");
+		return false;
+	}
+
+	md5SkinBones = rs->getProgramUniform(&md5SkinProgram, "bones");
+	md5SkinLightsCount = rs->getProgramUniform(&md5SkinProgram, "lightsCount");
+	md5SkinIndices = rs->getProgramAttribute(&md5SkinProgram, "boneIndices");
+	md5SkinWeights = rs->getProgramAttribute(&md5SkinProgram, "boneWeights");
+	md5SkinWeightPos[0] = rs->getProgramAttribute(&md5SkinProgram, "weightPos1");
+	md5SkinWeightPos[1] = rs->getProgramAttribute(&md5SkinProgram, "weightPos2");
+	md5SkinWeightPos[2] = rs->getProgramAttribute(&md5SkinProgram, "weightPos3");
+
+	md5SkinState = MD5_SKIN_READY;
+	return true;
+}
+
 md5mesh::md5mesh()
 {
 	mNormalList = NULL;
+	mVertexList[0] = mVertexList[1] = NULL;
+	mFrontBuffer = 0;
+	mUvList = NULL;
 	mIndexList = NULL;
 	mIndexListSize = 0;
 	mDrawNormals = false;
@@ -48,6 +161,9 @@ md5mesh::md5mesh()
 	mTIndex = 0;
 	mTCount = 0;
 	mTriangles = NULL;
+
+	mGPUReady = false;
+	mGPUSkinning = false;
 }
 
 md5mesh::~md5mesh()
@@ -61,8 +177,11 @@ md5mesh::~md5mesh()
 	if (mVertices)
 		free(mVertices);
 
-	if (mVertexList)
-		free(mVertexList);
+	if (mVertexList[0])
+		free(mVertexList[0]);
+
+	if (mVertexList[1])
+		free(mVertexList[1]);
 
 	if (mUvList)
 		free(mUvList);
@@ -72,6 +191,13 @@ md5mesh::~md5mesh()
 	
 	if (mTriangles)
 		free(mTriangles);
+
+	if (mGPUReady)
+	{
+		renderSystem* rs = root::getSingleton().getRenderSystem();
+		rs->delVBO(&mSkinVBO);
+		rs->delVBO(&mIndexVBO);
+	}
 }
 		
 void md5mesh::setDrawNormals(bool draw)
@@ -112,26 +238,35 @@ const boundingBox& md5mesh::getAABoundingBox()
 void md5mesh::prepareVertices(unsigned int size)
 {
 	mVertices = (vert_t*) memalign(32, size * sizeof(vert_t));
-	mVertexList = (vec_t*) memalign(32, size * sizeof(vec_t) * 3);
+	mVertexList[0] = (vec_t*) memalign(32, size * sizeof(vec_t) * 3);
+	mVertexList[1] = (vec_t*) memalign(32, size * sizeof(vec_t) * 3);
 	mUvList = (vec_t*) memalign(32, size * sizeof(vec_t) * 2);
 
-	if (!mVertices || !mVertexList || !mUvList)
+	if (!mVertices || !mVertexList[0] || !mVertexList[1] || !mUvList)
 	{
 		S_LOG_INFO("Failed to prepare vertices array on md5 model.");
 
-		if (!mVertices)
+		if (mVertices)
 			free(mVertices);
 
-		if (!mVertexList)
-			free(mVertexList);
+		if (mVertexList[0])
+			free(mVertexList[0]);
+
+		if (mVertexList[1])
+			free(mVertexList[1]);
 
-		if (!mUvList)
+		if (mUvList)
 			free(mUvList);
+
+		mVertices = NULL;
+		mVertexList[0] = mVertexList[1] = NULL;
+		mUvList = NULL;
 	}
 	else
 	{
 		memset(mUvList, 0, sizeof(vec_t) * 2 * size);
-		memset(mVertexList, 0, sizeof(vec_t) * 3 * size);
+		memset(mVertexList[0], 0, sizeof(vec_t) * 3 * size);
+		memset(mVertexList[1], 0, sizeof(vec_t) * 3 * size);
 		memset(mVertices, 0, sizeof(vert_t) * size);
 		mVCount = size;
 	}
@@ -218,6 +353,13 @@ void md5mesh::setMaterial(const std::string& matName)
 		
 void md5mesh::compileVertices(std::vector<bone_t*>* boneList)
 {
+	// Skinned by the vertex program
+	if (getGPUSkinning())
+		return;
+
+	// Write into the back buffer, draw keeps using the front one
+	vec_t* vertexList = mVertexList[mFrontBuffer ^ 1];
+
 	for (unsigned int vIt = 0; vIt < mVCount; vIt++)
 	{
 		vert_t* vertex = &mVertices[vIt];
@@ -245,9 +387,9 @@ void md5mesh::compileVertices(std::vector<bone_t*>* boneList)
 		}
 
 		// Put on vertex list
-		mVertexList[vIt*3] = vertex->renderPos.x;
-		mVertexList[vIt*3 + 1] = vertex->renderPos.y;
-		mVertexList[vIt*3 + 2] = vertex->renderPos.z;
+		vertexList[vIt*3] = vertex->renderPos.x;
+		vertexList[vIt*3 + 1] = vertex->renderPos.y;
+		vertexList[vIt*3 + 2] = vertex->renderPos.z;
 		mUvList[vIt*2] = vertex->uv.x;
 		mUvList[vIt*2 + 1] = vertex->uv.y;
 	}
@@ -260,6 +402,9 @@ void md5mesh::compileVertices(std::vector<bone_t*>* boneList)
 		mNormalList[i+2*i+1] = mVertices[i].renderNormal.y;
 		mNormalList[i+2*i+2] = mVertices[i].renderNormal.z;
 	}
+
+	// Publish the finished buffer
+	mFrontBuffer ^= 1;
 }
 
 void md5mesh::compileBase(std::vector<bone_t*>* boneList)
@@ -291,9 +436,13 @@ void md5mesh::compileBase(std::vector<bone_t*>* boneList)
 		vertex->renderPos = vertex->basePos;
 
 		// Put on vertex list
-		mVertexList[vIt*3] = vertex->basePos.x;
-		mVertexList[vIt*3 + 1] = vertex->basePos.y;
-		mVertexList[vIt*3 + 2] = vertex->basePos.z;
+		for (unsigned int b = 0; b < 2; b++)
+		{
+			mVertexList[b][vIt*3] = vertex->basePos.x;
+			mVertexList[b][vIt*3 + 1] = vertex->basePos.y;
+			mVertexList[b][vIt*3 + 2] = vertex->basePos.z;
+		}
+
 		mUvList[vIt*2] = vertex->uv.x;
 		mUvList[vIt*2 + 1] = vertex->uv.y;
 
@@ -406,13 +555,139 @@ void md5mesh::compileBase(std::vector<bone_t*>* boneList)
 	}
 }
 
+bool md5mesh::prepareGPUSkinning()
+{
+	if (mGPUReady)
+		return true;
+
+	if (!mVCount || !mIndexList || !prepareSkinProgram())
+		return false;
+
+	// Only a fixed number of weights fit on the attributes
+	for (unsigned int i = 0; i < mVCount; i++)
+	{
+		if (mVertices[i].weight.y > MD5_GPU_MAX_WEIGHTS)
+			return false;
+	}
+
+	gpuVert_t* gpuVertices = (gpuVert_t*) memalign(32, mVCount * sizeof(gpuVert_t));
+	if (!gpuVertices)
+	{
+		S_LOG_INFO("Failed to allocate md5 GPU skinning vertices.");
+		return false;
+	}
+
+	memset(gpuVertices, 0, mVCount * sizeof(gpuVert_t));
+	for (unsigned int vIt = 0; vIt < mVCount; vIt++)
+	{
+		vert_t* vertex = &mVertices[vIt];
+		gpuVert_t* gpuVertex = &gpuVertices[vIt];
+
+		gpuVertex->normal[0] = vertex->baseNormal.x;
+		gpuVertex->normal[1] = vertex->baseNormal.y;
+		gpuVertex->normal[2] = vertex->baseNormal.z;
+		gpuVertex->uv[0] = vertex->uv.x;
+		gpuVertex->uv[1] = vertex->uv.y;
+
+		for (int w = 0; w < vertex->weight.y; w++)
+		{
+			weight_t* weight = &mWeights[(int)vertex->weight.x + w];
+			vec_t* pos = (w == 0) ? gpuVertex->pos : gpuVertex->weightPos[w - 1];
+
+			gpuVertex->bones[w] = weight->jointIndex;
+			gpuVertex->weights[w] = weight->value;
+
+			pos[0] = weight->pos.x;
+			pos[1] = weight->pos.y;
+			pos[2] = weight->pos.z;
+		}
+	}
+
+	renderSystem* rs = root::getSingleton().getRenderSystem();
+
+	rs->genVBO(&mSkinVBO);
+	rs->bindVBO(&mSkinVBO, VBO_ARRAY);
+	rs->setVBOData(VBO_ARRAY, mVCount * sizeof(gpuVert_t), gpuVertices, VBO_STATIC_DRAW);
+	rs->bindVBO(NULL, VBO_ARRAY);
+
+	rs->genVBO(&mIndexVBO);
+	rs->bindVBO(&mIndexVBO, VBO_ELEMENT_ARRAY);
+	rs->setVBOData(VBO_ELEMENT_ARRAY, mIndexListSize * sizeof(index_t), mIndexList, VBO_STATIC_DRAW);
+	rs->bindVBO(NULL, VBO_ELEMENT_ARRAY);
+
+	free(gpuVertices);
+
+	mGPUReady = true;
+	return true;
+}
+
+void md5mesh::setGPUSkinning(bool enabled)
+{
+	mGPUSkinning = enabled && mGPUReady;
+}
+
+void md5mesh::drawGPUSkinned(const vec_t* bonePalette, unsigned int bonesCount)
+{
+	renderSystem* rs = root::getSingleton().getRenderSystem();
+	const unsigned int stride = sizeof(gpuVert_t);
+
+	mMaterial->start();
+
+	// After start(), so a material program never replaces the skinning one
+	rs->bindProgram(&md5SkinProgram);
+	rs->setProgramUniform(md5SkinBones, bonePalette, bonesCount * 2);
+	rs->setProgramUniform(md5SkinLightsCount, rs->isLightOn() ? (int)rs->getLightsCount() : 0);
+
+	rs->bindVBO(&mSkinVBO, VBO_ARRAY);
+	rs->bindVBO(&mIndexVBO, VBO_ELEMENT_ARRAY);
+
+	rs->clearArrayDesc();
+	rs->setVBO(true);
+
+	rs->setVertexArray((unsigned int)0, stride);
+	rs->setVertexCount(mVCount);
+
+	rs->setNormalArray((unsigned int)(sizeof(vec_t) * 3), stride);
+	rs->setTexCoordArray((unsigned int)(sizeof(vec_t) * 6), stride);
+
+	rs->setAttributeArray(md5SkinIndices, MD5_GPU_MAX_WEIGHTS, sizeof(vec_t) * 8, stride);
+	rs->setAttributeArray(md5SkinWeights, MD5_GPU_MAX_WEIGHTS, sizeof(vec_t) * (8 + MD5_GPU_MAX_WEIGHTS), stride);
+	for (unsigned int i = 0; i < MD5_GPU_MAX_WEIGHTS - 1; i++)
+		rs->setAttributeArray(md5SkinWeightPos[i], 3, sizeof(vec_t) * (8 + MD5_GPU_MAX_WEIGHTS * 2 + i * 3), stride);
+
+	rs->setVertexIndex((unsigned int)0);
+	rs->setIndexCount(mIndexListSize);
+
+	rs->drawArrays();
+
+	rs->unsetAttributeArray(md5SkinIndices);
+	rs->unsetAttributeArray(md5SkinWeights);
+	for (unsigned int i = 0; i < MD5_GPU_MAX_WEIGHTS - 1; i++)
+		rs->unsetAttributeArray(md5SkinWeightPos[i]);
+
+	rs->setVBO(false);
+	rs->bindVBO(NULL, VBO_ARRAY);
+	rs->bindVBO(NULL, VBO_ELEMENT_ARRAY);
+
+	mMaterial->finish();
+	rs->bindProgram(NULL);
+}
+
+void md5mesh::draw(const vec_t* bonePalette, unsigned int bonesCount)
+{
+	if (bonePalette && getGPUSkinning())
+		drawGPUSkinned(bonePalette, bonesCount);
+	else
+		draw();
+}
+
 void md5mesh::draw()
 {
 	renderSystem* rs = root::getSingleton().getRenderSystem();
 	mMaterial->start();
 
 	rs->clearArrayDesc();
-	rs->setVertexArray(mVertexList);
+	rs->setVertexArray(mVertexList[mFrontBuffer]);
 	rs->setVertexCount(mVCount);
 
 	rs->setTexCoordArray(mUvList);
@@ -459,6 +734,9 @@ md5model::md5model(const std::string& filename) : drawable3D()
 	// Auto feed is on by default
 	mDrawableAttach = NULL;
 	mAutoFeedAnims = true;
+	mPrepared = false;
+	mGPUSkinning = false;
+	mBonePalette = NULL;
 
 	// Get Path from resource manager (if any)
 	std::string fullPath = filename;
@@ -706,6 +984,8 @@ md5model::md5model(const std::string& filename) : drawable3D()
 	// while (!token.is_empty())
 
 	compileBase();
+	setGPUSkinning(true);
+
 	S_LOG_INFO("MD5 Model " + filename + " loaded.");
 }
 
@@ -744,6 +1024,9 @@ md5model::~md5model()
 	mAnimations.clear();
 	mMeshes.clear();
 	mBones.clear();
+
+	if (mBonePalette)
+		free(mBonePalette);
 }
 
 void md5model::compileVertices()
@@ -756,6 +1039,57 @@ void md5model::compileVertices()
 	
 		mesh->compileVertices(&mBones);
 	}
+
+	// Bone palette for the skinning program
+	if (mGPUSkinning)
+	{
+		for (unsigned int i = 0; i < mBones.size(); i++)
+		{
+			const bone_t* bone = mBones[i];
+
+			mBonePalette[i*8] = bone->orientation.x;
+			mBonePalette[i*8 + 1] = bone->orientation.y;
+			mBonePalette[i*8 + 2] = bone->orientation.z;
+			mBonePalette[i*8 + 3] = bone->orientation.w;
+			mBonePalette[i*8 + 4] = bone->pos.x;
+			mBonePalette[i*8 + 5] = bone->pos.y;
+			mBonePalette[i*8 + 6] = bone->pos.z;
+			mBonePalette[i*8 + 7] = 0;
+		}
+	}
+}
+
+void md5model::setGPUSkinning(bool enabled)
+{
+	mGPUSkinning = false;
+
+	if (enabled && mBones.size() && mBones.size() <= MD5_GPU_MAX_BONES)
+	{
+		if (!mBonePalette)
+			mBonePalette = (vec_t*) memalign(32, mBones.size() * 8 * sizeof(vec_t));
+
+		if (!mBonePalette)
+			S_LOG_INFO("Failed to allocate md5 bone palette.");
+		else
+		{
+			std::list<md5mesh*>::iterator it;
+			for (it = mMeshes.begin(); it != mMeshes.end(); it++)
+			{
+				(*it)->setGPUSkinning((*it)->prepareGPUSkinning());
+				mGPUSkinning |= (*it)->getGPUSkinning();
+			}
+		}
+	}
+
+	if (!mGPUSkinning)
+	{
+		std::list<md5mesh*>::iterator it;
+		for (it = mMeshes.begin(); it != mMeshes.end(); it++)
+			(*it)->setGPUSkinning(false);
+	}
+
+	// Refresh buffers of whoever is skinning now
+	compileVertices();
 }
 
 void md5model::compileBase()
@@ -767,15 +1101,44 @@ void md5model::compileBase()
 		kAssert(mesh);
 	
 		mesh->compileBase(&mBones);
+
+		// Bind pose culling bounds
+		if (it == mMeshes.begin())
+			mPoseBounds = mesh->getAABoundingBox();
+		else
+			mPoseBounds += mesh->getAABoundingBox();
 	}
 }
 
+void md5model::updatePoseBounds(const anim_t* anim, vec_t frame)
+{
+	kAssert(anim);
+
+	if (!anim->numFrames || !anim->bounds)
+		return;
+
+	unsigned int first = (uint32_t)frame % anim->numFrames;
+	unsigned int next = (first + 1) % anim->numFrames;
+	vec_t fraction = frame - floor(frame);
+
+	const bound_t* firstBound = &anim->bounds[first];
+	const bound_t* nextBound = &anim->bounds[next];
+
+	// Bones are not interpolated, keep both poses inside
+	mPoseBounds = boundingBox(firstBound->mins, firstBound->maxs);
+	if (fraction > 0)
+		mPoseBounds += boundingBox(nextBound->mins, nextBound->maxs);
+}
+
 void md5model::draw()
 {
 	renderSystem* rs = root::getSingleton().getRenderSystem();
 
-	// Feed animations =]
-	feedAnims();
+	// Feed animations =], unless the renderer already did
+	if (!mPrepared)
+		feedAnims();
+
+	mPrepared = false;
 
 	vector3 finalPos = getAbsolutePosition();
 	quaternion finalOrientation = getAbsoluteOrientation();
@@ -807,11 +1170,18 @@ void md5model::draw()
 		md5mesh* mesh = (*it);
 		kAssert(mesh);
 	
-		mesh->draw();
+		mesh->draw(mBonePalette, mBones.size());
 	}
 	
+	// Already on model space
 	if (getDrawBoundingBox())
-		getAABoundingBox().draw();
+		mPoseBounds.draw();
+}
+
+void md5model::prepare()
+{
+	feedAnims();
+	mPrepared = true;
 }
 
 bool md5model::isOpaque() const
@@ -1213,6 +1583,10 @@ void md5model::feedAnims()
 		}
 	} // for Bones
 
+	// Culling bounds of the evaluated frame
+	if (mBones.size() && mBones[0]->currentAnim)
+		updatePoseBounds(mBones[0]->currentAnim, (uint32_t)mBones[0]->currentAnim->currentFrame);
+
 	compileVertices();
 }
 
@@ -1292,6 +1666,10 @@ void md5model::setAnimationFrame(unsigned int frameNum)
 		}
 	} // for Bones
 
+	// Culling bounds of the evaluated frame
+	if (mBones.size() && mBones[0]->currentAnim)
+		updatePoseBounds(mBones[0]->currentAnim, frameNum);
+
 	compileVertices();
 }
 		
@@ -1327,43 +1705,7 @@ boundingBox md5model::getBoundingBox() const
 
 boundingBox md5model::getAABoundingBox() const
 {
-	boundingBox AABB;
-
-	for (unsigned int i = 0; i < mBones.size(); i++)
-	{
-		bone_t* thisBone = mBones[i];
-		if (!thisBone)
-			continue;
-
-		anim_t* thisAnim = thisBone->currentAnim;
-		if (!thisAnim)
-			continue;
-
-		if (thisAnim)
-		{
-			// Get Bounds for current Frame
-			bound_t* animBound = &thisAnim->bounds[(int)thisAnim->currentFrame];
-			if (!animBound)
-				continue;
-
-			AABB.setTestMins(animBound->mins);
-			AABB.setTestMaxs(animBound->maxs);
-		}
-	}
-
-	// In case we didnt find any anim, use model ones
-	if (AABB.getMins() == vector3::zero && AABB.getMaxs() == vector3::zero)
-	{
-		std::list<md5mesh*>::const_iterator it;
-		for (it = mMeshes.begin(); it != mMeshes.end(); it++)
-		{
-			boundingBox meshAABB = (*it)->getAABoundingBox();
-			AABB.setTestMins(meshAABB.getMins());
-			AABB.setTestMaxs(meshAABB.getMaxs());
-		}
-	}
-
-	return AABB;
+	return mPoseBounds.transform(getAbsolutePosition(), getAbsoluteOrientation(), mScale);
 }
 
 }
@@ -25,6 +25,8 @@ THE SOFTWARE.
 #include "materialManager.h"
 #include "rendersystem.h"
 #include "root.h"
+#include "simd.h"
+#include "workerPool.h"
 
 namespace k {
 namespace particle {
@@ -62,125 +64,59 @@ static inline vector3 getRandomVelocity(const vector3& mMaxVelocity, const vecto
 	}
 }
 			
-particle::particle()
-{
-	mVisible = false;
-
-	mLastDrawTime = 0;
-	mSpawnTime = 0;
-	mLifeTime = 0;
-	mRadius = 0;
-
-	mParent = NULL;
-}
-
-const vector3& particle::getVelocity() const
-{
-	return mVelocity;
-}
-
-const vector3& particle::getAcceleration() const
-{
-	return mAcceleration;
-}
-
-bool particle::isVisible() const
+container::container()
 {
-	return mVisible;
-}
+	for (unsigned int i = 0; i < MAX_PARTICLE_ATTRIBUTES; i++)
+		mAttributes[i] = NULL;
 
-unsigned int particle::getSpawnTime() const
-{
-	return mSpawnTime;
-}
+	mParticlesCount = 0;
+	mCapacity = 0;
 
-unsigned int particle::getLifeTime() const
-{
-	return mLifeTime;
-}
-			
-vec_t particle::getRadius() const
-{
-	return mRadius;
-}
+	mBatch = NULL;
+	mVertexPositions = NULL;
 
-void particle::setVelocity(const vector3& vel)
-{
-	mVelocity = vel;
-}
-			
-void particle::setAcceleration(const vector3& accel)
-{
-	mAcceleration = accel;
-}
+	mSortParticles = false;
+	mSortBuffer = NULL;
+	mSorted = false;
 
-void particle::setLifeTime(unsigned int time)
-{
-	mLifeTime = time;
-}
+	mMaxNumberOfParticles = 0;
+	mMaterial = 0;
 
-void particle::setRadius(vec_t radi)
-{
-	mRadius = radi;
+	mTimer.reset();
+	mLastUpdate = 0;
+	mStepTime = 0;
 }
 
-void particle::setVisibility(bool vis)
+container::~container()
 {
-	mVisible = vis;
+	freeParticles();
 }
 
-void particle::resetLife(long time)
+void container::freeParticles()
 {
-	mSpawnTime = time;
-	mLastDrawTime = time;
-}
+	// All attributes share one allocation
+	if (mAttributes[0])
+		free(mAttributes[0]);
 
-void particle::updatePhysics(long time)
-{
-	// Update sprite position
-	vec_t timeScaleDiff = (time - mLastDrawTime)/1000.0f;
-	mLastDrawTime = time;
+	for (unsigned int i = 0; i < MAX_PARTICLE_ATTRIBUTES; i++)
+		mAttributes[i] = NULL;
 
-	if (timeScaleDiff < 0)
-		return;
+	if (mVertexPositions)
+		delete [] mVertexPositions;
 
-	// dv/dt
-	if (mAcceleration != vector3::zero)
-		mVelocity += mAcceleration * timeScaleDiff;
+	if (mBatch)
+		delete mBatch;
 
-	// dr/dt
-	mPosition += mVelocity * timeScaleDiff;
-}
+	if (mSortBuffer)
+		free(mSortBuffer);
 
-void particle::draw(sprite* spr)
-{
-	spr->setPosition(getAbsolutePosition());
-	spr->setRadius(mRadius);
-	spr->rawDraw();
-}
-			
-container::container()
-{
-	mParticles = NULL;
-	mSprite = NULL;
 	mVertexPositions = NULL;
+	mBatch = NULL;
+	mSortBuffer = NULL;
+	mSorted = false;
 
-	mMaxNumberOfParticles = 0;
-	mMaterial = 0;
-
-	mTimer.reset();
-}
-
-container::~container()
-{
-	if (mParticles)
-		delete mParticles;
-
-	if (mVertexPositions)
-		delete [] mVertexPositions;
-
-	if (mSprite)
-		delete mSprite;
+	mParticlesCount = 0;
+	mCapacity = 0;
 }
 			
 void container::setNumParticles(unsigned int numParticles)
@@ -191,10 +127,24 @@ void container::setNumParticles(unsigned int numParticles)
 		return;
 	}
 
-	try
+	if (mAttributes[0])
 	{
-		mParticles = new std::vector<particle>(numParticles);
+		S_LOG_INFO("Particle container quota is already set.");
+		return;
+	}
 
+	const unsigned int capacity = (numParticles + 3) & ~3;
+	vec_t* attributes = (vec_t*) memalign(32, sizeof(vec_t) * capacity * MAX_PARTICLE_ATTRIBUTES);
+	if (!attributes)
+	{
+		S_LOG_INFO("Failed to allocate particle container.");
+		return;
+	}
+
+	memset(attributes, 0, sizeof(vec_t) * capacity * MAX_PARTICLE_ATTRIBUTES);
+
+	try
+	{
 		renderSystem* rs = root::getSingleton().getRenderSystem();
 		if (rs->getPointSpriteSupport())
 		{
@@ -202,18 +152,24 @@ void container::setNumParticles(unsigned int numParticles)
 		}
 		else
 		{
-			mSprite = new sprite();
+			mBatch = new spriteBatch(SPRITEUV_RAWDRAW);
+			mBatch->reserve(numParticles);
 		}	
 	}
 
 	catch (...)
 	{
 		S_LOG_INFO("Failed to allocate particle container.");
+		free(attributes);
 		return;
 	}
 
+	for (unsigned int i = 0; i < MAX_PARTICLE_ATTRIBUTES; i++)
+		mAttributes[i] = attributes + i * capacity;
+
+	mCapacity = capacity;
 	mMaxNumberOfParticles = numParticles;
-	mFreeParticles = numParticles;
+	mParticlesCount = 0;
 }
 
 void container::setMaterial(const std::string& name)
@@ -227,61 +183,262 @@ void container::setMaterial(material* mat)
 	mMaterial = mat;
 }
 
-particle* container::findFreeParticle()
+bool container::spawnParticle(const vector3& pos, const vector3& vel, 
+	const vector3& accel, vec_t radius, unsigned int lifeTime)
 {
-	std::vector<particle>::iterator it;
-	for (it = mParticles->begin(); it != mParticles->end(); it++)
+	if (mParticlesCount >= mMaxNumberOfParticles)
+		return false;
+
+	const unsigned int index = mParticlesCount++;
+	mSorted = false;
+
+	for (unsigned int i = 0; i < 3; i++)
 	{
-		if (!(*it).isVisible())
-			return &(*it);
+		mAttributes[PARTICLE_POS_X + i][index] = pos.vec[i];
+		mAttributes[PARTICLE_VEL_X + i][index] = vel.vec[i];
+		mAttributes[PARTICLE_ACCEL_X + i][index] = accel.vec[i];
 	}
 
-	return NULL;
+	mAttributes[PARTICLE_RADIUS][index] = radius;
+	mAttributes[PARTICLE_AGE][index] = 0;
+	mAttributes[PARTICLE_LIFETIME][index] = lifeTime / 1000.0f;
+
+	return true;
 }
-			
-particle* container::spawnParticle()
+
+void container::integrate(vec_t dt, unsigned int first, unsigned int count)
 {
-	particle* newP = findFreeParticle();
-	if (newP)
+	kAssert(first + count <= mParticlesCount);
+
+	for (unsigned int i = 0; i < 3; i++)
 	{
-		mFreeParticles--;
+		// dv/dt
+		madArray(mAttributes[PARTICLE_VEL_X + i] + first, mAttributes[PARTICLE_ACCEL_X + i] + first, dt, count);
 
-		newP->setVisibility(true);
-		newP->resetLife(mTimer.getMilliSeconds());
+		// dr/dt
+		madArray(mAttributes[PARTICLE_POS_X + i] + first, mAttributes[PARTICLE_VEL_X + i] + first, dt, count);
 	}
 
-	return newP;
+	addArray(mAttributes[PARTICLE_AGE] + first, dt, count);
 }
 
-void container::update()
+vec_t container::advanceTime()
 {
-	long timeElapsed = mTimer.getMilliSeconds();
+	const long timeElapsed = mTimer.getMilliSeconds();
+	const vec_t dt = (timeElapsed - mLastUpdate) / 1000.0f;
+	mLastUpdate = timeElapsed;
+	mStepTime = dt > 0 ? dt : 0;
+	mSorted = false;
 
-	if (!mParticles)
-	{
-		S_LOG_INFO("No particles in the system, maybe you forgot to set quota?");
+	return mStepTime;
+}
+
+void container::killParticle(unsigned int index)
+{
+	kAssert(index < mParticlesCount);
+
+	const unsigned int last = --mParticlesCount;
+	mSorted = false;
+	if (index == last)
 		return;
-	}
 
-	std::vector<particle>::iterator it;
-	for (it = mParticles->begin(); it != mParticles->end(); it++)
+	for (unsigned int i = 0; i < MAX_PARTICLE_ATTRIBUTES; i++)
+		mAttributes[i][index] = mAttributes[i][last];
+}
+
+void container::expire()
+{
+	const vec_t* age = mAttributes[PARTICLE_AGE];
+	const vec_t* lifeTime = mAttributes[PARTICLE_LIFETIME];
+
+	unsigned int i = 0;
+	while (i < mParticlesCount)
 	{
-		particle* p = &(*it);
-		if (!p->isVisible())
+		// Dead particles are replaced by the last alive ones,
+		// so the same slots are tested until they survive.
+		#ifdef __HAVE_SSE3__
+		int dead = _mm_movemask_ps(_mm_cmpge_ps(_mm_load_ps(age + i), _mm_load_ps(lifeTime + i)));
+
+		// Ignore slots past the alive ones
+		if (mParticlesCount - i < 4)
+			dead &= (1 << (mParticlesCount - i)) - 1;
+
+		if (!dead)
+		{
+			i += 4;
 			continue;
+		}
+
+		unsigned int lane = 0;
+		while (!(dead & (1 << lane)))
+			lane++;
+
+		// Particle is dead - timed out.
+		killParticle(i + lane);
+		#else
+		if (age[i] >= lifeTime[i])
+			killParticle(i);
+		else
+			i++;
+		#endif
+	}
+}
+
+const unsigned int* container::radixSort(const vector3& eye, const vector3& direction)
+{
+	const unsigned int count = mParticlesCount;
+
+	vec_t* depth = mSortBuffer + mCapacity * 3;
+	unsigned int* indices = (unsigned int*) (mSortBuffer + mCapacity * 4);
+	unsigned int* tempIndices = indices + mCapacity;
+	unsigned short* keys = (unsigned short*) (tempIndices + mCapacity);
+	unsigned short* tempKeys = keys + mCapacity;
+
+	const vec_t* posX = mAttributes[PARTICLE_POS_X];
+	const vec_t* posY = mAttributes[PARTICLE_POS_Y];
+	const vec_t* posZ = mAttributes[PARTICLE_POS_Z];
+
+	// View depth, dot(origin + pos - eye, direction)
+	const vec_t base = (getParticlesOrigin() - eye).dotProduct(direction);
+	vec_t minDepth = base + posX[0] * direction.x + posY[0] * direction.y + posZ[0] * direction.z;
+	vec_t maxDepth = minDepth;
+
+	unsigned int i = 0;
+
+	#ifdef __HAVE_SSE3__
+	if (count >= 4)
+	{
+		const __m128 dx = _mm_set1_ps(direction.x);
+		const __m128 dy = _mm_set1_ps(direction.y);
+		const __m128 dz = _mm_set1_ps(direction.z);
+		const __m128 db = _mm_set1_ps(base);
+
+		__m128 minD = _mm_set1_ps(minDepth);
+		__m128 maxD = minD;
 
-		if ((timeElapsed - p->getSpawnTime()) >= p->getLifeTime())
+		for (; i + 4 <= count; i += 4)
 		{
-			// Particle is dead - timed out.
-			p->setVisibility(false);
-			mFreeParticles++;
+			__m128 d = _mm_add_ps(db, _mm_mul_ps(_mm_load_ps(posX + i), dx));
+			d = _mm_add_ps(d, _mm_mul_ps(_mm_load_ps(posY + i), dy));
+			d = _mm_add_ps(d, _mm_mul_ps(_mm_load_ps(posZ + i), dz));
+			_mm_store_ps(depth + i, d);
+
+			minD = _mm_min_ps(minD, d);
+			maxD = _mm_max_ps(maxD, d);
+		}
+
+		vec_t lanes[4] ATTRIBUTE_ALIGN(16);
+		_mm_store_ps(lanes, minD);
+		minDepth = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+		_mm_store_ps(lanes, maxD);
+		maxDepth = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+	}
+	#endif
+
+	for (; i < count; i++)
+	{
+		depth[i] = base + posX[i] * direction.x + posY[i] * direction.y + posZ[i] * direction.z;
+		minDepth = std::min(minDepth, depth[i]);
+		maxDepth = std::max(maxDepth, depth[i]);
+	}
+
+	// Quantize, farthest particles get the smallest keys
+	const vec_t range = maxDepth - minDepth;
+	const vec_t scale = range > 0 ? 65535.0f / range : 0;
+	for (i = 0; i < count; i++)
+	{
+		keys[i] = (unsigned short) ((maxDepth - depth[i]) * scale);
+		indices[i] = i;
+	}
+
+	// Two stable 8 bits passes, low byte first
+	for (unsigned int shift = 0; shift < 16; shift += 8)
+	{
+		unsigned int offsets[256];
+		memset(offsets, 0, sizeof(offsets));
+
+		for (i = 0; i < count; i++)
+			offsets[(keys[i] >> shift) & 0xFF]++;
+
+		unsigned int sum = 0;
+		for (unsigned int b = 0; b < 256; b++)
+		{
+			const unsigned int bucket = offsets[b];
+			offsets[b] = sum;
+			sum += bucket;
 		}
+
+		for (i = 0; i < count; i++)
+		{
+			const unsigned int dest = offsets[(keys[i] >> shift) & 0xFF]++;
+			tempKeys[dest] = keys[i];
+			tempIndices[dest] = indices[i];
+		}
+
+		std::swap(keys, tempKeys);
+		std::swap(indices, tempIndices);
 	}
+
+	// After an even number of passes the result is back on the first arrays
+	return indices;
+}
+
+void container::sortParticles(const vector3& eye, const vector3& direction)
+{
+	mSorted = false;
+	if (!mSortParticles || !mAttributes[0] || !mParticlesCount)
+		return;
+
+	if (!mSortBuffer)
+	{
+		// Positions and radius, indices and keys (both double buffered)
+		const unsigned int size = mCapacity * (sizeof(vec_t) * 4 + 
+			sizeof(unsigned int) * 2 + sizeof(unsigned short) * 2);
+
+		mSortBuffer = (vec_t*) memalign(32, size);
+		if (!mSortBuffer)
+			return;
+	}
+
+	const unsigned int* indices = radixSort(eye, direction);
+
+	vec_t* sortedX = mSortBuffer;
+	vec_t* sortedY = sortedX + mCapacity;
+	vec_t* sortedZ = sortedY + mCapacity;
+	vec_t* sortedRadius = sortedZ + mCapacity;
+
+	// Radius are written over the depths, no longer needed
+	for (unsigned int i = 0; i < mParticlesCount; i++)
+	{
+		const unsigned int index = indices[i];
+
+		sortedX[i] = mAttributes[PARTICLE_POS_X][index];
+		sortedY[i] = mAttributes[PARTICLE_POS_Y][index];
+		sortedZ[i] = mAttributes[PARTICLE_POS_Z][index];
+		sortedRadius[i] = mAttributes[PARTICLE_RADIUS][index];
+	}
+
+	mSorted = true;
+}
+
+void container::update()
+{
+	if (!mAttributes[0])
+	{
+		S_LOG_INFO("No particles in the system, maybe you forgot to set quota?");
+		return;
+	}
+
+	const vec_t dt = advanceTime();
+	if (dt > 0)
+		integrate(dt, 0, mParticlesCount);
+
+	expire();
 }
 
 void container::draw()
 {
-	if (!mParticles)
+	if (!mAttributes[0])
 	{
 		S_LOG_INFO("No particles in the system, maybe you forgot to set quota?");
 		return;
@@ -294,49 +451,60 @@ void container::draw()
 	}
 	else
 	{
-		kAssert(mSprite);
+		kAssert(mBatch);
 	}
 
-	kAssert(mParticles);
 	kAssert(mMaterial);
 
-	mMaterial->start();
-	rs->setDepthMask(false); // FIXME: We need a "proper" way of doing this
+	const vector3 origin = getParticlesOrigin();
+	const vec_t* posX = mAttributes[PARTICLE_POS_X];
+	const vec_t* posY = mAttributes[PARTICLE_POS_Y];
+	const vec_t* posZ = mAttributes[PARTICLE_POS_Z];
+	const vec_t* radius = mAttributes[PARTICLE_RADIUS];
 
-	if (rs->getPointSpriteSupport())
+	// Draw back to front
+	if (mSorted)
 	{
-		std::vector<particle>::iterator it = mParticles->begin();
+		posX = mSortBuffer;
+		posY = posX + mCapacity;
+		posZ = posY + mCapacity;
+		radius = posZ + mCapacity;
+	}
 
-		vec_t particleOldRadius = it->getRadius(); 
-		vec_t particleRadius = it->getRadius(); 
+	camera* haveCamera = root::getSingleton().getRenderer()->getCamera();
 
-		while (it != mParticles->end())
+	// Blended particles dont write depth, opaque ones follow the material
+	mMaterial->start();
+	if (!mMaterial->isOpaque())
+		rs->setDepthMask(false);
+
+	if (rs->getPointSpriteSupport())
+	{
+		unsigned int index = 0;
+		while (index < mParticlesCount)
 		{
+			// Draw runs of particles with the same radius
 			unsigned int particleIndex = 0;
-			for (; it != mParticles->end(); it++)
+			vec_t particleRadius = 0;
+
+			for (; index < mParticlesCount; index++)
 			{
-				particle* p = &(*it);
-				if (!p->isVisible())
-					continue;
-
-				if (p->getRadius() != particleRadius)
-				{
-					particleOldRadius = particleRadius;
-					particleRadius = p->getRadius();
+				if (!particleIndex)
+					particleRadius = radius[index];
+				else
+				if (radius[index] != particleRadius)
 					break;
-				}
 
-				p->updatePhysics(mTimer.getMilliSeconds());
-				const vector3& pos = p->getAbsolutePosition();
-
-				mVertexPositions[particleIndex * 3 + 0] = pos.x;
-				mVertexPositions[particleIndex * 3 + 1] = pos.y;
-				mVertexPositions[particleIndex * 3 + 2] = pos.z;
+				mVertexPositions[particleIndex * 3 + 0] = origin.x + posX[index];
+				mVertexPositions[particleIndex * 3 + 1] = origin.y + posY[index];
+				mVertexPositions[particleIndex * 3 + 2] = origin.z + posZ[index];
 
 				particleIndex++;		
 			}
+
+			if (!particleIndex)
+				break;
 	
-			camera* haveCamera = root::getSingleton().getRenderer()->getCamera();
 			if (!haveCamera)
 			{
 				rs->setMatrixMode(MATRIXMODE_MODELVIEW);
@@ -348,7 +516,7 @@ void container::draw()
 			}
 					
 			rs->setPointSprite(true);
-			rs->setPointSpriteSize(particleOldRadius);
+			rs->setPointSpriteSize(particleRadius);
 		
 			rs->drawPointSprites(mVertexPositions, particleIndex);
 
@@ -357,31 +525,24 @@ void container::draw()
 	}
 	else
 	{
-		std::vector<particle>::iterator it;
-		for (it = mParticles->begin(); it != mParticles->end(); it++)
+		if (!haveCamera)
 		{
-			particle* p = &(*it);
-			if (!p->isVisible())
-				continue;
-
-			camera* haveCamera = root::getSingleton().getRenderer()->getCamera();
-			if (!haveCamera)
-			{
-				rs->setMatrixMode(MATRIXMODE_MODELVIEW);
-				rs->identityMatrix();
-			}
-			else
-			{
-				haveCamera->copyView();
-			}
-
-			p->updatePhysics(mTimer.getMilliSeconds());
-			p->draw(mSprite);
+			rs->setMatrixMode(MATRIXMODE_MODELVIEW);
+			rs->identityMatrix();
 		}
+		else
+		{
+			haveCamera->copyView();
+		}
+
+		// All particles in one draw
+		mBatch->setCamera(haveCamera);
+		mBatch->build(posX, posY, posZ, radius, mParticlesCount, origin, true);
+		mBatch->draw();
 	}
 
 	mMaterial->finish();
-	rs->setDepthMask(true); // FIXME
+	rs->setDepthMask(true);
 }
 			
 emitter::emitter(container* cont)
@@ -389,6 +550,10 @@ emitter::emitter(container* cont)
 	kAssert(cont);
 	mContainer = cont;
 	mParent = NULL;
+
+	mLifetime = 0;
+	mSpawnTime = 0;
+	mSpawnQuantity = 0;
 }
 
 emitter::~emitter()
@@ -430,11 +595,41 @@ void emitter::setMaxVelocity(const vector3& max)
 	mMaxVelocity = max;
 }
 
-void emitter::baseSpawn(particle* newP)
+void emitter::resetTimer()
+{
+	mSpawnTimer.reset();
+}
+
+void emitter::spawnParticles()
+{
+	// Spawn new particles
+	if (mSpawnTimer.getMilliSeconds() > mSpawnTime)
+	{
+		spawnBurst();
+
+		// Reset Timer
+		mSpawnTimer.reset();
+	}
+}
+
+void emitter::spawnFor(long elapsed)
 {
-	newP->setParent(this);
-	newP->setRadius(mRadius);
-	newP->setLifeTime(mLifetime);
+	// One set per step when there is no interval
+	long bursts = 1;
+	if (mSpawnTime > 0)
+		bursts = elapsed / mSpawnTime;
+
+	for (long i = 0; i < bursts; i++)
+	{
+		if (!spawnBurst())
+			break;
+	}
+}
+
+bool emitter::baseSpawn(const vector3& pos, const vector3& accel)
+{
+	return mContainer->spawnParticle(getRelativePosition() + pos, getRandomVelocity(mMaxVelocity, mMinVelocity), 
+		accel, mRadius, mLifetime);
 }
 
 pointEmitter::pointEmitter(container* cont)
@@ -446,30 +641,28 @@ pointEmitter::~pointEmitter()
 {
 }
 
-void pointEmitter::spawnParticles()
+emitter* pointEmitter::clone(container* cont) const
 {
-	// Spawn new particles
-	if (mSpawnTimer.getMilliSeconds() > mSpawnTime)
-	{
-		for (unsigned short i = 0; i < mSpawnQuantity; i++)
-		{
-			particle* newP = mContainer->spawnParticle();
-			if (!newP)
-				break;
+	kAssert(cont);
 
-			baseSpawn(newP);
-			newP->setPosition(vector3::zero);
-	
-			/**
-			 * Randomize particles velocity between minimum and max speeds
-			 */
-			newP->setVelocity(getRandomVelocity(mMaxVelocity, mMinVelocity));
-			newP->setAcceleration(mAcceleration);
-		}
+	pointEmitter* emit = new pointEmitter(*this);
+	emit->mContainer = cont;
 
-		// Reset Timer
-		mSpawnTimer.reset();
+	return emit;
+}
+
+bool pointEmitter::spawnBurst()
+{
+	for (unsigned short i = 0; i < mSpawnQuantity; i++)
+	{
+		/**
+		 * Velocity is randomized between minimum and max speeds
+		 */
+		if (!baseSpawn(vector3::zero, mAcceleration))
+			return false;
 	}
+
+	return true;
 }
 
 void pointEmitter::setAcceleration(const vector3& accel)
@@ -498,51 +691,49 @@ planeEmitter::~planeEmitter()
 {
 }
 
-void planeEmitter::spawnParticles()
+emitter* planeEmitter::clone(container* cont) const
 {
-	// Spawn new particles
-	if (mSpawnTimer.getMilliSeconds() > mSpawnTime)
-	{
-		// Spawn
-		for (unsigned short i = 0; i < mSpawnQuantity; i++)
-		{
-			particle* newP = mContainer->spawnParticle();
-			if (!newP)
-				break;
+	kAssert(cont);
 
-			/**
-			 * Randomize particles position between plane bounds
-			 */
-			vector3 randPos;
-			vector3 diff = mVertices[BOUND_MAX] - mVertices[BOUND_MIN];
+	planeEmitter* emit = new planeEmitter(*this);
+	emit->mContainer = cont;
 
-			int tmp = (int)(diff.x);
-			if (tmp != 0)
-				randPos.x += (rand() % tmp) + mVertices[BOUND_MIN].x;
-			else
-				randPos.x += mVertices[BOUND_MIN].x;
-	
-			tmp = (int)(diff.y);
-			if (tmp != 0)
-				randPos.y += (rand() % tmp) + mVertices[BOUND_MIN].y;
-			else
-				randPos.y += mVertices[BOUND_MIN].y;
+	return emit;
+}
 
-			tmp = (int)(diff.z);
-			if (tmp != 0)
-				randPos.z += (rand() % tmp) + mVertices[BOUND_MIN].z;
-			else
-				randPos.z += mVertices[BOUND_MIN].z;
+bool planeEmitter::spawnBurst()
+{
+	for (unsigned short i = 0; i < mSpawnQuantity; i++)
+	{
+		/**
+		 * Randomize particles position between plane bounds
+		 */
+		vector3 randPos;
+		vector3 diff = mVertices[BOUND_MAX] - mVertices[BOUND_MIN];
 
-			baseSpawn(newP);
-			newP->setPosition(randPos);
-			newP->setVelocity(getRandomVelocity(mMaxVelocity, mMinVelocity));
-			newP->setAcceleration(mAcceleration);
-		}
+		int tmp = (int)(diff.x);
+		if (tmp != 0)
+			randPos.x += (rand() % tmp) + mVertices[BOUND_MIN].x;
+		else
+			randPos.x += mVertices[BOUND_MIN].x;
 
-		// Reset Timer
-		mSpawnTimer.reset();
+		tmp = (int)(diff.y);
+		if (tmp != 0)
+			randPos.y += (rand() % tmp) + mVertices[BOUND_MIN].y;
+		else
+			randPos.y += mVertices[BOUND_MIN].y;
+
+		tmp = (int)(diff.z);
+		if (tmp != 0)
+			randPos.z += (rand() % tmp) + mVertices[BOUND_MIN].z;
+		else
+			randPos.z += mVertices[BOUND_MIN].z;
+
+		if (!baseSpawn(randPos, mAcceleration))
+			return false;
 	}
+
+	return true;
 }
 
 /**
@@ -608,108 +799,259 @@ void affector::resetTimer()
 	mTimer.reset();
 }
 
-void linearAffector::interact(particle* p)
-{
-	vector3 mActualFactor = mFactor * (mTimer.getMilliSeconds() / 1000.0f);
+/**
+ * Apply an operation with a factor on a particle attribute array.
+ */
+static inline void applyOperation(vec_t* attribute, unsigned int op, vec_t factor, unsigned int count)
+{
+	switch (op)
+	{
+		case AFF_SUM:
+			addArray(attribute, factor, count);
+			break;
+		case AFF_SUB:
+			addArray(attribute, -factor, count);
+			break;
+		case AFF_MUL:
+			mulArray(attribute, factor, count);
+			break;
+		case AFF_DIV:
+			mulArray(attribute, 1.0f / factor, count);
+			break;
+	}
+}
+
+void applyAffectorOp(container* cont, const affectorOp_t& op, vec_t time)
+{
+	kAssert(cont);
+	applyAffectorOp(cont, op, time, 0, cont->getParticlesCount());
+}
+
+void applyAffectorOp(container* cont, const affectorOp_t& op, vec_t time, 
+	unsigned int first, unsigned int count)
+{
+	kAssert(cont);
+	kAssert(op.attribute + op.components <= MAX_PARTICLE_ATTRIBUTES);
+	kAssert(first + count <= cont->getParticlesCount());
+
+	for (unsigned int i = 0; i < op.components; i++)
+		applyOperation(cont->getAttribute(op.attribute + i) + first, op.operation, op.factor[i] * time, count);
+}
+
+bool linearAffector::compile(affectorOp_t& op) const
+{
+	op.operation = mAffectedOperation;
+
+	// Vector sums and subtractions, scalar products and divisions
+	const bool perAxis = (mAffectedOperation == AFF_SUM || mAffectedOperation == AFF_SUB);
+	for (unsigned int i = 0; i < 3; i++)
+		op.factor[i] = perAxis ? mFactor.vec[i] : mFactor.x;
+
+	switch (mAffectedParameter)
+	{
+		case AFF_POS:
+			op.attribute = PARTICLE_POS_X;
+			op.components = 3;
+			break;
+		case AFF_VELOCITY:
+			op.attribute = PARTICLE_VEL_X;
+			op.components = 3;
+			break;
+		case AFF_ACCELERATION:
+			op.attribute = PARTICLE_ACCEL_X;
+			op.components = 3;
+			break;
+		case AFF_RADIUS:
+			op.attribute = PARTICLE_RADIUS;
+			op.components = 1;
+			break;
+		case AFF_LIFETIME:
+			op.attribute = PARTICLE_LIFETIME;
+			op.components = 1;
+
+			// Factors are in milliseconds
+			if (perAxis)
+				op.factor[0] /= 1000.0f;
+			break;
+		default:
+			return false;
+	}
+
+	return true;
+}
+
+void linearAffector::interact(container* cont)
+{
+	affectorOp_t op;
+	if (compile(op))
+		applyAffectorOp(cont, op, mTimer.getMilliSeconds() / 1000.0f);
+}
+
+system::system()
+{
+	mParent = NULL;
+	mIsVisible = true;
+	mAffectorsCompiled = false;
+	mIntegrateCount = 0;
+	mSleeping = false;
+
+	mTemplate = NULL;
+	mDuration = 0;
+
+	mCollision = PARTICLE_COLLISION_NONE;
+	mRestitution = 0.5f;
+	mCollisionFlags = 0;
+
+	mCollisionSegments = NULL;
+	mCollisionFractions = NULL;
+	mCollisionCapacity = 0;
+}
+
+system::~system()
+{
+	if (mCollisionSegments)
+		delete [] mCollisionSegments;
+
+	if (mCollisionFractions)
+		delete [] mCollisionFractions;
+
+	// Instances own copies of the template emitters
+	if (mTemplate)
+	{
+		std::map<std::string, emitter*>::const_iterator emIt;
+		for (emIt = mEmitters.begin(); emIt != mEmitters.end(); emIt++)
+			delete emIt->second;
+	}
+}
+
+void system::setTemplate(const system* tmpl)
+{
+	kAssert(tmpl);
+	kAssert(!mTemplate && mEmitters.empty());
+
+	mTemplate = tmpl;
+
+	if (!mAttributes[0])
+		setNumParticles(tmpl->getQuota());
+
+	mMaterial = tmpl->mMaterial;
+	mParticleMass = tmpl->mParticleMass;
+	mSortParticles = tmpl->mSortParticles;
+	mBounds = tmpl->mBounds;
+
+	mCollision = tmpl->mCollision;
+	mRestitution = tmpl->mRestitution;
+	mCollisionFlags = tmpl->mCollisionFlags;
+
+	std::map<std::string, emitter*>::const_iterator emIt;
+	for (emIt = tmpl->mEmitters.begin(); emIt != tmpl->mEmitters.end(); emIt++)
+		pushEmitter(emIt->first, emIt->second->clone(this));
+
+	// Affectors are only read (or compiled) by systems
+	mAffectors = tmpl->mAffectors;
+	mAffectorsCompiled = false;
+}
+
+void system::reset()
+{
+	mParticlesCount = 0;
+	mSorted = false;
+
+	mTimer.reset();
+	mLastUpdate = 0;
+	mStepTime = 0;
+	mSleeping = false;
+
+	std::map<std::string, emitter*>::const_iterator emIt;
+	for (emIt = mEmitters.begin(); emIt != mEmitters.end(); emIt++)
+		emIt->second->resetTimer();
+}
+
+void system::setCollision(unsigned int mode, vec_t restitution, int flags)
+{
+	mCollision = mode;
+	mRestitution = restitution;
+	mCollisionFlags = flags;
+}
+
+void system::collide(unsigned int first, unsigned int count)
+{
+	world* activeWorld = root::getSingleton().getRenderer()->getWorld();
+	if (!activeWorld || !count)
+		return;
+
+	vector3* starts = mCollisionSegments;
+	vector3* ends = starts + mCollisionCapacity;
+	vector3* normals = ends + mCollisionCapacity;
+	vec_t* fractions = mCollisionFractions;
+
+	vec_t* pos[3] = {mAttributes[PARTICLE_POS_X], mAttributes[PARTICLE_POS_Y], mAttributes[PARTICLE_POS_Z]};
+	vec_t* vel[3] = {mAttributes[PARTICLE_VEL_X], mAttributes[PARTICLE_VEL_Y], mAttributes[PARTICLE_VEL_Z]};
+
+	// Positions were integrated with the new velocities
+	const vector3 origin = getParticlesOrigin();
+	for (unsigned int i = first; i < first + count; i++)
+	{
+		const vector3 p(pos[0][i], pos[1][i], pos[2][i]);
+		const vector3 v(vel[0][i], vel[1][i], vel[2][i]);
+
+		ends[i] = origin + p;
+		starts[i] = ends[i] - v * mStepTime;
+	}
+
+	activeWorld->traceSegments(starts + first, ends + first, count, mCollisionFlags, 
+		fractions + first, normals + first);
+
+	for (unsigned int i = first; i < first + count; i++)
+	{
+		if (fractions[i] >= 1.0f)
+			continue;
+
+		// Dies on the next expire
+		if (mCollision == PARTICLE_COLLISION_KILL)
+		{
+			mAttributes[PARTICLE_AGE][i] = mAttributes[PARTICLE_LIFETIME][i];
+			continue;
+		}
+
+		const vector3 hit = starts[i] + (ends[i] - starts[i]) * fractions[i] - origin;
+		const vector3& normal = normals[i];
+
+		vector3 v(vel[0][i], vel[1][i], vel[2][i]);
+		const vec_t along = v.dotProduct(normal);
+		if (along < 0)
+			v -= normal * ((1.0f + mRestitution) * along);
 
-	switch (mAffectedParameter)
-	{
-		case AFF_POS:
-			switch (mAffectedOperation)
-			{
-				case AFF_SUM:
-					p->setPosition(p->getRelativePosition() + mActualFactor);
-					break;
-				case AFF_SUB:
-					p->setPosition(p->getRelativePosition() - mActualFactor);
-					break;
-				case AFF_MUL:
-					p->setPosition(p->getRelativePosition() * mActualFactor.x);
-					break;
-				case AFF_DIV:
-					p->setPosition(p->getRelativePosition() / mActualFactor.x);
-					break;
-			}
-			break;
-		case AFF_ACCELERATION:
-			switch (mAffectedOperation)
-			{
-				case AFF_SUM:
-					p->setAcceleration(p->getAcceleration() + mActualFactor);
-					break;
-				case AFF_SUB:
-					p->setAcceleration(p->getAcceleration() - mActualFactor);
-					break;
-				case AFF_MUL:
-					p->setAcceleration(p->getAcceleration() * mActualFactor.x);
-					break;
-				case AFF_DIV:
-					p->setAcceleration(p->getAcceleration() / mActualFactor.x);
-					break;
-			}
-			break;
-		case AFF_VELOCITY:
-			switch (mAffectedOperation)
-			{
-				case AFF_SUM:
-					p->setVelocity(p->getVelocity() + mActualFactor);
-					break;
-				case AFF_SUB:
-					p->setVelocity(p->getVelocity() - mActualFactor);
-					break;
-				case AFF_MUL:
-					p->setVelocity(p->getVelocity() * mActualFactor.x);
-					break;
-				case AFF_DIV:
-					p->setVelocity(p->getVelocity() / mActualFactor.x);
-					break;
-			}
-			break;
-		case AFF_RADIUS:
-			switch (mAffectedOperation)
-			{
-				case AFF_SUM:
-					p->setRadius(p->getRadius() + mActualFactor.x);
-					break;
-				case AFF_SUB:
-					p->setRadius(p->getRadius() - mActualFactor.x);
-					break;
-				case AFF_MUL:
-					p->setRadius(p->getRadius() * mActualFactor.x);
-					break;
-				case AFF_DIV:
-					p->setRadius(p->getRadius() / mActualFactor.x);
-					break;
-			}
-			break;
-		case AFF_LIFETIME:
-			switch (mAffectedOperation)
-			{
-				case AFF_SUM:
-					p->setLifeTime(p->getLifeTime() + mActualFactor.x);
-					break;
-				case AFF_SUB:
-					p->setLifeTime(p->getLifeTime() - mActualFactor.x);
-					break;
-				case AFF_MUL:
-					p->setLifeTime(p->getLifeTime() * mActualFactor.x);
-					break;
-				case AFF_DIV:
-					p->setLifeTime(p->getLifeTime() / mActualFactor.x);
-					break;
-			}
-			break;
+		for (unsigned int a = 0; a < 3; a++)
+		{
+			pos[a][i] = hit.vec[a];
+			vel[a][i] = v.vec[a];
+		}
 	}
 }
 
-system::system()
+bool system::isFinished()
 {
-	mParent = NULL;
-	mIsVisible = true;
+	if (mDuration <= 0)
+		return false;
+
+	const long elapsed = mTimer.getMilliSeconds();
+	if (elapsed <= mDuration)
+		return false;
+
+	// Sleeping systems arent expiring particles
+	return (!mSleeping && !mParticlesCount) || (elapsed > mDuration + (long) getMaxLifeTime());
 }
 
-system::~system()
+unsigned int system::getMaxLifeTime() const
 {
+	unsigned int maxLifeTime = 0;
+
+	std::map<std::string, emitter*>::const_iterator emIt;
+	for (emIt = mEmitters.begin(); emIt != mEmitters.end(); emIt++)
+		maxLifeTime = std::max(maxLifeTime, emIt->second->getLifeTime());
+
+	return maxLifeTime;
 }
 			
 const bool system::getVisible() const
@@ -773,38 +1115,197 @@ void system::pushAffector(const std::string& name, affector* aff)
 	kAssert(aff);
 	mAffectors[name] = aff;
 	aff->setParent(this);	
+
+	mAffectorsCompiled = false;
 }
-			
-void system::cycle()
+
+void system::compileAffectors()
+{
+	mAffectorOps.clear();
+	mInteractAffectors.clear();
+
+	std::map<std::string, affector*>::const_iterator affIt;
+	for (affIt = mAffectors.begin(); affIt != mAffectors.end(); affIt++)
+	{
+		affectorOp_t op;
+		if (affIt->second->compile(op))
+			mAffectorOps.push_back(op);
+		else
+			mInteractAffectors.push_back(affIt->second);
+	}
+
+	mAffectorsCompiled = true;
+}
+
+void system::beginSimulation(vec_t dt)
+{
+	mStepTime = dt;
+	expire();
+
+	// Spawn Particles, systems with a duration stop emitting
+	mIntegrateCount = mParticlesCount;
+
+	if (mDuration <= 0 || mLastUpdate <= mDuration)
+	{
+		std::map<std::string, emitter*>::const_iterator emIt;
+		for (emIt = mEmitters.begin(); emIt != mEmitters.end(); emIt++)
+		{
+			emIt->second->spawnParticles();
+		}
+	}
+
+	if (!mAffectorsCompiled)
+		compileAffectors();
+
+	// Collision buffers are shared by all ranges of the step
+	if (mCollision != PARTICLE_COLLISION_NONE && mCollisionCapacity != mCapacity)
+	{
+		if (mCollisionSegments)
+			delete [] mCollisionSegments;
+
+		if (mCollisionFractions)
+			delete [] mCollisionFractions;
+
+		mCollisionSegments = NULL;
+		mCollisionFractions = NULL;
+		mCollisionCapacity = 0;
+
+		try
+		{
+			mCollisionSegments = new vector3[mCapacity * 3];
+			mCollisionFractions = new vec_t[mCapacity];
+			mCollisionCapacity = mCapacity;
+		}
+
+		catch (...)
+		{
+			S_LOG_INFO("Failed to allocate particle collision buffers.");
+			mCollision = PARTICLE_COLLISION_NONE;
+		}
+	}
+}
+
+void system::simulateRange(unsigned int first, unsigned int count)
 {
-	if (!mParticles)
+	kAssert(first + count <= mParticlesCount);
+
+	// Nothing to do (and affector products would zero everything)
+	if (mStepTime <= 0)
 		return;
-	
-	// Container update
-	update();
-	
-	// Spawn Particles
-	std::map<std::string, emitter*>::const_iterator emIt;
-	for (emIt = mEmitters.begin(); emIt != mEmitters.end(); emIt++)
+
+	// Particles spawned on this step start where they were spawned
+	if (first < mIntegrateCount)
 	{
-		emIt->second->spawnParticles();
+		const unsigned int toIntegrate = mIntegrateCount - first;
+		const unsigned int integrated = count < toIntegrate ? count : toIntegrate;
+		integrate(mStepTime, first, integrated);
+
+		if (mCollision != PARTICLE_COLLISION_NONE)
+			collide(first, integrated);
 	}
 
-	std::map<std::string, affector*>::const_iterator affIt;
-	std::vector<particle>::iterator pIt;
+	// Compiled operations are whole array passes over the range
+	for (unsigned int i = 0; i < mAffectorOps.size(); i++)
+		applyAffectorOp(this, mAffectorOps[i], mStepTime, first, count);
+}
+
+void system::catchUp(vec_t elapsed)
+{
+	mSleeping = false;
+
+	// Particles older than the longest lifetime would be dead already
+	const vec_t window = std::min(elapsed, getMaxLifeTime() / 1000.0f);
+	if (window <= 0)
+		return;
 
-	for (pIt = mParticles->begin(); pIt != mParticles->end(); pIt++)
+	// Time the system started sleeping
+	const vec_t start = mLastUpdate / 1000.0f - elapsed;
+
+	if (!mAffectorsCompiled)
+		compileAffectors();
+
+	const vec_t step = window / PARTICLE_CATCHUP_STEPS;
+	for (unsigned int s = 0; s < PARTICLE_CATCHUP_STEPS; s++)
 	{
-		if (!pIt->isVisible())
-			continue;
+		mStepTime = step;
+		expire();
+
+		mIntegrateCount = mParticlesCount;
+
+		// Systems with a duration stop emitting
+		const vec_t stepTime = start + (elapsed - window) + step * s;
+		if (mDuration <= 0 || stepTime * 1000.0f <= mDuration)
+		{
+			std::map<std::string, emitter*>::const_iterator emIt;
+			for (emIt = mEmitters.begin(); emIt != mEmitters.end(); emIt++)
+				emIt->second->spawnFor((long) (step * 1000.0f));
+		}
+
+		simulateRange(0, mParticlesCount);
+	}
+}
+
+void system::simulateChunkJob(void* data)
+{
+	particleChunk_t* chunk = (particleChunk_t*) data;
+	kAssert(chunk);
+
+	chunk->owner->simulateRange(chunk->first, chunk->count);
+}
+
+void system::simulate(bool parallel)
+{
+	if (!mAttributes[0])
+		return;
 
-		for (affIt = mAffectors.begin(); affIt != mAffectors.end(); affIt++)
-			affIt->second->interact(&(*pIt));
+	vec_t dt = advanceTime();
+	if (mSleeping)
+	{
+		catchUp(dt);
+		dt = 0;
 	}
 
-	// Reset Affectors Time
-	for (affIt = mAffectors.begin(); affIt != mAffectors.end(); affIt++)
-		affIt->second->resetTimer();
+	beginSimulation(dt);
+
+	// Affectors that werent compiled need the whole container
+	if (parallel && mInteractAffectors.empty() && mParticlesCount > PARTICLE_CHUNK_SIZE)
+	{
+		mChunks.clear();
+		for (unsigned int first = 0; first < mParticlesCount; first += PARTICLE_CHUNK_SIZE)
+		{
+			particleChunk_t chunk;
+			chunk.owner = this;
+			chunk.first = first;
+			chunk.count = mParticlesCount - first;
+			if (chunk.count > PARTICLE_CHUNK_SIZE)
+				chunk.count = PARTICLE_CHUNK_SIZE;
+
+			mChunks.push_back(chunk);
+		}
+
+		// Chunks are only pushed after the vector is filled
+		workerPool* pool = &workerPool::getSingleton();
+		for (unsigned int i = 0; i < mChunks.size(); i++)
+			pool->pushJob(simulateChunkJob, &mChunks[i]);
+
+		return;
+	}
+
+	simulateRange(0, mParticlesCount);
+
+	for (unsigned int i = 0; i < mInteractAffectors.size(); i++)
+	{
+		mInteractAffectors[i]->interact(this);
+		mInteractAffectors[i]->resetTimer();
+	}
+}
+			
+void system::cycle()
+{
+	if (!mAttributes[0])
+		return;
+	
+	simulate();
 
 	// Draw container
 	if (mIsVisible)
@@ -841,10 +1342,87 @@ manager& manager::getSingleton()
 manager::manager()
 {
 	mSystems.clear();
+	mSimulationPending = false;
 }
 
 manager::~manager()
 {
+	for (unsigned int i = 0; i < mInstances.size(); i++)
+		delete mInstances[i];
+
+	std::map<const system*, std::vector<system*> >::iterator it;
+	for (it = mPools.begin(); it != mPools.end(); it++)
+	{
+		for (unsigned int i = 0; i < it->second.size(); i++)
+			delete it->second[i];
+	}
+}
+
+const system* manager::getTemplate(const std::string& name) const
+{
+	std::map<std::string, system*>::const_iterator it = mTemplates.find(name);
+	if (it != mTemplates.end())
+		return it->second;
+	else
+		return NULL;
+}
+
+system* manager::instantiate(const std::string& templateName, const vector3& position, long duration)
+{
+	const system* tmpl = getTemplate(templateName);
+	if (!tmpl)
+	{
+		S_LOG_INFO("Particle template " + templateName + " not found.");
+		return NULL;
+	}
+
+	system* instance = NULL;
+
+	std::vector<system*>& pool = mPools[tmpl];
+	if (pool.size())
+	{
+		instance = pool.back();
+		pool.pop_back();
+	}
+	else
+	{
+		try
+		{
+			instance = new system();
+		}
+
+		catch (...)
+		{
+			S_LOG_INFO("Failed to allocate particle system instance.");
+			return NULL;
+		}
+
+		instance->setTemplate(tmpl);
+	}
+
+	instance->setPosition(position);
+	instance->setDuration(duration);
+	instance->setVisible(true);
+	instance->reset();
+
+	mInstances.push_back(instance);
+	return instance;
+}
+
+void manager::release(system* instance)
+{
+	kAssert(instance);
+	kAssert(instance->getTemplate());
+
+	std::vector<system*>::iterator it = std::find(mInstances.begin(), mInstances.end(), instance);
+	if (it == mInstances.end())
+		return;
+
+	// Order doesnt matter
+	*it = mInstances.back();
+	mInstances.pop_back();
+
+	mPools[instance->getTemplate()].push_back(instance);
 }
 
 system* manager::getSystem(const std::string& name)
@@ -1122,14 +1700,17 @@ void manager::parseLinearAffector(parsingFile* file, system* system, const std::
 	system->pushAffector(name, aff);
 }
 				
-void manager::parseSystem(parsingFile* file, const std::string& psName)
+void manager::parseSystem(parsingFile* file, const std::string& psName, bool asTemplate)
 {
 	kAssert(file);
 	system* newSystem;
 
 	try 
 	{
-		newSystem = allocateSystem(psName);
+		if (asTemplate)
+			newSystem = new system();
+		else
+			newSystem = allocateSystem(psName);
 	}
 
 	catch (...)
@@ -1138,8 +1719,12 @@ void manager::parseSystem(parsingFile* file, const std::string& psName)
 		return;
 	}
 
+	if (!newSystem)
+		return;
+
 	std::string token = file->getNextToken(); // {
 	unsigned int openBraces = 1;
+	vec_t collisionRestitution = 0.5f;
 
 	while (openBraces)
 	{
@@ -1186,6 +1771,32 @@ void manager::parseSystem(parsingFile* file, const std::string& psName)
 			token = file->getNextToken();
 			newSystem->setMaterial(token);
 		}
+		else
+		if (token == "sort")
+		{
+			newSystem->setSorting(true);
+		}
+		else
+		if (token == "collision")
+		{
+			token = file->getNextToken();
+			if (token == "bounce")
+				newSystem->setCollision(PARTICLE_COLLISION_BOUNCE, collisionRestitution);
+			else
+			if (token == "kill")
+				newSystem->setCollision(PARTICLE_COLLISION_KILL);
+			else
+				S_LOG_INFO("Unknown particle collision " + token + ".");
+		}
+		else
+		if (token == "restitution")
+		{
+			token = file->getNextToken();
+			collisionRestitution = atof(token.c_str());
+
+			if (newSystem->getCollision() == PARTICLE_COLLISION_BOUNCE)
+				newSystem->setCollision(PARTICLE_COLLISION_BOUNCE, collisionRestitution);
+		}
 
 		token = file->getNextToken();
 
@@ -1198,7 +1809,20 @@ void manager::parseSystem(parsingFile* file, const std::string& psName)
 	}
 
 	newSystem->_calculateAABB();
-	S_LOG_INFO("Particle System " + psName + " created.");
+	newSystem->compileAffectors();
+
+	// Templates only keep the definition
+	if (asTemplate)
+	{
+		newSystem->freeParticles();
+		S_LOG_INFO("Particle Template " + psName + " created.");
+	}
+	else
+	{
+		S_LOG_INFO("Particle System " + psName + " created.");
+	}
+
+	mTemplates[psName] = newSystem;
 }
 
 void manager::parseScript(const std::string& filename)
@@ -1228,6 +1852,13 @@ void manager::parseScript(parsingFile* file)
 			token = file->getNextToken();
 			parseSystem(file, token);
 		}
+		else
+		if (token == "particleTemplate")
+		{
+			// Template name
+			token = file->getNextToken();
+			parseSystem(file, token, true);
+		}
 
 		// if (token == "particleSystem")
 		
@@ -1237,17 +1868,115 @@ void manager::parseScript(parsingFile* file)
 	// while (!file->eof())
 }
 			
-void manager::drawParticles()
+void manager::simulateSystemJob(void* data)
+{
+	system* sys = (system*) data;
+	kAssert(sys);
+
+	sys->simulate(true);
+}
+
+void manager::_scheduleSystem(system* sys, camera* cam, world* activeWorld)
+{
+	kAssert(sys);
+
+	// Systems out of view sleep until they are seen again
+	if (cam)
+	{
+		const boundingBox bounds = sys->getWorldBounds();
+		if (!cam->isBoxInsideFrustum(bounds) ||
+			(activeWorld && !activeWorld->isBoxVisible(bounds.getMins(), bounds.getMaxs(), cam)))
+		{
+			sys->sleep();
+			return;
+		}
+	}
+
+	mSimulatedSystems.push_back(sys);
+}
+
+void manager::_releaseFinished()
+{
+	unsigned int i = 0;
+	while (i < mInstances.size())
+	{
+		system* instance = mInstances[i];
+		if (instance->isFinished())
+			release(instance);
+		else
+			i++;
+	}
+}
+
+void manager::simulateParticles()
 {
 	camera* haveCamera = root::getSingleton().getRenderer()->getCamera();
+	world* activeWorld = root::getSingleton().getRenderer()->getWorld();
+
+	_releaseFinished();
+	mSimulatedSystems.clear();
 
 	std::map<std::string, system*>::const_iterator pIt;
 	for (pIt = mSystems.begin(); pIt != mSystems.end(); pIt++)
+		_scheduleSystem(pIt->second, haveCamera, activeWorld);
+
+	for (unsigned int i = 0; i < mInstances.size(); i++)
+		_scheduleSystem(mInstances[i], haveCamera, activeWorld);
+
+	// Systems dont share anything, each one is a job
+	workerPool* pool = &workerPool::getSingleton();
+	for (unsigned int i = 0; i < mSimulatedSystems.size(); i++)
+		pool->pushJob(simulateSystemJob, mSimulatedSystems[i]);
+
+	mSimulationPending = true;
+}
+
+void manager::sortSystemJob(void* data)
+{
+	system* sys = (system*) data;
+	kAssert(sys);
+
+	manager* self = &manager::getSingleton();
+	sys->sortParticles(self->mSortEye, self->mSortDirection);
+}
+
+void manager::drawParticles()
+{
+	if (!mSimulationPending)
+		simulateParticles();
+
+	// Particles must be finished before drawing
+	workerPool* pool = &workerPool::getSingleton();
+	pool->wait();
+	mSimulationPending = false;
+
+	// Sort systems that asked for it, big ones on the worker pool
+	camera* haveCamera = root::getSingleton().getRenderer()->getCamera();
+	if (haveCamera)
 	{
-		if (!haveCamera->isBoxInsideFrustum(pIt->second->getAABoundingBox()))
-			continue;
+		mSortEye = haveCamera->getPosition();
+		mSortDirection = haveCamera->getDirection();
+
+		for (unsigned int i = 0; i < mSimulatedSystems.size(); i++)
+		{
+			system* sys = mSimulatedSystems[i];
+			if (!sys->getVisible() || !sys->getSorting())
+				continue;
+
+			if (sys->getParticlesCount() > PARTICLE_CHUNK_SIZE)
+				pool->pushJob(sortSystemJob, sys);
+			else
+				sys->sortParticles(mSortEye, mSortDirection);
+		}
+
+		pool->wait();
+	}
 
-		pIt->second->cycle();
+	for (unsigned int i = 0; i < mSimulatedSystems.size(); i++)
+	{
+		system* sys = mSimulatedSystems[i];
+		if (sys->getVisible())
+			sys->draw();
 	}
 }
 
@@ -32,6 +32,9 @@ glRenderSystem::glRenderSystem()
 {
 	mActiveMaterial = NULL;
 	mLastLightIndex = 0;
+
+	mStateKnown = false;
+	mActiveUnit = -1;
 }
 
 glRenderSystem::~glRenderSystem()
@@ -59,6 +62,7 @@ void glRenderSystem::setWireFrame(bool wire)
 			
 void glRenderSystem::setTexEnv(texEnvMode mode, int stage)
 {
+	kAssert(stage >= 0 && stage < MAX_TEXCOORD);
 	GLuint mod = GL_REPLACE;
 
 	switch (mode)
@@ -79,25 +83,30 @@ void glRenderSystem::setTexEnv(texEnvMode mode, int stage)
 			break;
 	}
 
+	_setActiveUnit(stage);
+	if (mStateKnown && mTexEnv[stage] == mod)
+		return;
+
+	mTexEnv[stage] = mod;
 	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, mod);
 }
 			
 void glRenderSystem::setTexEnv(const std::string& baseEnv, int stage) 
 {
-	GLuint mod = GL_REPLACE;
+	texEnvMode mode = TEX_ENV_REPLACE;
 	if (baseEnv == "add")
-		mod = GL_ADD;
+		mode = TEX_ENV_ADD;
 	else
 	if (baseEnv == "modulate")
-		mod = GL_MODULATE;
+		mode = TEX_ENV_MODULATE;
 	else
 	if (baseEnv == "decal")
-		mod = GL_DECAL;
+		mode = TEX_ENV_DECAL;
 	else
 	if (baseEnv == "blend")
-		mod = GL_BLEND;
+		mode = TEX_ENV_BLEND;
 
-	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, mod);
+	setTexEnv(mode, stage);
 }
 
 void glRenderSystem::configure()
@@ -132,6 +141,9 @@ void glRenderSystem::configure()
 		glPointParameterfv(GL_POINT_DISTANCE_ATTENUATION, distanceAtt);
 	}
 
+	// Known state for materials to diff against
+	_resetState();
+
 	// Ask System Materials and Textures to be created
 	textureManager::getSingleton().createSystemTextures();
 	materialManager::getSingleton().createSystemMaterials();
@@ -187,11 +199,20 @@ void glRenderSystem::createWindow(const int w, const int h)
 
 void glRenderSystem::setBlendMode(unsigned short src, unsigned short dst)
 {
+	if (mStateKnown && mBlendSrc == src && mBlendDst == dst)
+		return;
+
+	mBlendSrc = src;
+	mBlendDst = dst;
 	glBlendFunc(src, dst);
 }
 
 void glRenderSystem::setBlend(bool state)
 {
+	if (mStateKnown && mBlend == state)
+		return;
+
+	mBlend = state;
 	if (state)
 		glEnable(GL_BLEND);
 	else
@@ -200,6 +221,10 @@ void glRenderSystem::setBlend(bool state)
 			
 void glRenderSystem::setDepthMask(bool mask)
 {
+	if (mStateKnown && mDepthMask == mask)
+		return;
+
+	mDepthMask = mask;
 	glDepthMask(mask);
 }
 
@@ -260,6 +285,10 @@ void glRenderSystem::setClearDepth(const vec_t amount)
 
 void glRenderSystem::setDepthTest(bool test)
 {
+	if (mStateKnown && mDepthTest == test)
+		return;
+
+	mDepthTest = test;
 	if (test)
 		glEnable(GL_DEPTH_TEST);
 	else
@@ -372,6 +401,10 @@ void glRenderSystem::setOrthographic(vec_t left, vec_t right, vec_t bottom, vec_
 
 void glRenderSystem::setCulling(CullMode culling)
 {
+	if (mStateKnown && mCull == culling)
+		return;
+
+	mCull = culling;
 	unsigned short cullMode = GL_BACK;
 	switch(culling)
 	{
@@ -401,6 +434,11 @@ void glRenderSystem::startVertices(VertexMode mode)
 	if (mActiveMaterial && mActiveMaterial->getNoDraw())
 		return;
 
+	// Materials leave their units bound
+	const unsigned int texUnits = mActiveMaterial ? mActiveMaterial->getStagesCount() : 0;
+	for (unsigned int i = texUnits; i < MAX_TEXCOORD; i++)
+		_enableTexture(i, false);
+
 	switch (mode)
 	{
 		case VERTEXMODE_POINTS:
@@ -477,18 +515,201 @@ void glRenderSystem::endVertices()
 
 void glRenderSystem::matAmbient(const color& col)
 {
+	if (mStateKnown && !memcmp(mAmbient.c, col.c, sizeof(col.c)))
+		return;
+
+	mAmbient = col;
 	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, col.c);
 }
 
 void glRenderSystem::matDiffuse(const color& col)
 {
+	if (mStateKnown && !memcmp(mDiffuse.c, col.c, sizeof(col.c)))
+		return;
+
+	mDiffuse = col;
 	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, col.c);
 }
 
 void glRenderSystem::matSpecular(const color& col)
 {
+	if (mStateKnown && !memcmp(mSpecular.c, col.c, sizeof(col.c)))
+		return;
+
+	mSpecular = col;
 	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, col.c);
 }
+
+void glRenderSystem::applyMaterialState(const materialState_t& state)
+{
+	matAmbient(state.ambient);
+	matDiffuse(state.diffuse);
+	matSpecular(state.specular);
+
+	setCulling(state.cull);
+	setDepthTest(state.depthTest);
+	setDepthMask(state.depthWrite);
+
+	setBlend(state.blend);
+	if (state.blend)
+		setBlendMode(state.blendSrc, state.blendDst);
+
+	// Replace needs to modulate lit fragments
+	int lightOn = -1;
+
+	for (unsigned int i = 0; i < state.stagesCount; i++)
+	{
+		texEnvMode mode;
+		switch (state.stages[i].texEnv)
+		{
+			default:
+			case TEXENV_REPLACE:
+				if (lightOn < 0)
+					lightOn = isLightOn() ? 1 : 0;
+
+				mode = lightOn ? TEX_ENV_MODULATE : TEX_ENV_REPLACE;
+				break;
+
+			case TEXENV_MODULATE:
+				mode = TEX_ENV_MODULATE;
+				break;
+
+			case TEXENV_BLEND:
+				mode = TEX_ENV_BLEND;
+				break;
+
+			case TEXENV_DECAL:
+				mode = TEX_ENV_DECAL;
+				break;
+
+			case TEXENV_ADD:
+				mode = TEX_ENV_ADD;
+				break;
+		}
+
+		setTexEnv(mode, i);
+	}
+
+	// Units past the material may still hold texgen or matrices
+	for (unsigned int i = 0; i < MAX_TEXCOORD; i++)
+	{
+		const bool used = i < state.stagesCount;
+		_setSphereMap(i, used && state.stages[i].coordType == TEXCOORD_SPHERE);
+
+		// Stage loads its matrix on draw
+		if (mTextureMatrix[i] && !(used && state.stages[i].textureMatrix))
+			_resetTextureMatrix(i);
+	}
+}
+
+void glRenderSystem::_setActiveUnit(int unit)
+{
+	if (mStateKnown && mActiveUnit == unit)
+		return;
+
+	mActiveUnit = unit;
+	glClientActiveTextureARB(GL_TEXTURE0_ARB + unit);
+	glActiveTextureARB(GL_TEXTURE0_ARB + unit);
+}
+
+void glRenderSystem::_enableTexture(int unit, bool enabled)
+{
+	if (mStateKnown && mTextureEnabled[unit] == enabled)
+		return;
+
+	_setActiveUnit(unit);
+	mTextureEnabled[unit] = enabled;
+	if (enabled)
+		glEnable(GL_TEXTURE_2D);
+	else
+		glDisable(GL_TEXTURE_2D);
+}
+
+void glRenderSystem::_setSphereMap(int unit, bool enabled)
+{
+	if (mStateKnown && mSphereMap[unit] == enabled)
+		return;
+
+	_setActiveUnit(unit);
+	mSphereMap[unit] = enabled;
+
+	if (enabled)
+	{
+		glTexGeni(GL_S, GL_TEXTURE_GEN_MODE, GL_SPHERE_MAP);
+		glTexGeni(GL_T, GL_TEXTURE_GEN_MODE, GL_SPHERE_MAP);
+		glTexGeni(GL_R, GL_TEXTURE_GEN_MODE, GL_SPHERE_MAP);
+		glEnable(GL_TEXTURE_GEN_S);
+		glEnable(GL_TEXTURE_GEN_T);
+		glEnable(GL_TEXTURE_GEN_R);
+	}
+	else
+	{
+		glDisable(GL_TEXTURE_GEN_S);
+		glDisable(GL_TEXTURE_GEN_T);
+		glDisable(GL_TEXTURE_GEN_R);
+	}
+}
+
+void glRenderSystem::setTextureMatrix(const matrix4& mat, int stage)
+{
+	kAssert(stage >= 0 && stage < MAX_TEXCOORD);
+
+	mTextureMatrix[stage] = true;
+	if (mStateKnown && !memcmp(mTextureMatrices[stage].m, mat.m, sizeof(mat.m)))
+		return;
+
+	_setActiveUnit(stage);
+	mTextureMatrices[stage] = mat;
+
+	glPushAttrib(GL_TRANSFORM_BIT);
+	glMatrixMode(GL_TEXTURE);
+	glLoadMatrixf(mat.m[0]);
+	glPopAttrib();
+}
+
+void glRenderSystem::_resetTextureMatrix(int unit)
+{
+	_setActiveUnit(unit);
+	mTextureMatrix[unit] = false;
+	mTextureMatrices[unit].setIdentity();
+
+	glPushAttrib(GL_TRANSFORM_BIT);
+	glMatrixMode(GL_TEXTURE);
+	glLoadIdentity();
+	glPopAttrib();
+}
+
+void glRenderSystem::_resetState()
+{
+	mStateKnown = false;
+
+	setCulling(CULLMODE_NONE);
+	setDepthTest(true);
+	setDepthMask(true);
+	setBlend(false);
+	setBlendMode(GL_ONE, GL_ZERO);
+
+	// GL defaults
+	matAmbient(color(0.2f, 0.2f, 0.2f));
+	matDiffuse(color(0.8f, 0.8f, 0.8f));
+	matSpecular(color(0, 0, 0));
+
+	for (int i = 0; i < MAX_TEXCOORD; i++)
+	{
+		unBindTexture(i);
+		setTexEnv(TEX_ENV_MODULATE, i);
+		_setSphereMap(i, false);
+		_resetTextureMatrix(i);
+	}
+
+	if (getProgramSupport())
+		bindProgram(NULL);
+	else
+		mBoundProgram = 0;
+
+	_setActiveUnit(0);
+	mStateKnown = true;
+}
 			
 void glRenderSystem::genTexture(uint32_t w, uint32_t h, uint32_t bpp, platformTexturePointer* tex)
 {
@@ -509,19 +730,15 @@ void glRenderSystem::bindTexture(GLuint* tex, int chan)
 {
 	kAssert(tex);
 
-	glClientActiveTextureARB(GL_TEXTURE0_ARB + chan);
-	glActiveTextureARB(GL_TEXTURE0_ARB + chan);
-
-	glEnable(GL_TEXTURE_2D);
+	_setActiveUnit(chan);
+	_enableTexture(chan, true);
 	glBindTexture(GL_TEXTURE_2D, tex[0]);
 }
 			
 void glRenderSystem::unBindTexture(int chan)
 {
-	glClientActiveTextureARB(GL_TEXTURE0_ARB + chan);
-	glActiveTextureARB(GL_TEXTURE0_ARB + chan);
-
-	glDisable(GL_TEXTURE_2D);
+	_setActiveUnit(chan);
+	_enableTexture(chan, false);
 	glBindTexture(GL_TEXTURE_2D, 0);
 }
 
@@ -548,32 +765,30 @@ void glRenderSystem::drawArrays(bool dontUseIndex)
 	}
 
 	// If we have at least coord 0, we can check for textures
-	if (mTexCoordArray[0])
+	if (mTexCoordArray[0] || (mUsingVBO && mTexCoordOffset[0] != -1))
 	{
 		unsigned int texUnits = mActiveMaterial->getStagesCount();
 		for (unsigned int i = texUnits; i < MAX_TEXCOORD; i++)
 		{
 			// In case we specified an array
-			if (mTexCoordArray[i])
+			if (mTexCoordArray[i] || (mUsingVBO && mTexCoordOffset[i] != -1))
 			{
 				texUnits = i + 1;
 				continue;
 			}
 
-			glClientActiveTextureARB(GL_TEXTURE0_ARB + i);
-			glActiveTextureARB(GL_TEXTURE0_ARB + i);
+			_setActiveUnit(i);
+			_enableTexture(i, false);
 			glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-			glDisable(GL_TEXTURE_2D);
 		}
 			
 		if (texUnits)
 		{
 			for (unsigned int i = 0; i < texUnits; i++)
 			{
-				glClientActiveTextureARB(GL_TEXTURE0_ARB + i);
-				glActiveTextureARB(GL_TEXTURE0_ARB + i);
+				_setActiveUnit(i);
+				_enableTexture(i, true);
 				glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-				glEnable(GL_TEXTURE_2D);
 					
 				int found = 0;
 				for (found = i; found > 0; found--)
@@ -639,6 +854,19 @@ void glRenderSystem::drawArrays(bool dontUseIndex)
 
 	glDisableClientState(GL_VERTEX_ARRAY);
 	glDisableClientState(GL_NORMAL_ARRAY);
+
+	// Dont leave VBO offsets behind for client arrays
+	if (mUsingVBO)
+	{
+		for (unsigned int i = 0; i < MAX_TEXCOORD; i++)
+		{
+			glClientActiveTextureARB(GL_TEXTURE0_ARB + i);
+			glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+		}
+
+		glClientActiveTextureARB(GL_TEXTURE0_ARB);
+		mActiveUnit = -1;
+	}
 }
 			
 void glRenderSystem::copyToTexture(platformTexturePointer* tex)
@@ -661,45 +889,19 @@ void glRenderSystem::screenshot(const char* filename)
 		return;
 	}
 
-	char* imgData;
-	try
-	{
-		imgData = new char[mScreenSize[0] * mScreenSize[1] * 3];
-	}
-
-	catch (...)
-	{
-		S_LOG_INFO("Failed to allocate memory for screenshot.");
-		FreeImage_Unload(newImage);
+	// Both GL and FreeImage keep rows bottom up and 4 byte aligned, so
+	// the pixels are read straight into the bitmap in its own order
+	#if FREEIMAGE_COLORORDER == FREEIMAGE_COLORORDER_RGB
+	const GLenum pixelFormat = GL_RGB;
+	#else
+	const GLenum pixelFormat = GL_BGR;
+	#endif
 
-		return;
-	}
-
-	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_UNSIGNED_BYTE, imgData);
-
-	// Width * BPP
-	uint32_t pitch = mScreenSize[0] * 3;
-
-	// Write data
-	for (uint32_t y = 0; y < mScreenSize[1]; y++)
-	{
-		uint32_t Ypitch = y * pitch;
-		for (uint32_t x = 0; x < mScreenSize[0]; x++)
-		{
-			uint32_t tripleX = x * 3;
-
-			RGBQUAD color;
-			color.rgbRed = imgData[Ypitch + tripleX];
-			color.rgbGreen = imgData[Ypitch + tripleX + 1];
-			color.rgbBlue = imgData[Ypitch + tripleX + 2];
-
-			FreeImage_SetPixelColor(newImage, x, y, &color);
-		}
-	}
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glGetTexImage(GL_TEXTURE_2D, 0, pixelFormat, GL_UNSIGNED_BYTE, FreeImage_GetBits(newImage));
 
 	FreeImage_Save(FIF_JPEG, newImage, filename, JPEG_QUALITYSUPERB);
 	FreeImage_Unload(newImage);
-	delete [] imgData;
 }
 			
 bool glRenderSystem::isLightOn()
@@ -931,6 +1133,157 @@ void glRenderSystem::delVBO(platformVBO* target)
 	glDeleteBuffers(1, target);
 }
 
+bool glRenderSystem::getProgramSupport()
+{
+	return GLEW_VERSION_2_0;
+}
+
+unsigned int glRenderSystem::getProgramMaxUniforms()
+{
+	if (!getProgramSupport())
+		return 0;
+
+	GLint components = 0;
+	glGetIntegerv(GL_MAX_VERTEX_UNIFORM_COMPONENTS, &components);
+
+	return components / 4;
+}
+
+static GLuint compileShader(GLenum type, const char* source)
+{
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+
+	GLint status = GL_FALSE;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (status != GL_TRUE)
+	{
+		char infoLog[1024];
+		glGetShaderInfoLog(shader, sizeof(infoLog), NULL, infoLog);
+		S_LOG_INFO("Failed to compile shader: " + std::string(infoLog));
+
+		glDeleteShader(shader);
+		return 0;
+	}
+
+	return shader;
+}
+
+bool glRenderSystem::genProgram(platformProgram* target, const char* vertex, const char* fragment)
+{
+	kAssert(target);
+	kAssert(vertex);
+
+	*target = 0;
+	if (!getProgramSupport())
+		return false;
+
+	GLuint vertexShader = compileShader(GL_VERTEX_SHADER, vertex);
+	if (!vertexShader)
+		return false;
+
+	GLuint fragmentShader = 0;
+	if (fragment)
+	{
+		fragmentShader = compileShader(GL_FRAGMENT_SHADER, fragment);
+		if (!fragmentShader)
+		{
+			glDeleteShader(vertexShader);
+			return false;
+		}
+	}
+
+	GLuint program = glCreateProgram();
+	glAttachShader(program, vertexShader);
+	if (fragmentShader)
+		glAttachShader(program, fragmentShader);
+
+	glLinkProgram(program);
+
+	// Shaders are released with the program
+	glDeleteShader(vertexShader);
+	if (fragmentShader)
+		glDeleteShader(fragmentShader);
+
+	GLint status = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status != GL_TRUE)
+	{
+		char infoLog[1024];
+		glGetProgramInfoLog(program, sizeof(infoLog), NULL, infoLog);
+		S_LOG_INFO("Failed to link program: " + std::string(infoLog));
+
+		glDeleteProgram(program);
+		return false;
+	}
+
+	*target = program;
+	return true;
+}
+
+void glRenderSystem::bindProgram(platformProgram* target)
+{
+	const GLuint program = target ? *target : 0;
+	if (mStateKnown && mBoundProgram == program)
+		return;
+
+	mBoundProgram = program;
+	glUseProgram(program);
+}
+
+void glRenderSystem::delProgram(platformProgram* target)
+{
+	kAssert(target);
+	glDeleteProgram(*target);
+}
+
+int glRenderSystem::getProgramUniform(platformProgram* target, const std::string& name)
+{
+	kAssert(target);
+	return glGetUniformLocation(*target, name.c_str());
+}
+
+int glRenderSystem::getProgramAttribute(platformProgram* target, const std::string& name)
+{
+	kAssert(target);
+	return glGetAttribLocation(*target, name.c_str());
+}
+
+void glRenderSystem::setProgramUniform(int location, int value)
+{
+	if (location < 0)
+		return;
+
+	glUniform1i(location, value);
+}
+
+void glRenderSystem::setProgramUniform(int location, const vec_t* values, unsigned int count)
+{
+	if (location < 0)
+		return;
+
+	kAssert(values);
+	glUniform4fv(location, count, values);
+}
+
+void glRenderSystem::setAttributeArray(int location, unsigned int size, unsigned int offset, unsigned int stride)
+{
+	if (location < 0)
+		return;
+
+	glEnableVertexAttribArray(location);
+	glVertexAttribPointer(location, size, GL_FLOAT, GL_FALSE, stride, (char*)NULL + offset);
+}
+
+void glRenderSystem::unsetAttributeArray(int location)
+{
+	if (location < 0)
+		return;
+
+	glDisableVertexAttribArray(location);
+}
+
 unsigned int glRenderSystem::getScreenWidth()
 {
 	return mScreenSize[0];
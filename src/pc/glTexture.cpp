@@ -23,21 +23,36 @@ THE SOFTWARE.
 #include "texture.h"
 #include "root.h"
 #include "logger.h"
+#include "resourceManager.h"
+#include "simd.h"
 	
 // FreeImage
 #include <FreeImage.h>
 
 namespace k {
+
+/**
+ * FreeImage keeps 24 and 32 bit pixels in BGR order
+ * on little endian machines, we upload BGRA.
+ */
+#if FREEIMAGE_COLORORDER == FREEIMAGE_COLORORDER_RGB
+static const bool freeImageSwap = true;
+#else
+static const bool freeImageSwap = false;
+#endif
 			
-texture::texture(const std::string& filename, int flags)
+unsigned char* texture::decodeFile(const std::string& filename, unsigned int* width, unsigned int* height)
 {
+	kAssert(width);
+	kAssert(height);
+
 	// Check if file exists
 	FILE* fileExist = fopen(filename.c_str(), "rb");
 
 	if (!fileExist)
 	{
 		S_LOG_INFO("Failed to open file " + filename + ", it doesnt exist or you dont have permissions to access it.");
-		return;
+		return NULL;
 	}
 
 	fclose(fileExist);
@@ -46,7 +61,7 @@ texture::texture(const std::string& filename, int flags)
 	if (imgFormat == FIF_UNKNOWN)
 	{
 		S_LOG_INFO("FreeImage was unable to load texture " + filename);
-		return;
+		return NULL;
 	}
 
 	int imgFlags = 0;
@@ -59,65 +74,177 @@ texture::texture(const std::string& filename, int flags)
 	if (!image)
 	{
 		S_LOG_INFO("FreeImage was unable to load texture " + filename);
-		return;
+		return NULL;
 	}
 
-	mWidth = FreeImage_GetWidth(image);
-	mHeight = FreeImage_GetHeight(image);
-	mFormat = TEX_RGBA;
-	mFlags = flags;
-
+	const unsigned int w = FreeImage_GetWidth(image);
+	const unsigned int h = FreeImage_GetHeight(image);
 	unsigned int bpp = FreeImage_GetBPP(image);
 
-	if (!mWidth || !mHeight)
+	if (!w || !h)
 	{
 		std::stringstream tempStr;
 		tempStr << "Invalid texture size (" << filename;
-		tempStr << ", " << mWidth << "x" << mHeight << ")";
+		tempStr << ", " << w << "x" << h << ")";
 
 		S_LOG_INFO(tempStr.str());
-		return;
+		FreeImage_Unload(image);
+		return NULL;
 	}
 
-	if (bpp != 32 && bpp != 24)
+	// Palettes and grayscale are expanded here, other layouts by FreeImage
+	const bool bitmap = FreeImage_GetImageType(image) == FIT_BITMAP;
+	if (!bitmap || (bpp != 32 && bpp != 24 && bpp != 8))
 	{
 		FIBITMAP* tmp = FreeImage_ConvertTo32Bits(image);
 		FreeImage_Unload(image);
 		image = tmp;
+		bpp = 32;
+
+		if (!image)
+		{
+			S_LOG_INFO("FreeImage was unable to convert texture " + filename);
+			return NULL;
+		}
 	}
 
-	mRawData = NULL;
+	unsigned char* pixels = NULL;
 	try 
 	{
-		mRawData = new unsigned char[mWidth * mHeight * 4];
+		pixels = new unsigned char[w * h * 4];
 	}
 
 	catch (...)
 	{
 		S_LOG_INFO("Could not allocate memory for texture (" + filename + ") data.");
 		FreeImage_Unload(image);
-		return;
+		return NULL;
+	}
+
+	// Palette lookup, alpha from the transparency table
+	unsigned int palette[256];
+	const bool gray = FreeImage_GetColorType(image) == FIC_MINISBLACK && !FreeImage_IsTransparent(image);
+	if (bpp == 8 && !gray)
+	{
+		const RGBQUAD* colors = FreeImage_GetPalette(image);
+		const BYTE* alpha = FreeImage_IsTransparent(image) ? FreeImage_GetTransparencyTable(image) : NULL;
+		const unsigned int colorsCount = FreeImage_GetColorsUsed(image);
+		const unsigned int alphaCount = FreeImage_GetTransparencyCount(image);
+
+		memset(palette, 0, sizeof(palette));
+		for (unsigned int i = 0; i < colorsCount && i < 256; i++)
+		{
+			unsigned char* entry = (unsigned char*) &palette[i];
+			entry[0] = colors[i].rgbBlue;
+			entry[1] = colors[i].rgbGreen;
+			entry[2] = colors[i].rgbRed;
+			entry[3] = (alpha && i < alphaCount) ? alpha[i] : 0xff;
+		}
 	}
 
-	// Copy Pixel data
-	unsigned char* copyImgData = (unsigned char*)mRawData;
-	for (int j = (mHeight - 1); j >= 0; j--)
+	// Copy scanlines, FreeImage stores them bottom up
+	for (unsigned int j = 0; j < h; j++)
 	{
-		for (unsigned int i = 0; i < mWidth; i++)
+		const unsigned char* src = FreeImage_GetScanLine(image, h - 1 - j);
+		unsigned char* dst = pixels + j * w * 4;
+
+		switch (bpp)
 		{
-			RGBQUAD pixelColor;
-			FreeImage_GetPixelColor(image, i, j, &pixelColor);
-
-			copyImgData[2] = pixelColor.rgbRed;
-			copyImgData[1] = pixelColor.rgbGreen;
-			copyImgData[0] = pixelColor.rgbBlue;
-			copyImgData[3] = pixelColor.rgbReserved;
-			copyImgData += 4;
+			case 32:
+				if (freeImageSwap)
+					swapRedBlue(src, dst, w);
+				else
+					memcpy(dst, src, w * 4);
+				break;
+
+			case 24:
+				expandRGBToRGBA(src, dst, w, freeImageSwap);
+				break;
+
+			case 8:
+				if (gray)
+				{
+					expandGrayToRGBA(src, dst, w);
+				}
+				else
+				{
+					unsigned int* dstPixels = (unsigned int*) dst;
+					for (unsigned int i = 0; i < w; i++)
+						dstPixels[i] = palette[src[i]];
+				}
+				break;
 		}
 	}
 
 	FreeImage_Unload(image);
 
+	*width = w;
+	*height = h;
+	return pixels;
+}
+
+void texture::setData(const unsigned char* data, unsigned int w, unsigned int h)
+{
+	kAssert(data);
+	kAssert(mPointer);
+
+	// Placeholders share the placeholder name, get our own
+	if (mPending)
+		glGenTextures(1, mPointer);
+
+	mWidth = w;
+	mHeight = h;
+	mFormat = TEX_RGBA;
+	mPending = false;
+
+	glBindTexture(GL_TEXTURE_2D, *mPointer);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, mWidth, mHeight, 0, GL_BGRA, GL_UNSIGNED_BYTE, data);
+
+	// Wrapping, leaves the texture bound
+	setFlags(mFlags);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	resourceManager* rsc = &resourceManager::getSingleton();
+	if (rsc) rsc->addMemoryUse(getMemoryUse());
+}
+
+void texture::evict(const texture* placeholder)
+{
+	kAssert(placeholder);
+	kAssert(placeholder->getPointer());
+
+	if (!mPointer || mPending)
+		return;
+
+	resourceManager* rsc = &resourceManager::getSingleton();
+	if (rsc) rsc->removeMemoryUse(getMemoryUse());
+
+	glDeleteTextures(1, mPointer);
+	*mPointer = *placeholder->getPointer();
+
+	mWidth = placeholder->getWidth();
+	mHeight = placeholder->getHeight();
+	mPending = true;
+}
+			
+texture::texture(const std::string& filename, int flags)
+{
+	mWidth = mHeight = 0;
+	mFormat = TEX_RGBA;
+	mFlags = flags;
+	mPointer = NULL;
+	mRawData = NULL;
+	mPending = false;
+	mUsed = false;
+
+	unsigned char* pixels = decodeFile(filename, &mWidth, &mHeight);
+	if (!pixels)
+		return;
+
 	try
 	{
 		mPointer = new platformTexturePointer;
@@ -126,49 +253,14 @@ texture::texture(const std::string& filename, int flags)
 	catch (...)
 	{
 		S_LOG_INFO("Failed to allocate GLuint texture for " + filename);
-		delete [] (char*) mRawData;
+		delete [] pixels;
 		return;
 	}
 		
-	glEnable(GL_TEXTURE_2D);
 	glGenTextures(1, mPointer);
-	glBindTexture(GL_TEXTURE_2D, *mPointer);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, mWidth, mHeight, 0, GL_BGRA, GL_UNSIGNED_BYTE, mRawData);
-
-	// Wrapping S
-	if (mFlags & (1 << FLAG_CLAMP_EDGE_S))
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	else
-	if (mFlags & (1 << FLAG_CLAMP_S))
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-	else
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-
-	// Wrapping T
-	if (mFlags & (1 << FLAG_CLAMP_EDGE_T))
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	else
-	if (mFlags & (1 << FLAG_CLAMP_T))
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-	else
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	setData(pixels, mWidth, mHeight);
 
-	// Wrapping R
-	if (mFlags & (1 << FLAG_CLAMP_EDGE_R))
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-	else
-	if (mFlags & (1 << FLAG_CLAMP_R))
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP);
-	else
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_REPEAT);
-
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-	glBindTexture(GL_TEXTURE_2D, 0);
-
-	delete [] (char*) mRawData;
-	mRawData = NULL;
+	delete [] pixels;
 }
 			
 texture::texture(void* data, unsigned int w, unsigned int h, int flags, int format)
@@ -178,6 +270,8 @@ texture::texture(void* data, unsigned int w, unsigned int h, int flags, int form
 	mFormat = format;
 	mFlags = flags;
 	mRawData = NULL;
+	mPending = false;
+	mUsed = false;
 
 	try
 	{
@@ -190,30 +284,48 @@ texture::texture(void* data, unsigned int w, unsigned int h, int flags, int form
 		return;
 	}
 
+	// 24 bit data is expanded to BGRA before upload
 	int realFormat = GL_RGBA;
+	int dataFormat = GL_BGRA;
+	unsigned char* expanded = NULL;
 	switch (mFormat)
 	{
 		case TEX_RGB:
+		case TEX_BGR:
 			realFormat = GL_RGB;
+			try
+			{
+				expanded = new unsigned char[mWidth * mHeight * 4];
+			}
+
+			catch (...)
+			{
+				S_LOG_INFO("Failed to allocate memory to expand texture data.");
+				return;
+			}
+
+			expandRGBToRGBA((const unsigned char*) data, expanded, mWidth * mHeight, mFormat == TEX_RGB);
+			data = expanded;
 			break;
 		case TEX_RGBA:
-			realFormat = GL_RGBA;
-			break;
-		case TEX_BGR:
-			realFormat = GL_BGR;
+			dataFormat = GL_RGBA;
 			break;
 		case TEX_BGRA:
-			realFormat = GL_BGRA;
 			break;
 		default:
 			S_LOG_INFO("Texture Format not supported by openGL");
 			return;
 	}
 		
-	glEnable(GL_TEXTURE_2D);
 	glGenTextures(1, mPointer);
 	glBindTexture(GL_TEXTURE_2D, *mPointer);
-	glTexImage2D(GL_TEXTURE_2D, 0, realFormat, mWidth, mHeight, 0, GL_BGRA, GL_UNSIGNED_BYTE, data);
+	glTexImage2D(GL_TEXTURE_2D, 0, realFormat, mWidth, mHeight, 0, dataFormat, GL_UNSIGNED_BYTE, data);
+
+	if (expanded)
+		delete [] expanded;
+
+	resourceManager* rsc = &resourceManager::getSingleton();
+	if (rsc) rsc->addMemoryUse(getMemoryUse());
 
 	// Wrapping S
 	if (mFlags & (1 << FLAG_CLAMP_EDGE_S))
@@ -260,6 +372,11 @@ void texture::setFlags(unsigned int flags)
 		return;
 
 	mFlags = flags;
+
+	// Applied by setData, the placeholder keeps its own
+	if (mPending)
+		return;
+
 	glBindTexture(GL_TEXTURE_2D, *mPointer);
 
 	// Wrapping S
@@ -124,6 +124,18 @@ root::root(const std::string& filename)
 		S_LOG_INFO("Failed to allocate particleManager.");
 		return;
 	}
+
+	try
+	{
+		// Create the worker pool
+		mWorkerPool = new workerPool();
+	}
+
+	catch (...)
+	{
+		S_LOG_INFO("Failed to allocate workerPool.");
+		return;
+	}
 }
 
 } // namespace k
@@ -24,6 +24,8 @@ THE SOFTWARE.
 #include "thread.h"
 #include "logger.h"
 
+#include <unistd.h>
+
 namespace k {
 
 void createKThread(platformThread* t, void* (*start)(void*), void* arg)
@@ -70,6 +72,48 @@ void destroyKMutex(platformMutex* m)
 	pthread_mutex_destroy(m);
 }
 
+void createKCondition(platformCondition* c)
+{
+	kAssert(c);
+	pthread_cond_init(c, NULL);
+}
+
+void waitKCondition(platformCondition* c, platformMutex* m)
+{
+	kAssert(c);
+	kAssert(m);
+	pthread_cond_wait(c, m);
+}
+
+void signalKCondition(platformCondition* c)
+{
+	kAssert(c);
+	pthread_cond_signal(c);
+}
+
+void broadcastKCondition(platformCondition* c)
+{
+	kAssert(c);
+	pthread_cond_broadcast(c);
+}
+
+void destroyKCondition(platformCondition* c)
+{
+	kAssert(c);
+	pthread_cond_destroy(c);
+}
+
+unsigned int getKProcessorsCount()
+{
+	#ifdef _SC_NPROCESSORS_ONLN
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (count > 0)
+		return (unsigned int)count;
+	#endif
+
+	return 1;
+}
+
 }
 
 #endif
@@ -21,23 +21,35 @@ THE SOFTWARE.
 */
 
 #include "ray.h"
+#include "simd.h"
+#include "logger.h"
 
 namespace k {
+
+void ray::updateLocal()
+{
+	if (mInverseTransformation.isIdentity())
+	{
+		mLocalOrigin = mOrigin;
+		mLocalDirection = mDirection;
+		return;
+	}
+
+	const matrix4& m = mInverseTransformation;
+	mLocalOrigin = m * mOrigin;
+
+	// Directions dont translate
+	for (unsigned int i = 0; i < 3; i++)
+		mLocalDirection.vec[i] = m.m[i][0] * mDirection.x + m.m[i][1] * mDirection.y + m.m[i][2] * mDirection.z;
+}
 			
 /**
  * This one is based on Moller and Trumbore
  */
 bool ray::intersect(const vector3& v1, const vector3& v2, const vector3& v3)
 {
-	vector3 newDirection = mDirection;
-	vector3 newOrigin = mOrigin;
-
-	// Change coordinates of the ray
-	if (!mInverseTransformation.isIdentity())
-	{
-		newDirection = mInverseTransformation * mDirection;
-		newOrigin = mInverseTransformation * mOrigin;
-	}
+	const vector3& newDirection = mLocalDirection;
+	const vector3& newOrigin = mLocalOrigin;
 
 	// reset fraction
 	mFraction = 0;
@@ -71,16 +83,436 @@ bool ray::intersect(const vector3& v1, const vector3& v2, const vector3& v3)
 	if (distance > 0.00001)
 	{
 		mFraction = distance;
+
+		// Front face is the one facing the ray
+		mNormal = edge1.crossProduct(edge2);
+		mNormal.normalize();
+		if (mNormal.dotProduct(newDirection) > 0)
+			mNormal = mNormal * -1;
+
 		return true;
 	}
 		
 	return false;
 }
 
+void ray::setTriangle(triangle4_t& packet, unsigned int lane, const vector3& v1, const vector3& v2, const vector3& v3)
+{
+	kAssert(lane < 4);
+
+	const vector3 edge1 = v2 - v1;
+	const vector3 edge2 = v3 - v1;
+
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		packet.v1[i][lane] = v1.vec[i];
+		packet.edge1[i][lane] = edge1.vec[i];
+		packet.edge2[i][lane] = edge2.vec[i];
+	}
+}
+
+/**
+ * Same test as the single triangle one, on four triangles per step.
+ * Zeroed lanes have no determinant and never hit.
+ */
+int ray::intersect(const triangle4_t* packets, unsigned int count)
+{
+	kAssert(packets || !count);
+
+	const vec_t noHit = 1e30f;
+	vec_t closest = noHit;
+	int closestIndex = -1;
+
+	#ifdef __HAVE_SSE3__
+	const __m128 epsilon = _mm_set1_ps(0.00001f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+	const __m128 dx = _mm_set1_ps(mLocalDirection.x);
+	const __m128 dy = _mm_set1_ps(mLocalDirection.y);
+	const __m128 dz = _mm_set1_ps(mLocalDirection.z);
+	const __m128 ox = _mm_set1_ps(mLocalOrigin.x);
+	const __m128 oy = _mm_set1_ps(mLocalOrigin.y);
+	const __m128 oz = _mm_set1_ps(mLocalOrigin.z);
+
+	for (unsigned int p = 0; p < count; p++)
+	{
+		const triangle4_t& tri = packets[p];
+
+		const __m128 e1x = _mm_loadu_ps(tri.edge1[0]);
+		const __m128 e1y = _mm_loadu_ps(tri.edge1[1]);
+		const __m128 e1z = _mm_loadu_ps(tri.edge1[2]);
+		const __m128 e2x = _mm_loadu_ps(tri.edge2[0]);
+		const __m128 e2y = _mm_loadu_ps(tri.edge2[1]);
+		const __m128 e2z = _mm_loadu_ps(tri.edge2[2]);
+
+		// pvec = direction x edge2
+		const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+		const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+		const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+
+		const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+		__m128 valid = _mm_cmpge_ps(_mm_and_ps(det, absMask), epsilon);
+		if (!_mm_movemask_ps(valid))
+			continue;
+
+		const __m128 invDet = _mm_div_ps(one, _mm_or_ps(_mm_and_ps(valid, det), _mm_andnot_ps(valid, one)));
+
+		// tvec = origin - v1
+		const __m128 tx = _mm_sub_ps(ox, _mm_loadu_ps(tri.v1[0]));
+		const __m128 ty = _mm_sub_ps(oy, _mm_loadu_ps(tri.v1[1]));
+		const __m128 tz = _mm_sub_ps(oz, _mm_loadu_ps(tri.v1[2]));
+
+		const __m128 u = _mm_mul_ps(invDet, _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)));
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+
+		// qvec = tvec x edge1
+		const __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+		const __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+		const __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+
+		const __m128 v = _mm_mul_ps(invDet, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)));
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+		const __m128 distance = _mm_mul_ps(invDet, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)));
+		valid = _mm_and_ps(valid, _mm_cmpgt_ps(distance, epsilon));
+
+		const int mask = _mm_movemask_ps(valid);
+		if (!mask)
+			continue;
+
+		vec_t distances[4];
+		_mm_storeu_ps(distances, distance);
+
+		for (unsigned int lane = 0; lane < 4; lane++)
+		{
+			if ((mask & (1 << lane)) && distances[lane] < closest)
+			{
+				closest = distances[lane];
+				closestIndex = p * 4 + lane;
+			}
+		}
+	}
+	#else
+	for (unsigned int p = 0; p < count; p++)
+	{
+		for (unsigned int lane = 0; lane < 4; lane++)
+		{
+			const triangle4_t& tri = packets[p];
+			const vector3 v1(tri.v1[0][lane], tri.v1[1][lane], tri.v1[2][lane]);
+			const vector3 edge1(tri.edge1[0][lane], tri.edge1[1][lane], tri.edge1[2][lane]);
+			const vector3 edge2(tri.edge2[0][lane], tri.edge2[1][lane], tri.edge2[2][lane]);
+
+			if (intersect(v1, v1 + edge1, v1 + edge2) && mFraction < closest)
+			{
+				closest = mFraction;
+				closestIndex = p * 4 + lane;
+			}
+		}
+	}
+	#endif
+
+	if (closestIndex < 0)
+	{
+		mFraction = 0;
+		return -1;
+	}
+
+	const triangle4_t& tri = packets[closestIndex / 4];
+	const unsigned int lane = closestIndex % 4;
+	const vector3 edge1(tri.edge1[0][lane], tri.edge1[1][lane], tri.edge1[2][lane]);
+	const vector3 edge2(tri.edge2[0][lane], tri.edge2[1][lane], tri.edge2[2][lane]);
+
+	mFraction = closest;
+	mNormal = edge1.crossProduct(edge2);
+	mNormal.normalize();
+	if (mNormal.dotProduct(mLocalDirection) > 0)
+		mNormal = mNormal * -1;
+
+	return closestIndex;
+}
+
+ray ray::getTransformed() const
+{
+	return ray(mLocalOrigin, mLocalDirection);
+}
+
 bool ray::intersect(const boundingBox& bb)
 {
-	//TODO
-	return false;
+	return intersect(bb.getMins(), bb.getMaxs());
+}
+
+/**
+ * Slab test, clipping the ray against each pair of box planes
+ */
+bool ray::intersect(const vector3& mins, const vector3& maxs)
+{
+	const vector3& newDirection = mLocalDirection;
+	const vector3& newOrigin = mLocalOrigin;
+
+	// reset fraction
+	mFraction = 0;
+
+	vec_t tMin = 0;
+	vec_t tMax = 1e30f;
+	int entryAxis = -1;
+
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		if (fabs(newDirection.vec[i]) < 0.00001)
+		{
+			// Parallel to slab, origin must be inside it
+			if (newOrigin.vec[i] < mins.vec[i] || newOrigin.vec[i] > maxs.vec[i])
+				return false;
+
+			continue;
+		}
+
+		const vec_t invDir = 1.0f / newDirection.vec[i];
+		vec_t t0 = (mins.vec[i] - newOrigin.vec[i]) * invDir;
+		vec_t t1 = (maxs.vec[i] - newOrigin.vec[i]) * invDir;
+
+		if (t0 > t1)
+			std::swap(t0, t1);
+
+		if (t0 > tMin)
+		{
+			tMin = t0;
+			entryAxis = i;
+		}
+
+		if (t1 < tMax)
+			tMax = t1;
+
+		if (tMin > tMax)
+			return false;
+	}
+
+	mFraction = tMin;
+
+	// Normal of the face we entered by, none if starting inside
+	mNormal = vector3(0, 0, 0);
+	if (entryAxis >= 0)
+		mNormal.vec[entryAxis] = (newDirection.vec[entryAxis] > 0) ? -1 : 1;
+
+	return true;
+}
+
+// Slabs parallel to the ray get a zero inverse direction, and the
+// ray only passes them if its origin is inside.
+static const vec_t slabInfinity = 1e30f;
+
+static inline vec_t slabInverse(vec_t d)
+{
+	if (fabs(d) < 0.00001)
+		return 0;
+
+	return 1.0f / d;
+}
+
+static inline vec_t slabTest(const vector3& origin, const vector3& invDir, const vector3& mins, const vector3& maxs)
+{
+	vec_t tMin = 0;
+	vec_t tMax = slabInfinity;
+
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		if (invDir.vec[i] == 0)
+		{
+			if (origin.vec[i] < mins.vec[i] || origin.vec[i] > maxs.vec[i])
+				return -1;
+
+			continue;
+		}
+
+		vec_t t0 = (mins.vec[i] - origin.vec[i]) * invDir.vec[i];
+		vec_t t1 = (maxs.vec[i] - origin.vec[i]) * invDir.vec[i];
+
+		tMin = std::max(tMin, std::min(t0, t1));
+		tMax = std::min(tMax, std::max(t0, t1));
+	}
+
+	return (tMin <= tMax) ? tMin : -1;
+}
+
+#ifdef __HAVE_SSE3__
+/**
+ * Slab test of four (origin, inverse direction, box) sets laid out
+ * by axis. Returns entry distances, -1 on lanes that missed.
+ */
+static inline __m128 slabTest4(const __m128* origin, const __m128* invDir, const __m128* mins, const __m128* maxs)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 infinity = _mm_set1_ps(slabInfinity);
+
+	__m128 tMin = zero;
+	__m128 tMax = infinity;
+	__m128 valid = _mm_cmpeq_ps(zero, zero);
+
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(mins[i], origin[i]), invDir[i]);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(maxs[i], origin[i]), invDir[i]);
+		__m128 near = _mm_min_ps(t0, t1);
+		__m128 far = _mm_max_ps(t0, t1);
+
+		// Parallel lanes dont clip, but must start inside the slab
+		__m128 parallel = _mm_cmpeq_ps(invDir[i], zero);
+		__m128 inside = _mm_and_ps(_mm_cmpge_ps(origin[i], mins[i]), _mm_cmple_ps(origin[i], maxs[i]));
+		valid = _mm_andnot_ps(_mm_andnot_ps(inside, parallel), valid);
+
+		near = _mm_andnot_ps(parallel, near);
+		far = _mm_or_ps(_mm_and_ps(parallel, infinity), _mm_andnot_ps(parallel, far));
+
+		tMin = _mm_max_ps(tMin, near);
+		tMax = _mm_min_ps(tMax, far);
+	}
+
+	__m128 hit = _mm_and_ps(valid, _mm_cmple_ps(tMin, tMax));
+	return _mm_or_ps(_mm_and_ps(hit, tMin), _mm_andnot_ps(hit, _mm_set1_ps(-1)));
+}
+#endif
+
+/**
+ * Test a ray against boxes whose extremes are stride bytes apart.
+ */
+static unsigned int intersectBoxes(const ray& localRay, const char* mins, const char* maxs, 
+	unsigned int stride, unsigned int count, vec_t* fractions)
+{
+	const vector3& origin = localRay.getOrigin();
+	const vector3 invDir(slabInverse(localRay.getDirection().x), 
+		slabInverse(localRay.getDirection().y), slabInverse(localRay.getDirection().z));
+
+	unsigned int hits = 0;
+	unsigned int i = 0;
+
+	#ifdef __HAVE_SSE3__
+	__m128 origin4[3], invDir4[3];
+	for (unsigned int axis = 0; axis < 3; axis++)
+	{
+		origin4[axis] = _mm_set1_ps(origin.vec[axis]);
+		invDir4[axis] = _mm_set1_ps(invDir.vec[axis]);
+	}
+
+	for (; i + 4 <= count; i += 4)
+	{
+		const vec_t* mn[4];
+		const vec_t* mx[4];
+		for (unsigned int j = 0; j < 4; j++)
+		{
+			mn[j] = ((const vector3*)(mins + (i + j) * stride))->vec;
+			mx[j] = ((const vector3*)(maxs + (i + j) * stride))->vec;
+		}
+
+		__m128 mins4[3], maxs4[3];
+		for (unsigned int axis = 0; axis < 3; axis++)
+		{
+			mins4[axis] = _mm_set_ps(mn[3][axis], mn[2][axis], mn[1][axis], mn[0][axis]);
+			maxs4[axis] = _mm_set_ps(mx[3][axis], mx[2][axis], mx[1][axis], mx[0][axis]);
+		}
+
+		__m128 t = slabTest4(origin4, invDir4, mins4, maxs4);
+		_mm_storeu_ps(fractions + i, t);
+
+		hits += __builtin_popcount(_mm_movemask_ps(_mm_cmpge_ps(t, _mm_setzero_ps())));
+	}
+	#endif
+
+	for (; i < count; i++)
+	{
+		fractions[i] = slabTest(origin, invDir, *(const vector3*)(mins + i * stride), 
+			*(const vector3*)(maxs + i * stride));
+
+		if (fractions[i] >= 0)
+			hits++;
+	}
+
+	return hits;
+}
+
+unsigned int ray::intersect(const boundingBox* boxes, unsigned int count, vec_t* fractions) const
+{
+	kAssert(fractions);
+	if (!count)
+		return 0;
+
+	kAssert(boxes);
+	return intersectBoxes(getTransformed(), (const char*)&boxes[0].getMins(), 
+		(const char*)&boxes[0].getMaxs(), sizeof(boundingBox), count, fractions);
+}
+
+unsigned int ray::intersect(const vector3* mins, const vector3* maxs, unsigned int count, vec_t* fractions) const
+{
+	kAssert(fractions);
+	if (!count)
+		return 0;
+
+	kAssert(mins && maxs);
+	return intersectBoxes(getTransformed(), (const char*)mins, (const char*)maxs, 
+		sizeof(vector3), count, fractions);
+}
+
+unsigned int ray::intersect(const ray* rays, unsigned int count, const boundingBox& bb, vec_t* fractions)
+{
+	kAssert(fractions);
+	if (!count)
+		return 0;
+
+	kAssert(rays);
+
+	const vector3& mins = bb.getMins();
+	const vector3& maxs = bb.getMaxs();
+
+	unsigned int hits = 0;
+	unsigned int i = 0;
+
+	#ifdef __HAVE_SSE3__
+	__m128 mins4[3], maxs4[3];
+	for (unsigned int axis = 0; axis < 3; axis++)
+	{
+		mins4[axis] = _mm_set1_ps(mins.vec[axis]);
+		maxs4[axis] = _mm_set1_ps(maxs.vec[axis]);
+	}
+
+	for (; i + 4 <= count; i += 4)
+	{
+		vector3 origin[4], invDir[4];
+		for (unsigned int j = 0; j < 4; j++)
+		{
+			const ray localRay = rays[i + j].getTransformed();
+			const vector3& dir = localRay.getDirection();
+
+			origin[j] = localRay.getOrigin();
+			invDir[j] = vector3(slabInverse(dir.x), slabInverse(dir.y), slabInverse(dir.z));
+		}
+
+		__m128 origin4[3], invDir4[3];
+		for (unsigned int axis = 0; axis < 3; axis++)
+		{
+			origin4[axis] = _mm_set_ps(origin[3].vec[axis], origin[2].vec[axis], origin[1].vec[axis], origin[0].vec[axis]);
+			invDir4[axis] = _mm_set_ps(invDir[3].vec[axis], invDir[2].vec[axis], invDir[1].vec[axis], invDir[0].vec[axis]);
+		}
+
+		__m128 t = slabTest4(origin4, invDir4, mins4, maxs4);
+		_mm_storeu_ps(fractions + i, t);
+
+		hits += __builtin_popcount(_mm_movemask_ps(_mm_cmpge_ps(t, _mm_setzero_ps())));
+	}
+	#endif
+
+	for (; i < count; i++)
+	{
+		const ray localRay = rays[i].getTransformed();
+		const vector3& dir = localRay.getDirection();
+		const vector3 invDir(slabInverse(dir.x), slabInverse(dir.y), slabInverse(dir.z));
+
+		fractions[i] = slabTest(localRay.getOrigin(), invDir, mins, maxs);
+		if (fractions[i] >= 0)
+			hits++;
+	}
+
+	return hits;
 }
 
 }
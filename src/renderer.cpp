@@ -24,6 +24,9 @@ THE SOFTWARE.
 #include "root.h"
 #include "logger.h"
 #include "guiManager.h"
+#include "workerPool.h"
+#include "textureManager.h"
+#include "ray.h"
 
 namespace k {
 
@@ -52,6 +55,7 @@ renderer::renderer()
 	mRenderToTexture = false;
 	mFpsCount = 0;
 	mLastFps = 1;
+	mFrameStartTime = 0;
 }
 
 renderer::~renderer()
@@ -76,6 +80,11 @@ void renderer::setWorld(world* w)
 	kAssert(w);
 	mActiveWorld = w;
 }
+
+world* renderer::getWorld()
+{
+	return mActiveWorld;
+}
 			
 light::light* renderer::createPointLight()
 {
@@ -375,7 +384,7 @@ void renderer::_drawSkybox()
 	kAssert(matStage->getImagesCount() == 6);
 
 	// Render the front quad
-	rs->bindTexture(matStage->getTexture(CUBE_FRONT)->getPointer(), 0);
+	rs->bindTexture(matStage->getTexture(CUBE_FRONT), 0);
  	rs->startVertices(VERTEXMODE_QUAD);
 		rs->texCoord(vector2(0, 1)); rs->vertex(vector3( 400.0f, -200.0f, -400.0f));
 		rs->texCoord(vector2(1, 1)); rs->vertex(vector3(-400.0f, -200.0f, -400.0f));
@@ -384,7 +393,7 @@ void renderer::_drawSkybox()
 	rs->endVertices();
 
 	// Render the left quad
-	rs->bindTexture(matStage->getTexture(CUBE_LEFT)->getPointer(), 0);
+	rs->bindTexture(matStage->getTexture(CUBE_LEFT), 0);
 	rs->startVertices(VERTEXMODE_QUAD);
 		rs->texCoord(vector2(0, 1)); rs->vertex(vector3( 400.0f, -200.0f,  400.0f));
 		rs->texCoord(vector2(1, 1)); rs->vertex(vector3( 400.0f, -200.0f, -400.0f));
@@ -393,7 +402,7 @@ void renderer::_drawSkybox()
 	rs->endVertices();
 
 	// Render the back quad
-	rs->bindTexture(matStage->getTexture(CUBE_BACK)->getPointer(), 0);
+	rs->bindTexture(matStage->getTexture(CUBE_BACK), 0);
 	rs->startVertices(VERTEXMODE_QUAD);
 		rs->texCoord(vector2(0, 1)); rs->vertex(vector3(-400.0f, -200.0f,  400.0f));
 		rs->texCoord(vector2(1, 1)); rs->vertex(vector3( 400.0f, -200.0f,  400.0f));
@@ -402,7 +411,7 @@ void renderer::_drawSkybox()
 	rs->endVertices();
 
 	// Render the right quad
-	rs->bindTexture(matStage->getTexture(CUBE_RIGHT)->getPointer(), 0);
+	rs->bindTexture(matStage->getTexture(CUBE_RIGHT), 0);
 	rs->startVertices(VERTEXMODE_QUAD);
 		rs->texCoord(vector2(0, 1)); rs->vertex(vector3(-400.0f, -200.0f, -400.0f));
 		rs->texCoord(vector2(1, 1)); rs->vertex(vector3(-400.0f, -200.0f,  400.0f));
@@ -411,7 +420,7 @@ void renderer::_drawSkybox()
 	rs->endVertices();
 
 	// Render the top quad
-	rs->bindTexture(matStage->getTexture(CUBE_UP)->getPointer(), 0);
+	rs->bindTexture(matStage->getTexture(CUBE_UP), 0);
 	rs->startVertices(VERTEXMODE_QUAD);
 		rs->texCoord(vector2(1, 1)); rs->vertex(vector3(-400.0f,  200.0f, -400.0f));
 		rs->texCoord(vector2(1, 0)); rs->vertex(vector3(-400.0f,  200.0f,  400.0f));
@@ -420,7 +429,7 @@ void renderer::_drawSkybox()
 	rs->endVertices();
 
 	// Render the bottom quad
-	rs->bindTexture(matStage->getTexture(CUBE_DOWN)->getPointer(), 0);
+	rs->bindTexture(matStage->getTexture(CUBE_DOWN), 0);
 	rs->startVertices(VERTEXMODE_QUAD);
 		rs->texCoord(vector2(1, 0)); rs->vertex(vector3(-400.0f, -200.0f, -400.0f));
 		rs->texCoord(vector2(1, 1)); rs->vertex(vector3(-400.0f, -200.0f,  400.0f));
@@ -442,6 +451,74 @@ void renderer::_drawSkybox()
 	rs->setDepthMask(true);
 }
 
+static void prepareDrawableJob(void* data)
+{
+	drawable3D* obj = (drawable3D*) data;
+	kAssert(obj);
+
+	obj->prepare();
+}
+
+void renderer::_prepareObjects()
+{
+	workerPool* pool = &workerPool::getSingleton();
+
+	for (std::list<drawable3D*>::const_iterator it = m3DObjects.begin(); it != m3DObjects.end(); ++it)
+	{
+		drawable3D* obj = *it;
+		kAssert(obj);
+
+		if (!obj->isVisible() || !obj->isAnimated())
+			continue;
+
+		// Dont waste time on objects we wont draw
+		if (mActiveCamera && !mActiveCamera->isBoxInsideFrustum(obj->getAABoundingBox()))
+			continue;
+
+		pool->pushJob(prepareDrawableJob, obj);
+	}
+}
+
+void renderer::_drawSpriteBatches()
+{
+	renderSystem* rs = root::getSingleton().getRenderSystem();
+	mSpriteBatch.setCamera(mActiveCamera);
+
+	std::map<material*, std::vector<sprite*> >::iterator it;
+	for (it = mSpriteGroups.begin(); it != mSpriteGroups.end(); it++)
+	{
+		std::vector<sprite*>& group = it->second;
+		if (group.empty())
+			continue;
+
+		if (!mActiveCamera)
+		{
+			rs->setMatrixMode(MATRIXMODE_MODELVIEW);
+			rs->identityMatrix();
+		}
+		else
+		{
+			mActiveCamera->copyView();
+		}
+
+		mSpriteBatch.build(&group[0], group.size());
+		group.clear();
+
+		material* mat = it->first;
+		mat->start();
+
+		// Same states of sprite::draw
+		rs->setCulling(CULLMODE_NONE);
+		rs->setDepthTest(true);
+		rs->setDepthMask(false);
+
+		mSpriteBatch.draw();
+
+		rs->setDepthMask(true);
+		mat->finish();
+	}
+}
+
 void renderer::draw()
 {
 	renderSystem* rs = root::getSingleton().getRenderSystem();
@@ -456,6 +533,10 @@ void renderer::draw()
 
 	// Time since frame start.
 	mFrameTime.reset();
+	mFrameStartTime = root::getSingleton().getGlobalTime();
+
+	// Swap in textures decoded since the last frame
+	textureManager::getSingleton().update();
 
 	// Set default perspective
 	if (mActiveCamera)
@@ -496,6 +577,13 @@ void renderer::draw()
 		rs->setPerspective(90, 1.33, 0.1, 1000.0f);
 	}
 
+	/**
+	 * Animate objects and simulate particles on
+	 * the worker pool while we draw the world.
+	 */
+	_prepareObjects();
+	particle::manager::getSingleton().simulateParticles();
+
 	/** 
 	 * Draw world
 	 */
@@ -505,6 +593,9 @@ void renderer::draw()
 		mActiveWorld->draw(mActiveCamera);
 	}
 
+	// Poses (and particles) must be finished before drawing
+	workerPool::getSingleton().wait();
+
 	/**
 	 * Camera is ready, draw objects
 	 * keep in mind that you wont call identityMatrix() on the
@@ -560,6 +651,8 @@ void renderer::draw()
 			rs->setLighting(false);
 	}
 
+	const bool batchSprites = !rs->getPointSpriteSupport();
+
 	std::list<sprite*>::const_iterator it;
 	for (it = mSprites.begin(); it != mSprites.end(); it++)
 	{
@@ -603,12 +696,21 @@ void renderer::draw()
 			lightIndex++;
 		}
 
+		if (!lightFound && batchSprites && spr->getMaterial())
+		{
+			mSpriteGroups[spr->getMaterial()].push_back(spr);
+			continue;
+		}
+
 		spr->draw();
 
 		if (lightFound)
 			rs->setLighting(false);
 	}
 
+	if (batchSprites)
+		_drawSpriteBatches();
+
 	// Particles
 	particle::manager::getSingleton().drawParticles();
 
@@ -708,5 +810,120 @@ void renderer::prepareRTT(unsigned int w, unsigned int h, platformTexturePointer
 	mRenderToTexture = true;
 }
 
+void renderer::_gatherQueryBounds(vec_t radius)
+{
+	const vector3 grow(radius, radius, radius);
+
+	mQueryObjects.clear();
+	mQueryMins.clear();
+	mQueryMaxs.clear();
+
+	std::list<drawable3D*>::iterator it;
+	for (it = m3DObjects.begin(); it != m3DObjects.end(); it++)
+	{
+		drawable3D* obj = *it;
+		if (!obj->isVisible())
+			continue;
+
+		const boundingBox box = obj->getAABoundingBox();
+		mQueryObjects.push_back(obj);
+		mQueryMins.push_back(box.getMins() - grow);
+		mQueryMaxs.push_back(box.getMaxs() + grow);
+	}
+
+	mQueryFractions.resize(mQueryObjects.size());
+}
+
+bool renderer::_query(const vector3& start, const vector3& end, vec_t radius, 
+	int worldFlags, const drawable3D* ignore, sceneHit& hit)
+{
+	hit.object = NULL;
+	hit.world = false;
+	hit.surface = -1;
+	hit.fraction = 1.0f;
+
+	// World first, so drawables behind it are never traced
+	if (mActiveWorld && mActiveWorld->traceSegment(start, end, radius, worldFlags, hit.fraction, hit.normal))
+		hit.world = true;
+
+	// Broadphase, direction is not normalized so fractions are on [0, 1]
+	ray queryRay(start, end - start);
+	const unsigned int count = mQueryObjects.size();
+	if (count && queryRay.intersect(&mQueryMins[0], &mQueryMaxs[0], count, &mQueryFractions[0]))
+	{
+		std::vector<std::pair<vec_t, unsigned int> > candidates;
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (mQueryFractions[i] >= 0 && mQueryFractions[i] <= hit.fraction && mQueryObjects[i] != ignore)
+				candidates.push_back(std::make_pair(mQueryFractions[i], i));
+		}
+
+		std::sort(candidates.begin(), candidates.end());
+
+		// Narrowphase, nearest boxes first
+		for (unsigned int i = 0; i < candidates.size(); i++)
+		{
+			if (candidates[i].first > hit.fraction)
+				break;
+
+			const unsigned int index = candidates[i].second;
+			drawable3D* obj = mQueryObjects[index];
+
+			if (radius > 0)
+			{
+				// Spheres stop at the grown box
+				queryRay.resetOrientation();
+				queryRay.intersect(mQueryMins[index], mQueryMaxs[index]);
+				queryRay.setSurface(-1);
+			}
+			else
+			if (!obj->trace(queryRay))
+				continue;
+
+			if (queryRay.getFraction() > hit.fraction)
+				continue;
+
+			hit.object = obj;
+			hit.world = false;
+			hit.surface = queryRay.getSurface();
+			hit.fraction = queryRay.getFraction();
+			hit.normal = queryRay.getNormal();
+		}
+	}
+
+	hit.position = start + (end - start) * hit.fraction;
+	return hit.world || hit.object;
+}
+
+bool renderer::raycast(const vector3& start, const vector3& end, sceneHit& hit, 
+	int worldFlags, const drawable3D* ignore)
+{
+	_gatherQueryBounds(0);
+	return _query(start, end, 0, worldFlags, ignore, hit);
+}
+
+bool renderer::sphereCast(const vector3& start, const vector3& end, vec_t radius, sceneHit& hit,
+	int worldFlags, const drawable3D* ignore)
+{
+	_gatherQueryBounds(radius);
+	return _query(start, end, radius, worldFlags, ignore, hit);
+}
+
+unsigned int renderer::raycast(const vector3* starts, const vector3* ends, unsigned int count, 
+	sceneHit* hits, int worldFlags)
+{
+	kAssert(starts && ends && hits);
+	_gatherQueryBounds(0);
+
+	unsigned int hitCount = 0;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (_query(starts[i], ends[i], 0, worldFlags, NULL, hits[i]))
+			hitCount++;
+	}
+
+	return hitCount;
+}
+
 }
 
@@ -120,6 +120,14 @@ void resourceManager::addMemoryUse(unsigned long m)
 	mUsedMemory += m;
 }
 
+void resourceManager::removeMemoryUse(unsigned long m)
+{
+	if (m > mUsedMemory)
+		mUsedMemory = 0;
+	else
+		mUsedMemory -= m;
+}
+
 unsigned long resourceManager::getMemoryUsage()
 {
 	return mUsedMemory;
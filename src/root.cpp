@@ -37,13 +37,16 @@ root& root::getSingleton()
 
 root::~root()
 {
-	delete mActiveRS;
 	delete mInputManager;
 	delete mGuiManager;
 	delete mRenderer;
 	delete mTextureManager;
 	delete mMaterialManager;
 	delete mParticleManager;
+	delete mWorkerPool;
+
+	// Last, managers may still release buffers on it
+	delete mActiveRS;
 	delete mLogger;
 }
 			
@@ -52,6 +55,11 @@ particle::manager* root::getParticleManager()
 	return mParticleManager;
 }
 			
+workerPool* root::getWorkerPool()
+{
+	return mWorkerPool;
+}
+			
 renderSystem* root::getRenderSystem()
 {
 	return mActiveRS;
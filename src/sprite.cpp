@@ -24,6 +24,7 @@ THE SOFTWARE.
 #include "logger.h"
 #include "root.h"
 #include "camera.h"
+#include "simd.h"
 
 namespace k {
 
@@ -299,5 +300,263 @@ void sprite::rawDraw()
 	rs->drawArrays(true);
 }
 
+spriteBatch::spriteBatch(spriteUVLayout_t layout)
+{
+	mLayout = layout;
+	mBuffer = NULL;
+	mGather = NULL;
+	mCapacity = 0;
+	mCount = 0;
+	mHaveVBO = false;
+
+	setCamera(NULL);
+}
+
+spriteBatch::~spriteBatch()
+{
+	if (mHaveVBO)
+	{
+		renderSystem* rs = root::getSingleton().getRenderSystem();
+		rs->delVBO(&mVBO);
+	}
+
+	if (mBuffer)
+		free(mBuffer);
+
+	if (mGather)
+		free(mGather);
+}
+
+bool spriteBatch::reserve(unsigned int count)
+{
+	if (count <= mCapacity)
+		return true;
+
+	const unsigned int capacity = (count + 3) & ~3;
+
+	// 4 texture coordinates and 4 vertices per quad
+	vec_t* buffer = (vec_t*) memalign(32, sizeof(vec_t) * capacity * 20);
+	vec_t* gather = (vec_t*) memalign(32, sizeof(vec_t) * capacity * 4);
+	if (!buffer || !gather)
+	{
+		S_LOG_INFO("Failed to allocate sprite batch.");
+
+		if (buffer)
+			free(buffer);
+
+		if (gather)
+			free(gather);
+
+		return false;
+	}
+
+	if (mBuffer)
+		free(mBuffer);
+
+	if (mGather)
+		free(mGather);
+
+	// Texture coordinates never change, corners 
+	// are -x-y, x-y, x+y and -x+y (see setCamera).
+	const vec_t drawUV[8] = {1, 1, 0, 1, 0, 0, 1, 0};
+	const vec_t rawDrawUV[8] = {0, 0, 1, 0, 1, 1, 0, 1};
+	const vec_t* uv = (mLayout == SPRITEUV_DRAW) ? drawUV : rawDrawUV;
+
+	for (unsigned int i = 0; i < capacity; i++)
+		memcpy(buffer + i * 8, uv, sizeof(vec_t) * 8);
+
+	mBuffer = buffer;
+	mGather = gather;
+	mCapacity = capacity;
+	mCount = 0;
+
+	return true;
+}
+
+void spriteBatch::setCamera(const camera* cam)
+{
+	vector3 sprX = vector3::unit_x;
+	vector3 sprY = vector3::unit_y;
+
+	// Same orientation of sprite::calculateTransPos, 
+	// but facing the camera plane instead of its position.
+	if (cam)
+	{
+		vector3 sprZ = cam->getDirection().negate();
+		sprZ.normalize();
+
+		sprX = sprZ.crossProduct(vector3::unit_y);
+		if (sprX.length() > 0.0001f)
+		{
+			sprX.normalize();
+
+			sprY = sprX.crossProduct(sprZ);
+			sprY.normalize();
+		}
+		else
+		{
+			// Looking straight up or down
+			sprX = cam->getRight();
+			sprY = cam->getUp();
+		}
+	}
+
+	mCorners[0] = sprX.negate() - sprY;
+	mCorners[1] = sprX - sprY;
+	mCorners[2] = sprX + sprY;
+	mCorners[3] = sprY - sprX;
+}
+
+#ifdef __HAVE_SSE3__
+/**
+ * Write the 4 vertices (12 floats) of a quad, 
+ * p0-p2 are the position repeated as xyzx yzxy zxyz.
+ */
+static inline void expandQuad(vec_t* out, __m128 p0, __m128 p1, __m128 p2, __m128 h,
+	__m128 c0, __m128 c1, __m128 c2)
+{
+	_mm_storeu_ps(out, _mm_add_ps(p0, _mm_mul_ps(h, c0)));
+	_mm_storeu_ps(out + 4, _mm_add_ps(p1, _mm_mul_ps(h, c1)));
+	_mm_storeu_ps(out + 8, _mm_add_ps(p2, _mm_mul_ps(h, c2)));
+}
+#endif
+
+void spriteBatch::build(const vec_t* x, const vec_t* y, const vec_t* z, const vec_t* radius,
+	unsigned int count, const vector3& origin, bool screenRadius)
+{
+	mCount = 0;
+	if (!count || !reserve(count))
+		return;
+
+	kAssert(x && y && z && radius);
+
+	// Vertices are right after the texture coordinates of all quads
+	vec_t* out = mBuffer + mCapacity * 8;
+
+	// sprite::setRadius conversion, radius * radius / width
+	renderSystem* rs = root::getSingleton().getRenderSystem();
+	const vec_t radiusScale = screenRadius ? 1.0f / rs->getScreenWidth() : 0;
+
+	unsigned int i = 0;
+
+	#ifdef __HAVE_SSE3__
+	const vector3* c = mCorners;
+	const __m128 c0 = _mm_setr_ps(c[0].x, c[0].y, c[0].z, c[1].x);
+	const __m128 c1 = _mm_setr_ps(c[1].y, c[1].z, c[2].x, c[2].y);
+	const __m128 c2 = _mm_setr_ps(c[2].z, c[3].x, c[3].y, c[3].z);
+	const __m128 scale = _mm_set1_ps(radiusScale);
+
+	for (; i + 4 <= count; i += 4, out += 48)
+	{
+		const __m128 px = _mm_add_ps(_mm_loadu_ps(x + i), _mm_set1_ps(origin.x));
+		const __m128 py = _mm_add_ps(_mm_loadu_ps(y + i), _mm_set1_ps(origin.y));
+		const __m128 pz = _mm_add_ps(_mm_loadu_ps(z + i), _mm_set1_ps(origin.z));
+
+		__m128 h = _mm_loadu_ps(radius + i);
+		if (screenRadius)
+			h = _mm_mul_ps(_mm_mul_ps(h, h), scale);
+
+		// (x0 y0 x1 y1), (y0 z0 y1 z1), (z0 x0 z1 x1) and the high halves
+		const __m128 xyLo = _mm_unpacklo_ps(px, py);
+		const __m128 yzLo = _mm_unpacklo_ps(py, pz);
+		const __m128 zxLo = _mm_unpacklo_ps(pz, px);
+		const __m128 xyHi = _mm_unpackhi_ps(px, py);
+		const __m128 yzHi = _mm_unpackhi_ps(py, pz);
+		const __m128 zxHi = _mm_unpackhi_ps(pz, px);
+
+		expandQuad(out, _mm_movelh_ps(xyLo, zxLo), _mm_movelh_ps(yzLo, xyLo), _mm_movelh_ps(zxLo, yzLo),
+			_mm_shuffle_ps(h, h, _MM_SHUFFLE(0, 0, 0, 0)), c0, c1, c2);
+		expandQuad(out + 12, _mm_movehl_ps(zxLo, xyLo), _mm_movehl_ps(xyLo, yzLo), _mm_movehl_ps(yzLo, zxLo),
+			_mm_shuffle_ps(h, h, _MM_SHUFFLE(1, 1, 1, 1)), c0, c1, c2);
+		expandQuad(out + 24, _mm_movelh_ps(xyHi, zxHi), _mm_movelh_ps(yzHi, xyHi), _mm_movelh_ps(zxHi, yzHi),
+			_mm_shuffle_ps(h, h, _MM_SHUFFLE(2, 2, 2, 2)), c0, c1, c2);
+		expandQuad(out + 36, _mm_movehl_ps(zxHi, xyHi), _mm_movehl_ps(xyHi, yzHi), _mm_movehl_ps(yzHi, zxHi),
+			_mm_shuffle_ps(h, h, _MM_SHUFFLE(3, 3, 3, 3)), c0, c1, c2);
+	}
+	#endif
+
+	for (; i < count; i++, out += 12)
+	{
+		const vector3 pos(origin.x + x[i], origin.y + y[i], origin.z + z[i]);
+		const vec_t h = screenRadius ? radius[i] * radius[i] * radiusScale : radius[i];
+
+		for (unsigned int j = 0; j < 4; j++)
+		{
+			out[j * 3 + 0] = pos.x + h * mCorners[j].x;
+			out[j * 3 + 1] = pos.y + h * mCorners[j].y;
+			out[j * 3 + 2] = pos.z + h * mCorners[j].z;
+		}
+	}
+
+	mCount = count;
+}
+
+void spriteBatch::build(sprite* const* sprites, unsigned int count)
+{
+	mCount = 0;
+	if (!count || !reserve(count))
+		return;
+
+	kAssert(sprites);
+
+	vec_t* x = mGather;
+	vec_t* y = x + mCapacity;
+	vec_t* z = y + mCapacity;
+	vec_t* radius = z + mCapacity;
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		const vector3& pos = sprites[i]->getPosition();
+
+		x[i] = pos.x;
+		y[i] = pos.y;
+		z[i] = pos.z;
+		radius[i] = sprites[i]->getRadius();
+	}
+
+	// Sprites radius are already converted
+	build(x, y, z, radius, count, vector3::zero, false);
 }
 
+void spriteBatch::draw()
+{
+	if (!mCount)
+		return;
+
+	renderSystem* rs = root::getSingleton().getRenderSystem();
+	const unsigned int verticesOffset = mCapacity * 8;
+
+	if (rs->getVBOSupport())
+	{
+		if (!mHaveVBO)
+		{
+			rs->genVBO(&mVBO);
+			mHaveVBO = true;
+		}
+
+		// All texture coordinates, then the vertices of mCount quads
+		rs->bindVBO(&mVBO, VBO_ARRAY);
+		rs->setVBOData(VBO_ARRAY, (verticesOffset + mCount * 12) * sizeof(vec_t), mBuffer, VBO_STREAM_DRAW);
+
+		rs->clearArrayDesc(VERTEXMODE_QUAD);
+		rs->setVBO(true);
+
+		rs->setVertexArray((unsigned int)(verticesOffset * sizeof(vec_t)));
+		rs->setVertexCount(mCount * 4);
+		rs->setTexCoordArray((unsigned int)0);
+
+		rs->drawArrays(true);
+
+		rs->setVBO(false);
+		rs->bindVBO(NULL, VBO_ARRAY);
+		return;
+	}
+
+	rs->clearArrayDesc(VERTEXMODE_QUAD);
+	rs->setVertexArray(mBuffer + verticesOffset);
+	rs->setVertexCount(mCount * 4);
+	rs->setTexCoordArray(mBuffer);
+	rs->drawArrays(true);
+}
+
+}
@@ -24,6 +24,7 @@ THE SOFTWARE.
 #include "logger.h"
 #include "resourceManager.h"
 #include "root.h"
+#include "workerPool.h"
 
 namespace k {
 
@@ -45,10 +46,45 @@ textureManager::textureManager()
 	#endif
 
 	mTextures.clear();
+
+	#ifdef __WII__
+	mAsyncLoading = false;
+	#else
+	mAsyncLoading = true;
+	#endif
+
+	mPendingLoads = 0;
+	mMemoryBudget = 0;
+	mMemoryUse = 0;
+	mFrame = 0;
+	mResidency.clear();
+
+	createKMutex(&mLoadMutex);
+	createKCondition(&mLoadCondition);
 }
 			
 textureManager::~textureManager()
 {
+	// Workers may still be decoding, wait before freeing anything
+	lockKMutex(&mLoadMutex);
+	while (mFinishedLoads.size() < mPendingLoads)
+		waitKCondition(&mLoadCondition, &mLoadMutex);
+	unlockKMutex(&mLoadMutex);
+
+	std::list<textureLoad_t*>::iterator lit;
+	for (lit = mFinishedLoads.begin(); lit != mFinishedLoads.end(); lit++)
+	{
+		textureLoad_t* load = (*lit);
+		if (load->data)
+			delete [] load->data;
+
+		delete load;
+	}
+
+	mFinishedLoads.clear();
+	destroyKCondition(&mLoadCondition);
+	destroyKMutex(&mLoadMutex);
+
 	std::map<int, texture*>::iterator it;
 	for (it = mTextures.begin(); it != mTextures.end(); ++it)
 	{
@@ -93,20 +129,245 @@ texture* textureManager::allocateTexture(const std::string& filename, int wrapBi
 	{
 		return newTexture;
 	}
-	else
+
+	#ifndef __WII__
+	// Decode on the workers, the placeholder is swapped on update()
+	workerPool* pool = root::getSingleton().getWorkerPool();
+	texture* placeholder = getTexture("k_base_null");
+	if (mAsyncLoading && pool && pool->getThreadsCount() && placeholder)
 	{
-		newTexture = new texture(fullPath, wrapBits);
-		if (newTexture)
+		try
 		{
-			mTextures[getHashKey(filename)] = newTexture;
-			return newTexture;
+			newTexture = new texture(placeholder, wrapBits);
 		}
+
+		catch (...)
+		{
+			S_LOG_INFO("Failed to allocate texture for " + fullPath + ".");
+			return NULL;
+		}
+
+		textureResidency_t residency;
+		residency.filename = fullPath;
+		residency.lastUsed = mFrame;
+		residency.failed = false;
+		residency.loading = _queueLoad(newTexture, fullPath);
+
+		mTextures[getHashKey(filename)] = newTexture;
+		mResidency[newTexture] = residency;
+		return newTexture;
+	}
+	#endif
+
+	newTexture = new texture(fullPath, wrapBits);
+	if (newTexture)
+	{
+		textureResidency_t residency;
+		residency.filename = fullPath;
+		residency.lastUsed = mFrame;
+		residency.loading = false;
+		residency.failed = !newTexture->getPointer();
+
+		mTextures[getHashKey(filename)] = newTexture;
+		mResidency[newTexture] = residency;
+		return newTexture;
 	}
 		
 	S_LOG_INFO("Failed to allocate texture data for " + fullPath + ".");
 	return NULL;
 }
 
+bool textureManager::_queueLoad(texture* target, const std::string& filename)
+{
+	kAssert(target);
+
+	workerPool* pool = root::getSingleton().getWorkerPool();
+	kAssert(pool);
+
+	textureLoad_t* load = NULL;
+	try
+	{
+		load = new textureLoad_t;
+	}
+
+	catch (...)
+	{
+		S_LOG_INFO("Failed to allocate texture load for " + filename + ".");
+		return false;
+	}
+
+	load->target = target;
+	load->filename = filename;
+	load->data = NULL;
+	load->width = load->height = 0;
+
+	lockKMutex(&mLoadMutex);
+	mPendingLoads++;
+	unlockKMutex(&mLoadMutex);
+
+	pool->pushBackgroundJob(decodeJob, load);
+	return true;
+}
+
+void textureManager::decodeJob(void* data)
+{
+	textureLoad_t* load = (textureLoad_t*) data;
+	kAssert(load);
+
+	#ifndef __WII__
+	load->data = texture::decodeFile(load->filename, &load->width, &load->height);
+	#endif
+
+	textureManager* self = &textureManager::getSingleton();
+	lockKMutex(&self->mLoadMutex);
+	self->mFinishedLoads.push_back(load);
+	broadcastKCondition(&self->mLoadCondition);
+	unlockKMutex(&self->mLoadMutex);
+}
+
+void textureManager::_finishLoads(bool wait)
+{
+	std::list<textureLoad_t*> finished;
+
+	lockKMutex(&mLoadMutex);
+	if (wait)
+	{
+		while (mFinishedLoads.size() < mPendingLoads)
+			waitKCondition(&mLoadCondition, &mLoadMutex);
+	}
+
+	finished.swap(mFinishedLoads);
+	mPendingLoads -= finished.size();
+	unlockKMutex(&mLoadMutex);
+
+	// Upload outside the lock, workers keep decoding
+	std::list<textureLoad_t*>::iterator it;
+	for (it = finished.begin(); it != finished.end(); it++)
+	{
+		textureLoad_t* load = (*it);
+
+		textureResidencyMap::iterator rit = mResidency.find(load->target);
+		if (rit != mResidency.end())
+		{
+			rit->second.loading = false;
+			rit->second.failed = !load->data;
+		}
+
+		if (load->data)
+		{
+			#ifndef __WII__
+			load->target->setData(load->data, load->width, load->height);
+			#endif
+			delete [] load->data;
+		}
+		else
+		{
+			// Keeps drawing the placeholder, like a missing file did
+			S_LOG_INFO("Failed to allocate texture data for " + load->filename + ".");
+		}
+
+		delete load;
+	}
+}
+
+unsigned int textureManager::getPendingLoads()
+{
+	lockKMutex(&mLoadMutex);
+	unsigned int pending = mPendingLoads;
+	unlockKMutex(&mLoadMutex);
+
+	return pending;
+}
+
+void textureManager::update()
+{
+	mFrame++;
+	_finishLoads(false);
+
+	#ifndef __WII__
+	unsigned long memoryUse = 0;
+
+	textureResidencyMap::iterator it;
+	for (it = mResidency.begin(); it != mResidency.end(); it++)
+	{
+		texture* tex = it->first;
+		textureResidency_t& residency = it->second;
+
+		// Bound during the last frame
+		if (tex->takeUsed())
+		{
+			residency.lastUsed = mFrame;
+			if (tex->isPending() && !residency.loading && !residency.failed)
+				_reload(tex, residency);
+		}
+
+		memoryUse += tex->getMemoryUse();
+	}
+
+	mMemoryUse = memoryUse;
+	if (mMemoryBudget && mMemoryUse > mMemoryBudget)
+		_evict();
+	#endif
+}
+
+void textureManager::_reload(texture* tex, textureResidency_t& residency)
+{
+	#ifndef __WII__
+	kAssert(tex);
+
+	workerPool* pool = root::getSingleton().getWorkerPool();
+	if (mAsyncLoading && pool && pool->getThreadsCount())
+	{
+		residency.loading = _queueLoad(tex, residency.filename);
+		return;
+	}
+
+	unsigned int width, height;
+	unsigned char* data = texture::decodeFile(residency.filename, &width, &height);
+	if (!data)
+	{
+		residency.failed = true;
+		return;
+	}
+
+	tex->setData(data, width, height);
+	delete [] data;
+	#endif
+}
+
+void textureManager::_evict()
+{
+	#ifndef __WII__
+	texture* placeholder = getTexture("k_base_null");
+	if (!placeholder)
+		return;
+
+	// Resident textures not bound last frame, oldest first
+	std::vector<std::pair<unsigned int, texture*> > candidates;
+	textureResidencyMap::iterator it;
+	for (it = mResidency.begin(); it != mResidency.end(); it++)
+	{
+		if (it->second.lastUsed < mFrame && it->first->getMemoryUse())
+			candidates.push_back(std::make_pair(it->second.lastUsed, it->first));
+	}
+
+	std::sort(candidates.begin(), candidates.end());
+
+	std::vector<std::pair<unsigned int, texture*> >::iterator cit;
+	for (cit = candidates.begin(); cit != candidates.end() && mMemoryUse > mMemoryBudget; cit++)
+	{
+		texture* tex = cit->second;
+		mMemoryUse -= tex->getMemoryUse();
+		tex->evict(placeholder);
+	}
+	#endif
+}
+
+void textureManager::flushLoads()
+{
+	_finishLoads(true);
+}
+
 void textureManager::createSystemTextures()
 {
 	// Register some basic textures (k_base_white, k_base_black, k_base_null)
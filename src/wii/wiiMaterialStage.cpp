@@ -44,7 +44,7 @@ void materialStage::draw()
 		return;
 
 	renderSystem* rs = root::getSingleton().getRenderSystem();
-	rs->bindTexture(getTexture((uint32_t)mCurrentFrame)->getPointer(), mIndex);
+	rs->bindTexture(getTexture((uint32_t)mCurrentFrame), mIndex);
 
 	switch (mCoordType)
 	{
@@ -55,12 +55,9 @@ void materialStage::draw()
 				kAssert(mIndex < 8);
 				static Mtx mTransRotate;
 
-				vec_t sinAngle = sin(mAngle);
-				vec_t cosAngle = cos(mAngle);
-				mAngle += mRotate * M_PI / 180.0f;
-
-				mScrolled.x += mScroll.x;
-				mScrolled.y += mScroll.y;
+				// Angle and scroll are evaluated once per frame
+				vec_t sinAngle = sin(mAngle * M_PI / 180.0f);
+				vec_t cosAngle = cos(mAngle * M_PI / 180.0f);
 
 				mTransRotate[0][0] = cosAngle * mScale.x;
 				mTransRotate[0][1] = -sinAngle;
@@ -173,8 +170,6 @@ void materialStage::draw()
 
 }
 
-void materialStage::finish() {}
-
 }
 
 #endif
@@ -862,6 +862,32 @@ void wiiRenderSystem::matSpecular(const color& color)
 	//TODO
 }
 
+void wiiRenderSystem::applyMaterialState(const materialState_t& state)
+{
+	// GX state is cheap to set, stages set their own tev and blending
+	matAmbient(state.ambient);
+	matDiffuse(state.diffuse);
+	matSpecular(state.specular);
+
+	setCulling(state.cull);
+	setDepthTest(state.depthTest);
+	setDepthMask(state.depthWrite);
+
+	// Color/Light Only
+	if (!state.stagesCount)
+	{
+		setColorChannels(0);
+		setTextureGenerations(0);
+		setTextureUnits(1);
+	}
+	else
+	{
+		setColorChannels(1);
+		setTextureGenerations(state.stagesCount);
+		setTextureUnits(state.stagesCount);
+	}
+}
+
 void wiiRenderSystem::bindTexture(GXTexObj* tex, int chan)
 {
 	kAssert(chan < MAX_WII_TEXTURES);
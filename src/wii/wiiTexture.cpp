@@ -88,6 +88,8 @@ texture::texture(const std::string& filename, int flags)
 	mFormat = 0;
 	mRawData = NULL;
 	mPointer = NULL;
+	mPending = false;
+	mUsed = false;
 
 	// Check if file exists
 	FILE* fileExist = fopen(filename.c_str(), "rb");
@@ -357,6 +359,8 @@ texture::texture(void* data, unsigned int w, unsigned int h, int flags, int form
 	mHeight = h;
 	mFormat = TEX_RGBA;
 	mFlags = flags;
+	mPending = false;
+	mUsed = false;
 
 	try
 	{
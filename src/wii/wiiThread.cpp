@@ -26,41 +26,71 @@ THE SOFTWARE.
 
 namespace k {
 
-void createplatformThread(platformThread* t, void* (*start)(void*), void* arg)
+void createKThread(platformThread* t, void* (*start)(void*), void* arg)
 {
 	LWP_CreateThread(t, start, arg, NULL, 0, 0);
 }
 
-void destroyplatformThread(platformThread* t)
+void destroyKThread(platformThread* t)
 {
 	LWP_SuspendThread(*t);
 }
 
-void joinplatformThread(platformThread* t)
+void joinKThread(platformThread* t)
 {
 	LWP_JoinThread(*t, NULL);
 }
 
-void createplatformMutex(platformMutex* m)
+void createKMutex(platformMutex* m)
 {
 	LWP_MutexInit(m, false);	
 }
 	
-void lockplatformMutex(platformMutex* m)
+void lockKMutex(platformMutex* m)
 {
 	LWP_MutexLock(*m);
 }
 
-void unlockplatformMutex(platformMutex* m)
+void unlockKMutex(platformMutex* m)
 {
 	LWP_MutexUnlock(*m);
 }
 
-void destroyplatformMutex(platformMutex* m)
+void destroyKMutex(platformMutex* m)
 {
 	LWP_MutexDestroy(*m);
 }
 
+void createKCondition(platformCondition* c)
+{
+	LWP_CondInit(c);
+}
+
+void waitKCondition(platformCondition* c, platformMutex* m)
+{
+	LWP_CondWait(*c, *m);
+}
+
+void signalKCondition(platformCondition* c)
+{
+	LWP_CondSignal(*c);
+}
+
+void broadcastKCondition(platformCondition* c)
+{
+	LWP_CondBroadcast(*c);
+}
+
+void destroyKCondition(platformCondition* c)
+{
+	LWP_CondDestroy(*c);
+}
+
+unsigned int getKProcessorsCount()
+{
+	return 1;
+}
+
 }
 
 #endif
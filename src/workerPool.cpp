@@ -0,0 +1,215 @@
+/*
+Copyright (c) 2008-2009 Rômulo Fernandes Machado <romulo@castorgroup.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "workerPool.h"
+#include "logger.h"
+
+namespace k {
+
+template<> workerPool* singleton<workerPool>::singleton_instance = 0;
+
+workerPool& workerPool::getSingleton()
+{  
+	kAssert(singleton_instance);
+	return (*singleton_instance);  
+}
+
+workerPool::workerPool(unsigned int threads)
+{
+	mThreads = NULL;
+	mThreadsCount = 0;
+	mPendingJobs = 0;
+	mRunning = true;
+	mJobs.clear();
+	mBackgroundJobs.clear();
+
+	createKMutex(&mMutex);
+	createKCondition(&mJobCondition);
+	createKCondition(&mDoneCondition);
+
+	// The thread calling wait() also works
+	if (!threads)
+		threads = getKProcessorsCount() - 1;
+
+	if (!threads)
+		return;
+
+	try
+	{
+		mThreads = new platformThread[threads];
+	}
+
+	catch (...)
+	{
+		S_LOG_INFO("Failed to allocate worker threads, jobs will run serially.");
+		return;
+	}
+
+	mThreadsCount = threads;
+	for (unsigned int i = 0; i < mThreadsCount; i++)
+		createKThread(&mThreads[i], workerLoop, this);
+
+	std::stringstream msg;
+	msg << "Worker pool started with " << mThreadsCount << " threads.";
+	S_LOG_INFO(msg.str());
+}
+
+workerPool::~workerPool()
+{
+	lockKMutex(&mMutex);
+	mRunning = false;
+	broadcastKCondition(&mJobCondition);
+	unlockKMutex(&mMutex);
+
+	for (unsigned int i = 0; i < mThreadsCount; i++)
+		joinKThread(&mThreads[i]);
+
+	if (mThreads)
+		delete [] mThreads;
+
+	destroyKCondition(&mDoneCondition);
+	destroyKCondition(&mJobCondition);
+	destroyKMutex(&mMutex);
+}
+
+void* workerPool::workerLoop(void* pool)
+{
+	workerPool* self = (workerPool*) pool;
+	kAssert(self);
+
+	lockKMutex(&self->mMutex);
+	while (true)
+	{
+		while (self->mRunning && self->mJobs.empty() && self->mBackgroundJobs.empty())
+			waitKCondition(&self->mJobCondition, &self->mMutex);
+
+		if (!self->mRunning)
+			break;
+
+		// Frame jobs first, someone may be waiting on them
+		if (!self->mJobs.empty())
+		{
+			job_t job = self->mJobs.front();
+			self->mJobs.pop_front();
+			unlockKMutex(&self->mMutex);
+
+			job.function(job.data);
+
+			lockKMutex(&self->mMutex);
+			self->finishJob();
+		}
+		else
+		{
+			job_t job = self->mBackgroundJobs.front();
+			self->mBackgroundJobs.pop_front();
+			unlockKMutex(&self->mMutex);
+
+			job.function(job.data);
+
+			lockKMutex(&self->mMutex);
+		}
+	}
+
+	unlockKMutex(&self->mMutex);
+	return NULL;
+}
+
+void workerPool::finishJob()
+{
+	// Must be called with mMutex locked
+	kAssert(mPendingJobs);
+
+	mPendingJobs--;
+	if (!mPendingJobs)
+		broadcastKCondition(&mDoneCondition);
+}
+
+void workerPool::pushJob(jobFunction function, void* data)
+{
+	kAssert(function);
+
+	// No workers, run it right now
+	if (!mThreadsCount)
+	{
+		function(data);
+		return;
+	}
+
+	job_t job;
+	job.function = function;
+	job.data = data;
+
+	lockKMutex(&mMutex);
+	mJobs.push_back(job);
+	mPendingJobs++;
+	signalKCondition(&mJobCondition);
+	unlockKMutex(&mMutex);
+}
+
+void workerPool::pushBackgroundJob(jobFunction function, void* data)
+{
+	kAssert(function);
+
+	if (!mThreadsCount)
+	{
+		function(data);
+		return;
+	}
+
+	job_t job;
+	job.function = function;
+	job.data = data;
+
+	lockKMutex(&mMutex);
+	mBackgroundJobs.push_back(job);
+	signalKCondition(&mJobCondition);
+	unlockKMutex(&mMutex);
+}
+
+void workerPool::wait()
+{
+	if (!mThreadsCount)
+		return;
+
+	lockKMutex(&mMutex);
+
+	// Help the workers while there are queued jobs
+	while (!mJobs.empty())
+	{
+		job_t job = mJobs.front();
+		mJobs.pop_front();
+		unlockKMutex(&mMutex);
+
+		job.function(job.data);
+
+		lockKMutex(&mMutex);
+		finishJob();
+	}
+
+	while (mPendingJobs)
+		waitKCondition(&mDoneCondition, &mMutex);
+
+	unlockKMutex(&mMutex);
+}
+
+}
+